@@ -0,0 +1,488 @@
+/*
+ * apex_batch.c
+ * Contains the parallel batch runner. Every worker thread owns a deque of
+ * job indices, pops work from its own bottom and steals from the top of the
+ * other deques once it runs dry. Each run gets its own APEX_CPU and its own
+ * output streams, so nothing mutable is shared between workers except the
+ * deques (a sweep shares its read-only code image).
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "apex_batch.h"
+#include "apex_checkpoint.h"
+#include "apex_cpu.h"
+#include "apex_macros.h"
+
+typedef struct APEX_Batch_Deque
+{
+    pthread_mutex_t lock;
+    int *items;     /* Job indices */
+    int top;        /* Next index to steal */
+    int bottom;     /* One past the next index the owner pops */
+} APEX_Batch_Deque;
+
+typedef struct APEX_Batch_Worker
+{
+    int id;
+    int num_workers;
+    APEX_Batch_Deque *deques;
+    APEX_Batch_Job *jobs;
+    const APEX_Batch_Config *cfg;
+} APEX_Batch_Worker;
+
+static double
+batch_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Pops the newest job of the worker's own deque, -1 if empty */
+static int
+deque_pop(APEX_Batch_Deque *dq)
+{
+    int job = -1;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top)
+    {
+        job = dq->items[--dq->bottom];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return job;
+}
+
+/* Takes the oldest job of another worker's deque, -1 if empty */
+static int
+deque_steal(APEX_Batch_Deque *dq)
+{
+    int job = -1;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top)
+    {
+        job = dq->items[dq->top++];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return job;
+}
+
+/* Opens the stage trace of a run, /dev/null when logs are not kept */
+static FILE *
+open_run_log(const APEX_Batch_Config *cfg, const int index,
+             const char *filename)
+{
+    const char *base = strrchr(filename, '/');
+    char path[4096];
+
+    if (!cfg->log_dir)
+    {
+        return fopen("/dev/null", "w");
+    }
+
+    snprintf(path, sizeof(path), "%s/%d_%s.log", cfg->log_dir, index,
+             base ? base + 1 : filename);
+    return fopen(path, "w");
+}
+
+/* Simulates one program and fills in its results */
+static void
+run_job(APEX_Batch_Job *job, const int index, const APEX_Batch_Config *cfg)
+{
+    APEX_CPU *cpu;
+    FILE *out;
+    double start = batch_seconds();
+
+    /* Nothing is printed per cycle unless the trace is kept */
+    const int log_level = cfg->log_dir ? APEX_LOG_FULL : APEX_LOG_QUIET;
+
+    job->status = BATCH_STATUS_ERROR;
+
+    out = open_run_log(cfg, index, job->filename);
+    if (!out)
+    {
+        return;
+    }
+
+    if (cfg->code_memory)
+    {
+        cpu = APEX_cpu_init_shared(cfg->code_memory, cfg->decoded,
+                                   cfg->code_memory_size, "simulate", out,
+                                   stderr, log_level);
+    }
+    else
+    {
+        cpu = APEX_cpu_init_with_output(job->filename, "simulate", out, stderr,
+                                        log_level);
+    }
+
+    if (cpu && APEX_cpu_configure(cpu, &job->config) != 0)
+    {
+        /* Cache geometry of this configuration is not valid */
+        APEX_cpu_stop(cpu);
+        cpu = NULL;
+    }
+
+    if (cpu)
+    {
+        job->status = APEX_cpu_run(cpu, cfg->cycles) ? BATCH_STATUS_HALTED
+                                                     : BATCH_STATUS_CYCLE_LIMIT;
+        if (cpu->data_memory.fault)
+        {
+            job->status = BATCH_STATUS_FAULT;
+        }
+        job->cycles = cpu->clock;
+        job->instructions = cpu->insn_completed;
+        job->zero_flag = cpu->zero_flag;
+        memcpy(job->regs, cpu->regs, sizeof(job->regs));
+        job->memory_hash = APEX_checkpoint_data_hash(cpu);
+        APEX_cpu_stop(cpu);
+    }
+
+    fclose(out);
+    job->seconds = batch_seconds() - start;
+}
+
+static void *
+worker_main(void *arg)
+{
+    APEX_Batch_Worker *w = arg;
+    int job, victim;
+
+    while (TRUE)
+    {
+        job = deque_pop(&w->deques[w->id]);
+
+        /* Own deque is empty, look for work elsewhere */
+        for (victim = 1; job < 0 && victim < w->num_workers; ++victim)
+        {
+            job = deque_steal(&w->deques[(w->id + victim) % w->num_workers]);
+        }
+
+        /* Jobs are never added while running, so no work means done */
+        if (job < 0)
+        {
+            break;
+        }
+
+        run_job(&w->jobs[job], job, w->cfg);
+    }
+    return NULL;
+}
+
+/*
+ * Reads a list of program files, one per line. Empty lines and lines starting
+ * with '#' are skipped.
+ *
+ * Returns NULL if the list can't be read or holds no program
+ */
+APEX_Batch_Job *
+APEX_batch_read_list(const char *filename, int *num_jobs)
+{
+    APEX_Batch_Job *jobs = NULL, *grown;
+    FILE *fp;
+    ssize_t nread;
+    size_t len = 0;
+    char *line = NULL;
+    int count = 0, capacity = 0;
+
+    *num_jobs = 0;
+    fp = fopen(filename, "r");
+    if (!fp)
+    {
+        return NULL;
+    }
+
+    while ((nread = getline(&line, &len, fp)) != -1)
+    {
+        while (nread > 0 && (line[nread - 1] == '\n' || line[nread - 1] == '\r'
+                             || line[nread - 1] == ' '))
+        {
+            line[--nread] = '\0';
+        }
+        if (nread == 0 || line[0] == '#')
+        {
+            continue;
+        }
+
+        if (count == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 16;
+            grown = realloc(jobs, capacity * sizeof(APEX_Batch_Job));
+            if (!grown)
+            {
+                break;
+            }
+            jobs = grown;
+        }
+
+        memset(&jobs[count], 0, sizeof(APEX_Batch_Job));
+        jobs[count].filename = strdup(line);
+        APEX_cpu_default_config(&jobs[count].config);
+        count++;
+    }
+
+    free(line);
+    fclose(fp);
+
+    if (!count)
+    {
+        free(jobs);
+        return NULL;
+    }
+
+    *num_jobs = count;
+    return jobs;
+}
+
+void
+APEX_batch_free(APEX_Batch_Job *jobs, const int num_jobs)
+{
+    int i;
+
+    for (i = 0; i < num_jobs; ++i)
+    {
+        free(jobs[i].filename);
+    }
+    free(jobs);
+}
+
+/*
+ * Runs every job on a pool of worker threads. Jobs are dealt round-robin to
+ * the workers up front; idle workers steal from the others.
+ *
+ * Returns the number of worker threads used, -1 on failure
+ */
+int
+APEX_batch_run(APEX_Batch_Job *jobs, const int num_jobs,
+               const APEX_Batch_Config *cfg)
+{
+    APEX_Batch_Deque *deques;
+    APEX_Batch_Worker *workers;
+    pthread_t *threads;
+    int num_workers = cfg->threads;
+    int i, started = 0;
+
+    if (num_workers <= 0)
+    {
+        num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (num_workers > num_jobs)
+    {
+        num_workers = num_jobs;
+    }
+    if (num_workers <= 0)
+    {
+        num_workers = 1;
+    }
+
+    deques = calloc(num_workers, sizeof(APEX_Batch_Deque));
+    workers = calloc(num_workers, sizeof(APEX_Batch_Worker));
+    threads = calloc(num_workers, sizeof(pthread_t));
+    if (!deques || !workers || !threads)
+    {
+        free(deques);
+        free(workers);
+        free(threads);
+        return -1;
+    }
+
+    for (i = 0; i < num_workers; ++i)
+    {
+        pthread_mutex_init(&deques[i].lock, NULL);
+        deques[i].items = calloc(num_jobs / num_workers + 1, sizeof(int));
+        workers[i].id = i;
+        workers[i].num_workers = num_workers;
+        workers[i].deques = deques;
+        workers[i].jobs = jobs;
+        workers[i].cfg = cfg;
+    }
+
+    /* Deal in reverse so every worker pops its jobs in list order */
+    for (i = num_jobs - 1; i >= 0; --i)
+    {
+        APEX_Batch_Deque *dq = &deques[i % num_workers];
+
+        dq->items[dq->bottom++] = i;
+    }
+
+    for (i = 0; i < num_workers; ++i)
+    {
+        if (pthread_create(&threads[i], NULL, worker_main, &workers[i]) != 0)
+        {
+            break;
+        }
+        started++;
+    }
+
+    /* Whatever a failed thread would have run is stolen by the others */
+    if (!started)
+    {
+        worker_main(&workers[0]);
+    }
+
+    for (i = 0; i < started; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (i = 0; i < num_workers; ++i)
+    {
+        pthread_mutex_destroy(&deques[i].lock);
+        free(deques[i].items);
+    }
+    free(deques);
+    free(workers);
+    free(threads);
+    return started ? started : 1;
+}
+
+const char *
+APEX_batch_status_name(const int status)
+{
+    switch (status)
+    {
+        case BATCH_STATUS_HALTED:
+            return "halted";
+        case BATCH_STATUS_CYCLE_LIMIT:
+            return "cycle_limit";
+        case BATCH_STATUS_ERROR:
+            return "error";
+        case BATCH_STATUS_FAULT:
+            return "memory_fault";
+    }
+    return "pending";
+}
+
+/* Writes s as a JSON string literal */
+static void
+print_json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; ++s)
+    {
+        if (*s == '"' || *s == '\\')
+        {
+            fputc('\\', fp);
+            fputc(*s, fp);
+        }
+        else if ((unsigned char)*s < 0x20)
+        {
+            fprintf(fp, "\\u%04x", *s);
+        }
+        else
+        {
+            fputc(*s, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+/* Writes s as a quoted CSV field, a '"' in it is doubled */
+static void
+print_csv_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; ++s)
+    {
+        if (*s == '"')
+        {
+            fputc('"', fp);
+        }
+        fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+static void
+print_csv(const APEX_Batch_Job *jobs, const int num_jobs, FILE *fp)
+{
+    int i, r;
+
+    fprintf(fp, "program,status,cycles,instructions,cpi,zero_flag");
+    for (r = 0; r < REG_FILE_SIZE; ++r)
+    {
+        fprintf(fp, ",R%d", r);
+    }
+    fprintf(fp, ",memory_hash,seconds\n");
+
+    for (i = 0; i < num_jobs; ++i)
+    {
+        const APEX_Batch_Job *job = &jobs[i];
+
+        print_csv_string(fp, job->filename);
+        fprintf(fp, ",%s,%d,%d,%.4f,%d",
+                APEX_batch_status_name(job->status), job->cycles,
+                job->instructions,
+                job->instructions ? (double)job->cycles / job->instructions
+                                  : 0.0,
+                job->zero_flag);
+        for (r = 0; r < REG_FILE_SIZE; ++r)
+        {
+            fprintf(fp, ",%d", job->regs[r]);
+        }
+        fprintf(fp, ",%016llx,%.6f\n", (unsigned long long)job->memory_hash,
+                job->seconds);
+    }
+}
+
+static void
+print_json(const APEX_Batch_Job *jobs, const int num_jobs, FILE *fp)
+{
+    long total_cycles = 0, total_insns = 0;
+    int i, r, halted = 0, errors = 0;
+
+    fprintf(fp, "{\n  \"runs\": [\n");
+    for (i = 0; i < num_jobs; ++i)
+    {
+        const APEX_Batch_Job *job = &jobs[i];
+
+        fprintf(fp, "    {\"program\": ");
+        print_json_string(fp, job->filename);
+        fprintf(fp, ", \"status\": \"%s\", \"cycles\": %d, "
+                "\"instructions\": %d, \"zero_flag\": %d,\n",
+                APEX_batch_status_name(job->status), job->cycles,
+                job->instructions, job->zero_flag);
+        fprintf(fp, "     \"regs\": [");
+        for (r = 0; r < REG_FILE_SIZE; ++r)
+        {
+            fprintf(fp, "%s%d", r ? ", " : "", job->regs[r]);
+        }
+        fprintf(fp, "],\n     \"memory_hash\": \"%016llx\", \"seconds\": %.6f}%s\n",
+                (unsigned long long)job->memory_hash, job->seconds,
+                i + 1 < num_jobs ? "," : "");
+
+        total_cycles += job->cycles;
+        total_insns += job->instructions;
+        halted += job->status == BATCH_STATUS_HALTED;
+        errors += job->status == BATCH_STATUS_ERROR;
+    }
+    fprintf(fp, "  ],\n");
+    fprintf(fp, "  \"summary\": {\"programs\": %d, \"halted\": %d, "
+            "\"errors\": %d, \"cycles\": %ld, \"instructions\": %ld}\n}\n",
+            num_jobs, halted, errors, total_cycles, total_insns);
+}
+
+/*
+ * Prints the results of all jobs, in list order, as JSON or (csv set) CSV
+ */
+void
+APEX_batch_report(const APEX_Batch_Job *jobs, const int num_jobs, FILE *fp,
+                  const int csv)
+{
+    if (csv)
+    {
+        print_csv(jobs, num_jobs, fp);
+    }
+    else
+    {
+        print_json(jobs, num_jobs, fp);
+    }
+}
@@ -0,0 +1,54 @@
+/*
+ * apex_batch.h
+ * Contains declarations of the batch runner, which simulates many programs
+ * in parallel on a pool of host threads and collects one report
+ */
+#ifndef _APEX_BATCH_H_
+#define _APEX_BATCH_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "apex_cpu.h"
+#include "apex_macros.h"
+
+/* Outcome of one run */
+#define BATCH_STATUS_PENDING 0
+#define BATCH_STATUS_HALTED 1      /* HALT retired */
+#define BATCH_STATUS_CYCLE_LIMIT 2 /* Stopped at the cycle limit */
+#define BATCH_STATUS_ERROR 3       /* Program could not be loaded */
+#define BATCH_STATUS_FAULT 4       /* Accessed a word outside data memory */
+
+typedef struct APEX_Batch_Job
+{
+    char *filename;
+    APEX_Pipeline_Config config; /* Timing to simulate the program with */
+    int status;
+    int cycles;
+    int instructions;
+    int zero_flag;
+    int regs[REG_FILE_SIZE];
+    uint64_t memory_hash;  /* APEX_checkpoint_data_hash of the final memory */
+    double seconds;        /* Host time spent on the run */
+} APEX_Batch_Job;
+
+typedef struct APEX_Batch_Config
+{
+    int threads;          /* Worker threads, 0 = one per online host core */
+    int cycles;           /* Cycle limit of every run */
+    const char *log_dir;  /* Per-run stage traces go here, NULL to drop them */
+
+    /* When set, every job runs this already parsed program */
+    APEX_Instruction *code_memory;
+    APEX_Decoded *decoded;
+    int code_memory_size;
+} APEX_Batch_Config;
+
+APEX_Batch_Job *APEX_batch_read_list(const char *filename, int *num_jobs);
+void APEX_batch_free(APEX_Batch_Job *jobs, const int num_jobs);
+int APEX_batch_run(APEX_Batch_Job *jobs, const int num_jobs,
+                   const APEX_Batch_Config *cfg);
+const char *APEX_batch_status_name(const int status);
+void APEX_batch_report(const APEX_Batch_Job *jobs, const int num_jobs,
+                       FILE *fp, const int csv);
+#endif
@@ -0,0 +1,419 @@
+/*
+ * apex_bpred.c
+ * Contains the branch predictors. Fetch asks for the next PC of every BZ/BNZ
+ * it brings in and shifts the predicted direction into the global history
+ * right away; execute resolves the branch and the predictor is trained with
+ * the history the prediction was made with, which is also where the history
+ * is repaired after a misprediction.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_bpred.h"
+#include "apex_macros.h"
+
+/* Weakly not taken, a cold predictor fetches like the original pipeline */
+#define COUNTER_INIT 1
+
+static int
+is_power_of_two(const int n)
+{
+    return n > 0 && (n & (n - 1)) == 0;
+}
+
+static int
+log2_of(int n)
+{
+    int shift = 0;
+
+    while (n > 1)
+    {
+        n >>= 1;
+        shift++;
+    }
+    return shift;
+}
+
+/*
+ * Sets up a predictor with every counter weakly not taken and an empty BTB.
+ * BPRED_NONE needs no tables.
+ *
+ * Returns 0 on success, -1 if the configuration is not valid
+ */
+int
+APEX_bpred_init(APEX_Bpred *bp, const APEX_Bpred_Config *config)
+{
+    int i;
+
+    memset(bp, 0, sizeof(APEX_Bpred));
+    bp->config = *config;
+
+    if (config->kind == BPRED_NONE)
+    {
+        return 0;
+    }
+
+    if (config->kind < BPRED_NONE || config->kind > BPRED_TAGE
+        || !is_power_of_two(config->size) || config->size < 16
+        || config->history < 0 || config->history > BPRED_MAX_HISTORY
+        || !is_power_of_two(config->btb_size))
+    {
+        return -1;
+    }
+
+    bp->history_mask = config->history == BPRED_MAX_HISTORY
+                       ? ~0u : (1u << config->history) - 1;
+    bp->counters = malloc(config->size);
+    bp->btb = calloc(config->btb_size, sizeof(APEX_Btb_Entry));
+    if (config->kind == BPRED_TAGE)
+    {
+        /* Each tagged table has a quarter of the entries of the base */
+        bp->tagged_bits = log2_of(config->size) - 2;
+        bp->tagged = calloc((size_t)TAGE_TABLES << bp->tagged_bits,
+                            sizeof(APEX_Tage_Entry));
+        for (i = 0; i < TAGE_TABLES; ++i)
+        {
+            bp->lengths[i] = config->history >> (TAGE_TABLES - 1 - i);
+            if (bp->lengths[i] < 1)
+            {
+                bp->lengths[i] = 1;
+            }
+        }
+    }
+
+    if (!bp->counters || !bp->btb
+        || (config->kind == BPRED_TAGE && !bp->tagged))
+    {
+        APEX_bpred_free(bp);
+        return -1;
+    }
+    memset(bp->counters, COUNTER_INIT, config->size);
+    return 0;
+}
+
+void
+APEX_bpred_free(APEX_Bpred *bp)
+{
+    free(bp->counters);
+    free(bp->tagged);
+    free(bp->btb);
+    bp->counters = NULL;
+    bp->tagged = NULL;
+    bp->btb = NULL;
+}
+
+/* Oldest length bits of history xor folded down to bits bits */
+static unsigned int
+fold_history(unsigned int history, const int length, const int bits)
+{
+    unsigned int folded = 0;
+
+    if (length < BPRED_MAX_HISTORY)
+    {
+        history &= (1u << length) - 1;
+    }
+    while (history)
+    {
+        folded ^= history & ((1u << bits) - 1);
+        history >>= bits;
+    }
+    return folded;
+}
+
+/* Entry of tagged table table for the branch at pc */
+static APEX_Tage_Entry *
+tage_entry(const APEX_Bpred *bp, const int table, const unsigned int pc,
+           const unsigned int history)
+{
+    const unsigned int index
+        = (pc ^ fold_history(history, bp->lengths[table], bp->tagged_bits))
+          & ((1u << bp->tagged_bits) - 1);
+
+    return &bp->tagged[((size_t)table << bp->tagged_bits) + index];
+}
+
+/* Tag of the branch at pc in table, never 0 */
+static unsigned int
+tage_tag(const APEX_Bpred *bp, const int table, const unsigned int pc,
+         const unsigned int history)
+{
+    const int length = bp->lengths[table];
+    const unsigned int hash = pc ^ fold_history(history, length, TAGE_TAG_BITS)
+                              ^ (fold_history(history, length,
+                                              TAGE_TAG_BITS - 1) << 1);
+
+    return (hash & ((1u << TAGE_TAG_BITS) - 1)) | (1u << TAGE_TAG_BITS);
+}
+
+/*
+ * Longest history tagged table that holds the branch, -1 if none. The entry
+ * of every table is returned in entries.
+ */
+static int
+tage_provider(const APEX_Bpred *bp, const unsigned int pc,
+              const unsigned int history,
+              APEX_Tage_Entry *entries[TAGE_TABLES], int *alt_taken)
+{
+    const int base_taken = bp->counters[pc & (bp->config.size - 1)] >= 2;
+    int table, provider = -1;
+
+    *alt_taken = base_taken;
+    for (table = TAGE_TABLES - 1; table >= 0; --table)
+    {
+        entries[table] = tage_entry(bp, table, pc, history);
+        if (entries[table]->tag != tage_tag(bp, table, pc, history))
+        {
+            continue;
+        }
+        if (provider < 0)
+        {
+            provider = table;
+        }
+        else
+        {
+            /* Next longest match is the alternate prediction */
+            *alt_taken = entries[table]->counter >= 0;
+            break;
+        }
+    }
+    return provider;
+}
+
+/* Direction the tables predict for the branch at word address pc */
+static int
+predict_taken(const APEX_Bpred *bp, const unsigned int pc,
+              const unsigned int history)
+{
+    APEX_Tage_Entry *entries[TAGE_TABLES];
+    int provider, alt_taken;
+
+    switch (bp->config.kind)
+    {
+        case BPRED_GSHARE:
+            return bp->counters[(pc ^ (history & bp->history_mask))
+                                & (bp->config.size - 1)] >= 2;
+
+        case BPRED_TAGE:
+        {
+            provider = tage_provider(bp, pc, history, entries, &alt_taken);
+            return provider < 0 ? alt_taken : entries[provider]->counter >= 0;
+        }
+    }
+    return bp->counters[pc & (bp->config.size - 1)] >= 2;
+}
+
+static void
+train_counter(unsigned char *counter, const int taken)
+{
+    if (taken && *counter < 3)
+    {
+        (*counter)++;
+    }
+    else if (!taken && *counter > 0)
+    {
+        (*counter)--;
+    }
+}
+
+/*
+ * TAGE-lite update: the provider (or the base table) learns the outcome, its
+ * useful bits follow whether it beat the alternate prediction, and a
+ * misprediction allocates an entry in one longer history table
+ */
+static void
+train_tage(APEX_Bpred *bp, const unsigned int pc, const unsigned int history,
+           const int taken)
+{
+    APEX_Tage_Entry *entries[TAGE_TABLES];
+    APEX_Tage_Entry *entry;
+    int provider, alt_taken, predicted, table;
+
+    provider = tage_provider(bp, pc, history, entries, &alt_taken);
+    if (provider < 0)
+    {
+        predicted = alt_taken;
+        train_counter(&bp->counters[pc & (bp->config.size - 1)], taken);
+    }
+    else
+    {
+        entry = entries[provider];
+        predicted = entry->counter >= 0;
+        if (predicted != alt_taken)
+        {
+            if (predicted == taken && entry->useful < 3)
+            {
+                entry->useful++;
+            }
+            else if (predicted != taken && entry->useful > 0)
+            {
+                entry->useful--;
+            }
+        }
+        if (taken && entry->counter < 3)
+        {
+            entry->counter++;
+        }
+        else if (!taken && entry->counter > -4)
+        {
+            entry->counter--;
+        }
+    }
+
+    if (predicted == taken)
+    {
+        return;
+    }
+
+    for (table = provider + 1; table < TAGE_TABLES; ++table)
+    {
+        if (entries[table]->useful == 0)
+        {
+            entries[table]->tag = tage_tag(bp, table, pc, history);
+            entries[table]->counter = taken ? 0 : -1;
+            return;
+        }
+    }
+
+    /* No room, age the longer entries so that one frees up later */
+    for (table = provider + 1; table < TAGE_TABLES; ++table)
+    {
+        entries[table]->useful--;
+    }
+}
+
+/*
+ * Predicts the BZ/BNZ fetched from pc. A branch predicted taken is only
+ * redirected when the BTB knows its target. The global history the
+ * prediction was made with is returned in history (to be handed back to
+ * APEX_bpred_update), the redirection is shifted into the live history.
+ *
+ * Returns the PC fetch continues at
+ */
+int
+APEX_bpred_predict(APEX_Bpred *bp, const int pc, unsigned int *history)
+{
+    const APEX_Btb_Entry *btb;
+    int next_pc = pc + 4;
+
+    *history = bp->history;
+    if (bp->config.kind == BPRED_NONE)
+    {
+        return next_pc;
+    }
+
+    if (predict_taken(bp, (unsigned int)pc >> 2, bp->history))
+    {
+        btb = &bp->btb[(pc >> 2) & (bp->config.btb_size - 1)];
+        if (btb->pc == pc)
+        {
+            next_pc = btb->target;
+        }
+        else
+        {
+            bp->btb_misses++;
+        }
+    }
+
+    bp->history = ((bp->history << 1) | (next_pc != pc + 4))
+                  & bp->history_mask;
+    return next_pc;
+}
+
+/*
+ * Trains the predictor with the outcome of the branch at pc, predicted with
+ * global history history. After a misprediction the live history is rebuilt
+ * from that one, the younger (wrong path) branches are gone.
+ */
+void
+APEX_bpred_update(APEX_Bpred *bp, const int pc, const unsigned int history,
+                  const int taken, const int target, const int mispredicted)
+{
+    const unsigned int word = (unsigned int)pc >> 2;
+    APEX_Btb_Entry *btb;
+
+    if (bp->config.kind == BPRED_NONE)
+    {
+        return;
+    }
+
+    bp->branches++;
+    bp->taken += taken;
+    bp->mispredicts += mispredicted;
+
+    switch (bp->config.kind)
+    {
+        case BPRED_BIMODAL:
+            train_counter(&bp->counters[word & (bp->config.size - 1)], taken);
+            break;
+
+        case BPRED_GSHARE:
+            train_counter(&bp->counters[(word ^ (history & bp->history_mask))
+                                        & (bp->config.size - 1)], taken);
+            break;
+
+        case BPRED_TAGE:
+            train_tage(bp, word, history, taken);
+            break;
+    }
+
+    if (taken)
+    {
+        btb = &bp->btb[word & (bp->config.btb_size - 1)];
+        btb->pc = pc;
+        btb->target = target;
+    }
+
+    if (mispredicted)
+    {
+        bp->history = ((history << 1) | (taken != 0)) & bp->history_mask;
+    }
+}
+
+const char *
+APEX_bpred_name(const int kind)
+{
+    switch (kind)
+    {
+        case BPRED_BIMODAL:
+            return "bimodal";
+        case BPRED_GSHARE:
+            return "gshare";
+        case BPRED_TAGE:
+            return "tage";
+    }
+    return "none";
+}
+
+/*
+ * Prints the configuration and accuracy of bp. Every misprediction flushes
+ * the pipeline for flush_cycles cycles, the original always-not-taken fetch
+ * flushed on every taken branch; the difference is the cycles recovered.
+ */
+void
+APEX_bpred_print_stats(const APEX_Bpred *bp, const long instructions,
+                       const int flush_cycles, FILE *fp)
+{
+    const APEX_Bpred_Config *config = &bp->config;
+
+    if (config->kind == BPRED_NONE)
+    {
+        return;
+    }
+
+    fprintf(fp, "\n ============== BRANCH PREDICTOR ============= \n");
+    fprintf(fp, "Predictor = %s | Table = %d | History = %d bits | BTB = %d\n",
+            APEX_bpred_name(config->kind), config->size,
+            config->kind == BPRED_BIMODAL ? 0 : config->history,
+            config->btb_size);
+    fprintf(fp, "Branches = %ld | Taken = %ld | Mispredicted = %ld | "
+            "Accuracy = %.2f%% | MPKI = %.2f\n",
+            bp->branches, bp->taken, bp->mispredicts,
+            bp->branches
+            ? 100.0 * (bp->branches - bp->mispredicts) / bp->branches : 0.0,
+            instructions ? 1000.0 * bp->mispredicts / instructions : 0.0);
+    fprintf(fp, "BTB misses = %ld | Flushes = %ld (always not taken: %ld) | "
+            "Cycles recovered = %ld\n",
+            bp->btb_misses, bp->mispredicts, bp->taken,
+            (bp->taken - bp->mispredicts) * flush_cycles);
+}
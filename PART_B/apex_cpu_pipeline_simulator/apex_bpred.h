@@ -0,0 +1,74 @@
+/*
+ * apex_bpred.h
+ * Contains declarations of the branch predictors consulted by fetch for
+ * BZ/BNZ: a direction predictor (bimodal, gshare or TAGE-lite) and a branch
+ * target buffer. Branches are resolved, and the predictor trained, in
+ * execute.
+ */
+#ifndef _APEX_BPRED_H_
+#define _APEX_BPRED_H_
+
+#include <stdio.h>
+
+/* Direction predictors */
+#define BPRED_NONE 0    /* Always not taken, the original APEX fetch */
+#define BPRED_BIMODAL 1 /* 2 bit counters indexed by PC */
+#define BPRED_GSHARE 2  /* 2 bit counters indexed by PC xor global history */
+#define BPRED_TAGE 3    /* Bimodal base plus tagged tables of longer history */
+
+/* Tagged tables of TAGE-lite, history lengths grow geometrically */
+#define TAGE_TABLES 4
+#define TAGE_TAG_BITS 8
+
+/* Longest global history, it is kept in one word */
+#define BPRED_MAX_HISTORY 32
+
+/* Predictor of APEX_Pipeline_Config */
+typedef struct APEX_Bpred_Config
+{
+    int kind;     /* BPRED_* */
+    int size;     /* Counters of the PC indexed table, a power of two */
+    int history;  /* Global history bits of gshare and TAGE */
+    int btb_size; /* Entries of the branch target buffer, a power of two */
+} APEX_Bpred_Config;
+
+typedef struct APEX_Tage_Entry
+{
+    unsigned short tag;  /* Partial tag, 0 = never allocated */
+    signed char counter; /* -4..3, taken when >= 0 */
+    unsigned char useful;
+} APEX_Tage_Entry;
+
+typedef struct APEX_Btb_Entry
+{
+    int pc;     /* Branch the entry belongs to, 0 = empty (code starts at 4000) */
+    int target;
+} APEX_Btb_Entry;
+
+typedef struct APEX_Bpred
+{
+    APEX_Bpred_Config config;
+    unsigned char *counters;  /* 2 bit counters, also the base of TAGE */
+    APEX_Tage_Entry *tagged;  /* TAGE_TABLES tables, table major */
+    int tagged_bits;          /* Index bits of one tagged table */
+    int lengths[TAGE_TABLES]; /* History bits of each tagged table */
+    APEX_Btb_Entry *btb;
+    unsigned int history;     /* Speculative global history, youngest in bit 0 */
+    unsigned int history_mask;
+
+    long branches;            /* Branches resolved in execute */
+    long taken;
+    long mispredicts;         /* Resolved to another PC than fetch went on to */
+    long btb_misses;          /* Predicted taken without a known target */
+} APEX_Bpred;
+
+int APEX_bpred_init(APEX_Bpred *bp, const APEX_Bpred_Config *config);
+void APEX_bpred_free(APEX_Bpred *bp);
+int APEX_bpred_predict(APEX_Bpred *bp, const int pc, unsigned int *history);
+void APEX_bpred_update(APEX_Bpred *bp, const int pc,
+                       const unsigned int history, const int taken,
+                       const int target, const int mispredicted);
+void APEX_bpred_print_stats(const APEX_Bpred *bp, const long instructions,
+                            const int flush_cycles, FILE *fp);
+const char *APEX_bpred_name(const int kind);
+#endif
@@ -0,0 +1,556 @@
+/*
+ * apex_cache.c
+ * Contains the set-associative cache timing model used for the L1 data and
+ * instruction caches. Only tags, valid and dirty bits are modelled; an
+ * access returns the number of cycles it takes and updates the hit/miss
+ * counters. A prefetcher (next line, PC stride or stream) watches the
+ * accesses and brings lines in ahead of them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_cache.h"
+#include "apex_macros.h"
+
+static int
+is_power_of_two(const int n)
+{
+    return n > 0 && (n & (n - 1)) == 0;
+}
+
+static int
+log2_of(int n)
+{
+    int shift = 0;
+
+    while (n > 1)
+    {
+        n >>= 1;
+        shift++;
+    }
+    return shift;
+}
+
+/*
+ * Sets up an empty (all invalid) cache. A config with size 0 leaves the
+ * cache disabled.
+ *
+ * Returns 0 on success, -1 if the geometry is not valid
+ */
+int
+APEX_cache_init(APEX_Cache *cache, const APEX_Cache_Config *config)
+{
+    memset(cache, 0, sizeof(APEX_Cache));
+    cache->config = *config;
+
+    if (config->size == 0)
+    {
+        return 0;
+    }
+
+    /* Sets and lines are found by masking, PLRU keeps ways - 1 tree bits */
+    if (!is_power_of_two(config->line_size) || config->line_size < 4
+        || config->ways < 1 || config->size % (config->line_size * config->ways)
+        || !is_power_of_two(config->size / (config->line_size * config->ways))
+        || (config->policy == CACHE_POLICY_PLRU
+            && (!is_power_of_two(config->ways) || config->ways > 32))
+        || config->policy < CACHE_POLICY_LRU
+        || config->policy > CACHE_POLICY_RANDOM
+        || config->prefetch < CACHE_PREFETCH_NONE
+        || config->prefetch > CACHE_PREFETCH_STREAM
+        || config->prefetch_degree < 1
+        || config->prefetch_degree > CACHE_MAX_PREFETCH_DEGREE
+        || config->prefetch_distance < 1
+        || config->hit_latency < 1 || config->miss_latency < 0)
+    {
+        return -1;
+    }
+
+    cache->num_sets = config->size / (config->line_size * config->ways);
+    cache->line_shift = log2_of(config->line_size);
+    cache->lines = calloc((size_t)cache->num_sets * config->ways,
+                          sizeof(APEX_Cache_Line));
+    cache->plru = calloc(cache->num_sets, sizeof(unsigned int));
+    cache->random = 2463534242u;
+    if (!cache->lines || !cache->plru)
+    {
+        APEX_cache_free(cache);
+        return -1;
+    }
+    return 0;
+}
+
+void
+APEX_cache_free(APEX_Cache *cache)
+{
+    free(cache->lines);
+    free(cache->plru);
+    cache->lines = NULL;
+    cache->plru = NULL;
+    cache->num_sets = 0;
+}
+
+/*
+ * Tree PLRU: node n (1 based, heap order) has its bit at position n, a set
+ * bit sends the victim search to the right child. Using a way turns every
+ * bit on its path away from it.
+ */
+static void
+plru_touch(unsigned int *bits, const int ways, const int way)
+{
+    int node = way + ways;
+
+    while (node > 1)
+    {
+        if (node & 1)
+        {
+            *bits &= ~(1u << (node >> 1));
+        }
+        else
+        {
+            *bits |= 1u << (node >> 1);
+        }
+        node >>= 1;
+    }
+}
+
+static int
+plru_victim(const unsigned int bits, const int ways)
+{
+    int node = 1;
+
+    while (node < ways)
+    {
+        node = 2 * node + ((bits >> node) & 1);
+    }
+    return node - ways;
+}
+
+/* Way of set to refill, an invalid one if there is any */
+static int
+choose_victim(APEX_Cache *cache, const APEX_Cache_Line *set, const int index)
+{
+    const int ways = cache->config.ways;
+    int way, victim = 0;
+
+    for (way = 0; way < ways; ++way)
+    {
+        if (!set[way].valid)
+        {
+            return way;
+        }
+    }
+
+    switch (cache->config.policy)
+    {
+        case CACHE_POLICY_PLRU:
+        {
+            return plru_victim(cache->plru[index], ways);
+        }
+
+        case CACHE_POLICY_RANDOM:
+        {
+            cache->random ^= cache->random << 13;
+            cache->random ^= cache->random >> 17;
+            cache->random ^= cache->random << 5;
+            return cache->random % ways;
+        }
+    }
+
+    for (way = 1; way < ways; ++way)
+    {
+        if (set[way].last_use < set[victim].last_use)
+        {
+            victim = way;
+        }
+    }
+    return victim;
+}
+
+static void
+touch(APEX_Cache *cache, APEX_Cache_Line *line, const int index,
+      const int way)
+{
+    line->last_use = cache->clock;
+    if (cache->config.policy == CACHE_POLICY_PLRU)
+    {
+        plru_touch(&cache->plru[index], cache->config.ways, way);
+    }
+}
+
+/* Set index of block and the first line of that set */
+static APEX_Cache_Line *
+set_of(const APEX_Cache *cache, const unsigned int block, int *index)
+{
+    *index = block & (cache->num_sets - 1);
+    return &cache->lines[(size_t)*index * cache->config.ways];
+}
+
+/* Way of set holding block, -1 if it is not cached */
+static int
+find_way(const APEX_Cache *cache, const APEX_Cache_Line *set,
+         const unsigned int block)
+{
+    int way;
+
+    for (way = 0; way < cache->config.ways; ++way)
+    {
+        if (set[way].valid && set[way].tag == block)
+        {
+            return way;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Brings block into its set, evicting a victim; a prefetched line arrives
+ * in cycle ready. Returns TRUE if the victim was dirty and had to be
+ * written back.
+ */
+static int
+fill_line(APEX_Cache *cache, const unsigned int block, const int dirty,
+          const int prefetched, const long ready)
+{
+    APEX_Cache_Line *set;
+    int index, way, written_back = FALSE;
+
+    set = set_of(cache, block, &index);
+    way = choose_victim(cache, set, index);
+    if (set[way].valid)
+    {
+        cache->evictions++;
+        if (set[way].dirty)
+        {
+            cache->writebacks++;
+            written_back = TRUE;
+        }
+    }
+
+    set[way].tag = block;
+    set[way].valid = TRUE;
+    set[way].dirty = dirty;
+    set[way].prefetched = prefetched;
+    set[way].ready = ready;
+    touch(cache, &set[way], index, way);
+    return written_back;
+}
+
+/*
+ * Brings block in as a prefetch issued in cycle now, unless it is cached
+ * already (or on its way). It arrives after the miss latency; memory
+ * bandwidth is not modelled.
+ */
+static void
+prefetch_line(APEX_Cache *cache, const unsigned int block, const long now)
+{
+    int index;
+
+    if (find_way(cache, set_of(cache, block, &index), block) >= 0)
+    {
+        return;
+    }
+
+    cache->prefetches++;
+    fill_line(cache, block, FALSE, TRUE, now + cache->config.miss_latency);
+}
+
+/*
+ * Stream prefetch on a miss or the first use of a prefetched line: a block
+ * next to the last one of a stream continues it in that direction, and the
+ * lines distance to distance + degree - 1 ahead of it are prefetched. Any
+ * other block starts a new stream in place of the least recently used one.
+ */
+static void
+prefetch_stream(APEX_Cache *cache, const unsigned int block, const long now)
+{
+    APEX_Stream *stream, *victim = &cache->streams[0];
+    int i, k, step;
+
+    for (i = 0; i < CACHE_STREAMS; ++i)
+    {
+        stream = &cache->streams[i];
+        step = (int)(block - stream->block);
+        if (stream->valid && (step == 1 || step == -1)
+            && (stream->direction == 0 || stream->direction == step))
+        {
+            stream->block = block;
+            stream->direction = step;
+            stream->last_use = cache->clock;
+            for (k = 0; k < cache->config.prefetch_degree; ++k)
+            {
+                prefetch_line(cache,
+                              block + step * (cache->config.prefetch_distance
+                                              + k),
+                              now);
+            }
+            return;
+        }
+        if (!stream->valid || (victim->valid
+                               && stream->last_use < victim->last_use))
+        {
+            victim = stream;
+        }
+    }
+
+    victim->block = block;
+    victim->direction = 0;
+    victim->valid = TRUE;
+    victim->last_use = cache->clock;
+}
+
+/*
+ * Stride prefetch, trained by every access of a load or store: once the
+ * access at pc has moved by the same stride twice in a row, the addresses
+ * distance to distance + degree - 1 strides ahead are prefetched
+ */
+static void
+prefetch_stride(APEX_Cache *cache, const unsigned int address, const int pc,
+                const long now)
+{
+    APEX_Stride_Entry *entry
+        = &cache->strides[((unsigned int)pc >> 2) & (CACHE_STRIDE_ENTRIES - 1)];
+    const int stride = (int)(address - entry->address);
+    int k;
+
+    if (entry->pc != pc)
+    {
+        entry->pc = pc;
+        entry->address = address;
+        entry->stride = 0;
+        entry->confidence = 0;
+        return;
+    }
+
+    if (stride == entry->stride)
+    {
+        entry->confidence += entry->confidence < 3;
+    }
+    else if (entry->confidence > 0)
+    {
+        entry->confidence--;
+    }
+    else
+    {
+        entry->stride = stride;
+    }
+    entry->address = address;
+
+    if (entry->confidence < 2 || entry->stride == 0)
+    {
+        return;
+    }
+    for (k = 0; k < cache->config.prefetch_degree; ++k)
+    {
+        prefetch_line(cache,
+                      (address + (unsigned int)entry->stride
+                                 * (cache->config.prefetch_distance + k))
+                      >> cache->line_shift,
+                      now);
+    }
+}
+
+/*
+ * Prefetch on a demand miss of block and on the first use of a prefetched
+ * line: the next line, or the next lines of its stream
+ */
+static void
+prefetch_after(APEX_Cache *cache, const unsigned int block, const long now)
+{
+    switch (cache->config.prefetch)
+    {
+        case CACHE_PREFETCH_NEXT_LINE:
+            prefetch_line(cache, block + 1, now);
+            break;
+        case CACHE_PREFETCH_STREAM:
+            prefetch_stream(cache, block, now);
+            break;
+    }
+}
+
+/* Demand access of APEX_cache_access before the stride prefetcher sees it */
+static int
+access_line(APEX_Cache *cache, const unsigned int address, const int write,
+            const long now)
+{
+    const APEX_Cache_Config *config = &cache->config;
+    const unsigned int block = address >> cache->line_shift;
+    APEX_Cache_Line *set;
+    int index, way, cycles;
+
+    cache->clock++;
+    if (write)
+    {
+        cache->writes++;
+    }
+    else
+    {
+        cache->reads++;
+    }
+
+    set = set_of(cache, block, &index);
+    way = find_way(cache, set, block);
+    if (way >= 0)
+    {
+        cycles = config->hit_latency;
+        touch(cache, &set[way], index, way);
+        if (write && config->write_back)
+        {
+            set[way].dirty = TRUE;
+        }
+        else if (write)
+        {
+            cache->write_throughs++;
+        }
+
+        if (set[way].prefetched)
+        {
+            set[way].prefetched = FALSE;
+            cache->useful_prefetches++;
+
+            /* Still on its way, the rest of the miss latency shows */
+            if (set[way].ready > now)
+            {
+                cache->late_prefetches++;
+                cycles += set[way].ready - now;
+            }
+            cache->hidden_cycles += config->miss_latency
+                                    - (cycles - config->hit_latency);
+            prefetch_after(cache, block, now);
+        }
+        return cycles;
+    }
+
+    if (write)
+    {
+        cache->write_misses++;
+    }
+    else
+    {
+        cache->read_misses++;
+    }
+
+    if (write && !config->write_back)
+    {
+        cache->write_throughs++;
+        return config->hit_latency;
+    }
+
+    cycles = config->hit_latency + config->miss_latency;
+    if (fill_line(cache, block, write, FALSE, 0))
+    {
+        cycles += config->miss_latency;
+    }
+    prefetch_after(cache, block, now);
+    return cycles;
+}
+
+/*
+ * Looks up the byte address, a read unless write is set, made by the
+ * instruction at pc in cycle now, and updates the tags, the replacement
+ * state, the prefetcher and the counters.
+ *
+ * Returns the cycles the access takes: the hit latency, plus the miss
+ * latency to bring the line in, plus once more to write back a dirty
+ * victim. Write-through stores do not allocate on a miss and are buffered,
+ * they always take the hit latency. A prefetched line that has not arrived
+ * yet costs the hit latency plus the cycles until it does.
+ */
+int
+APEX_cache_access(APEX_Cache *cache, const unsigned int address,
+                  const int write, const int pc, const long now)
+{
+    const int cycles = access_line(cache, address, write, now);
+
+    if (cache->config.prefetch == CACHE_PREFETCH_STRIDE)
+    {
+        prefetch_stride(cache, address, pc, now);
+    }
+    return cycles;
+}
+
+const char *
+APEX_cache_policy_name(const int policy)
+{
+    switch (policy)
+    {
+        case CACHE_POLICY_PLRU:
+            return "plru";
+        case CACHE_POLICY_RANDOM:
+            return "random";
+    }
+    return "lru";
+}
+
+const char *
+APEX_cache_prefetch_name(const int prefetch)
+{
+    switch (prefetch)
+    {
+        case CACHE_PREFETCH_NEXT_LINE:
+            return "next-line";
+        case CACHE_PREFETCH_STRIDE:
+            return "stride";
+        case CACHE_PREFETCH_STREAM:
+            return "stream";
+    }
+    return "none";
+}
+
+/* Prints the geometry and counters of cache under the heading name */
+void
+APEX_cache_print_stats(const APEX_Cache *cache, const char *name, FILE *fp)
+{
+    const APEX_Cache_Config *config = &cache->config;
+    const long accesses = cache->reads + cache->writes;
+    const long misses = cache->read_misses + cache->write_misses;
+
+    if (!cache->num_sets)
+    {
+        return;
+    }
+
+    fprintf(fp, "\n ============== %s ============= \n", name);
+    fprintf(fp, "Size = %d B | Ways = %d | Line = %d B | Policy = %s | %s\n",
+            config->size, config->ways, config->line_size,
+            APEX_cache_policy_name(config->policy),
+            config->write_back ? "Write-back" : "Write-through");
+    fprintf(fp, "Reads = %ld | Read misses = %ld | Writes = %ld | "
+            "Write misses = %ld | Hit rate = %.2f%%\n",
+            cache->reads, cache->read_misses, cache->writes,
+            cache->write_misses,
+            accesses ? 100.0 * (accesses - misses) / accesses : 0.0);
+    fprintf(fp, "Evictions = %ld | Writebacks = %ld | Write-throughs = %ld\n",
+            cache->evictions, cache->writebacks, cache->write_throughs);
+    if (config->prefetch == CACHE_PREFETCH_NEXT_LINE)
+    {
+        fprintf(fp, "Prefetcher = %s | Prefetches = %ld | Useful = %ld\n",
+                APEX_cache_prefetch_name(config->prefetch), cache->prefetches,
+                cache->useful_prefetches);
+    }
+    else if (config->prefetch != CACHE_PREFETCH_NONE)
+    {
+        fprintf(fp, "Prefetcher = %s | Degree = %d | Distance = %d | "
+                "Prefetches = %ld | Useful = %ld\n",
+                APEX_cache_prefetch_name(config->prefetch),
+                config->prefetch_degree, config->prefetch_distance,
+                cache->prefetches, cache->useful_prefetches);
+    }
+    if (config->prefetch != CACHE_PREFETCH_NONE)
+    {
+        /* Coverage: misses the prefetches removed out of all there would
+         * have been; timely: used after they had arrived */
+        fprintf(fp, "Coverage = %.2f%% | Accuracy = %.2f%% | "
+                "Timely = %.2f%% | Late = %ld | Latency hidden = %ld cycles\n",
+                cache->useful_prefetches
+                ? 100.0 * cache->useful_prefetches
+                  / (cache->useful_prefetches + misses) : 0.0,
+                cache->prefetches
+                ? 100.0 * cache->useful_prefetches / cache->prefetches : 0.0,
+                cache->useful_prefetches
+                ? 100.0 * (cache->useful_prefetches - cache->late_prefetches)
+                  / cache->useful_prefetches : 0.0,
+                cache->late_prefetches, cache->hidden_cycles);
+    }
+}
@@ -0,0 +1,108 @@
+/*
+ * apex_cache.h
+ * Contains declarations of the set-associative cache timing model. Caches
+ * only keep tags, the data itself always lives in APEX_Memory.
+ */
+#ifndef _APEX_CACHE_H_
+#define _APEX_CACHE_H_
+
+#include <stdio.h>
+
+/* Replacement policies */
+#define CACHE_POLICY_LRU 0
+#define CACHE_POLICY_PLRU 1   /* Tree pseudo-LRU, needs a power of two ways */
+#define CACHE_POLICY_RANDOM 2
+
+/* Prefetchers */
+#define CACHE_PREFETCH_NONE 0
+#define CACHE_PREFETCH_NEXT_LINE 1 /* Line after a miss or a prefetch hit */
+#define CACHE_PREFETCH_STRIDE 2    /* Constant stride of each load/store PC */
+#define CACHE_PREFETCH_STREAM 3    /* Runs of consecutive lines, either way */
+
+/* Entries of the PC indexed stride table, a power of two */
+#define CACHE_STRIDE_ENTRIES 64
+
+/* Streams followed at the same time */
+#define CACHE_STREAMS 8
+
+/* Most lines one stride or stream prefetch brings in */
+#define CACHE_MAX_PREFETCH_DEGREE 64
+
+/* Geometry and timing of one cache, part of APEX_Pipeline_Config */
+typedef struct APEX_Cache_Config
+{
+    int size;         /* Bytes, 0 = no cache */
+    int ways;         /* Associativity */
+    int line_size;    /* Bytes */
+    int policy;       /* CACHE_POLICY_* */
+    int write_back;   /* Write-back with write allocate, else write-through */
+    int hit_latency;  /* Cycles of an access that hits */
+    int miss_latency; /* Extra cycles to bring a line in (or write one back) */
+    int prefetch;     /* CACHE_PREFETCH_* */
+    int prefetch_degree;   /* Lines a stride or stream prefetch brings in */
+    int prefetch_distance; /* Strides or lines ahead of the access it starts */
+} APEX_Cache_Config;
+
+typedef struct APEX_Cache_Line
+{
+    unsigned int tag;
+    unsigned char valid;
+    unsigned char dirty;
+    unsigned char prefetched; /* Brought in by the prefetcher, not used yet */
+    unsigned long last_use; /* LRU stamp */
+    long ready;             /* Cycle a prefetched line arrives */
+} APEX_Cache_Line;
+
+/* Last address and stride of the loads and stores at one PC */
+typedef struct APEX_Stride_Entry
+{
+    int pc;
+    unsigned int address;
+    int stride;
+    int confidence;  /* Repeats of the stride, prefetches from 2 on */
+} APEX_Stride_Entry;
+
+/* Line a stream reached and the way it runs, -1 or 1 (0 = not known yet) */
+typedef struct APEX_Stream
+{
+    unsigned int block;
+    int direction;
+    int valid;
+    unsigned long last_use;
+} APEX_Stream;
+
+typedef struct APEX_Cache
+{
+    APEX_Cache_Config config;
+    int num_sets;           /* 0 when there is no cache */
+    int line_shift;
+    APEX_Cache_Line *lines; /* num_sets x ways, set major */
+    unsigned int *plru;     /* Tree bits of every set */
+    unsigned long clock;    /* Accesses so far, stamps LRU use */
+    unsigned int random;    /* xorshift state of random replacement */
+
+    long reads;
+    long read_misses;
+    long writes;
+    long write_misses;
+    long evictions;         /* Valid lines replaced */
+    long writebacks;        /* Dirty lines written back to memory */
+    long write_throughs;    /* Stores passed on to memory */
+    long prefetches;        /* Lines brought in by the prefetcher */
+    long useful_prefetches; /* Prefetched lines used before being evicted */
+    long late_prefetches;   /* Used while still on their way */
+    long hidden_cycles;     /* Miss latency the useful prefetches saved */
+
+    APEX_Stride_Entry strides[CACHE_STRIDE_ENTRIES];
+    APEX_Stream streams[CACHE_STREAMS];
+} APEX_Cache;
+
+int APEX_cache_init(APEX_Cache *cache, const APEX_Cache_Config *config);
+void APEX_cache_free(APEX_Cache *cache);
+int APEX_cache_access(APEX_Cache *cache, const unsigned int address,
+                      const int write, const int pc, const long now);
+void APEX_cache_print_stats(const APEX_Cache *cache, const char *name,
+                            FILE *fp);
+const char *APEX_cache_policy_name(const int policy);
+const char *APEX_cache_prefetch_name(const int prefetch);
+#endif
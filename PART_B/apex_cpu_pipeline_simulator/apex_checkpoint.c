@@ -0,0 +1,370 @@
+/*
+ * apex_checkpoint.c
+ * Contains binary checkpointing of the APEX cpu. A checkpoint holds the full
+ * architectural and pipeline state (registers, data memory, all five latches,
+ * operations in the functional units, flags and the clock) together with a
+ * hash of the code image it belongs to. Restoring maps the file and copies
+ * straight out of it.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "apex_checkpoint.h"
+#include "apex_cpu.h"
+#include "apex_macros.h"
+#include "apex_memory.h"
+#include "apex_ooo.h"
+
+#define NUM_CHECKPOINT_PAGES(mem) \
+    (((mem)->size + CHECKPOINT_PAGE_WORDS - 1) / CHECKPOINT_PAGE_WORDS)
+
+/* Checkpoint pages per page of data memory */
+#define CHECKPOINT_PAGES_PER_PAGE (MEMORY_PAGE_WORDS / CHECKPOINT_PAGE_WORDS)
+
+#define FNV_PRIME 0x100000001b3ULL
+
+/* FNV-1a, 64 bit */
+static uint64_t
+hash_bytes(uint64_t hash, const void *data, const size_t len)
+{
+    const unsigned char *p = data;
+    size_t i;
+
+    for (i = 0; i < len; ++i)
+    {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/* hash_bytes over len zero bytes */
+static uint64_t
+hash_zeros(uint64_t hash, const size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i)
+    {
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+ * Hash of the loaded program, covering every field that affects execution
+ * (handler pointers differ between builds and are left out)
+ */
+uint64_t
+APEX_checkpoint_code_hash(const APEX_CPU *cpu)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const APEX_Decoded *ins;
+    int i;
+
+    for (i = 0; i < cpu->code_memory_size; ++i)
+    {
+        ins = &cpu->decoded[i];
+        hash = hash_bytes(hash, &ins->opcode, sizeof(ins->opcode));
+        hash = hash_bytes(hash, &ins->rd, sizeof(ins->rd));
+        hash = hash_bytes(hash, &ins->rs1, sizeof(ins->rs1));
+        hash = hash_bytes(hash, &ins->rs2, sizeof(ins->rs2));
+        hash = hash_bytes(hash, &ins->rs3, sizeof(ins->rs3));
+        hash = hash_bytes(hash, &ins->imm, sizeof(ins->imm));
+    }
+    return hash;
+}
+
+/*
+ * Hash of the whole data memory, used to compare final states of runs. Pages
+ * never written are zero, FNV-1a over them only multiplies by a power of the
+ * prime, which is worked out once per run.
+ */
+uint64_t
+APEX_checkpoint_data_hash(const APEX_CPU *cpu)
+{
+    const APEX_Memory *mem = &cpu->data_memory;
+    const uint64_t zero_page = hash_zeros(1, sizeof(int) * MEMORY_PAGE_WORDS);
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    unsigned int words;
+    int page;
+
+    for (page = 0; page < mem->num_pages; ++page)
+    {
+        words = mem->size - ((unsigned int)page << MEMORY_PAGE_SHIFT);
+        if (words > MEMORY_PAGE_WORDS)
+        {
+            words = MEMORY_PAGE_WORDS;
+        }
+
+        if (mem->pages[page])
+        {
+            hash = hash_bytes(hash, mem->pages[page], sizeof(int) * words);
+        }
+        else if (words == MEMORY_PAGE_WORDS)
+        {
+            hash *= zero_page;
+        }
+        else
+        {
+            hash = hash_zeros(hash, sizeof(int) * words);
+        }
+    }
+    return hash;
+}
+
+/*
+ * Words of checkpoint page page in data memory, NULL when its memory page
+ * was never written. *words is set to the words of it inside memory.
+ */
+static const int *
+checkpoint_page(const APEX_Memory *mem, const int page, int *words)
+{
+    const int *base = mem->pages[page / CHECKPOINT_PAGES_PER_PAGE];
+    unsigned int left = mem->size - (unsigned int)page * CHECKPOINT_PAGE_WORDS;
+
+    *words = left < CHECKPOINT_PAGE_WORDS ? (int)left : CHECKPOINT_PAGE_WORDS;
+    if (!base)
+    {
+        return NULL;
+    }
+    return base + (page % CHECKPOINT_PAGES_PER_PAGE) * CHECKPOINT_PAGE_WORDS;
+}
+
+/* TRUE if the page of data memory holds only zeros */
+static int
+page_is_zero(const APEX_CPU *cpu, const int page)
+{
+    const int *p;
+    int i, words;
+
+    p = checkpoint_page(&cpu->data_memory, page, &words);
+    for (i = 0; p && i < words; ++i)
+    {
+        if (p[i])
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Latches of cpu in checkpoint order */
+static void
+stage_latches(const APEX_CPU *cpu, CPU_Stage *latches[5])
+{
+    latches[0] = cpu->fetch;
+    latches[1] = cpu->decode;
+    latches[2] = cpu->execute;
+    latches[3] = cpu->memory;
+    latches[4] = cpu->writeback;
+}
+
+/*
+ * Writes a checkpoint of cpu to filename
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int
+APEX_checkpoint_save(const APEX_CPU *cpu, const char *filename)
+{
+    APEX_Checkpoint_Header header;
+    CPU_Stage *latches[5];
+    int32_t words[CHECKPOINT_PAGE_WORDS];
+    const int *p;
+    uint32_t page_index;
+    FILE *fp;
+    int page, i, num_words, ok = TRUE;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.stage_size = sizeof(CPU_Stage);
+    header.code_hash = APEX_checkpoint_code_hash(cpu);
+    header.code_memory_size = cpu->code_memory_size;
+    header.pc = cpu->pc;
+    header.clock = cpu->clock;
+    header.insn_completed = cpu->insn_completed;
+    header.insn_fast_forwarded = cpu->insn_fast_forwarded;
+    header.zero_flag = cpu->zero_flag;
+    header.fetch_enabled = cpu->fetch_enabled;
+    header.stop_fetch = cpu->stop_fetch;
+    header.fetch_bubbles = cpu->fetch_bubbles;
+    header.fetch_wait = cpu->fetch_wait;
+    header.fetch_missed = cpu->fetch_missed;
+    header.num_inflight = cpu->num_inflight;
+    memcpy(header.unit_busy, cpu->unit_busy, sizeof(header.unit_busy));
+    memcpy(header.regs, cpu->regs, sizeof(header.regs));
+    header.data_memory_words = cpu->data_memory.size;
+
+    for (page = 0; page < NUM_CHECKPOINT_PAGES(&cpu->data_memory); ++page)
+    {
+        if (!page_is_zero(cpu, page))
+        {
+            header.num_pages++;
+        }
+    }
+
+    fp = fopen(filename, "wb");
+    if (!fp)
+    {
+        return -1;
+    }
+
+    ok &= fwrite(&header, sizeof(header), 1, fp) == 1;
+    stage_latches(cpu, latches);
+    for (i = 0; i < 5; ++i)
+    {
+        ok &= fwrite(latches[i], sizeof(CPU_Stage), 1, fp) == 1;
+    }
+    for (i = 0; i < cpu->num_inflight; ++i)
+    {
+        ok &= fwrite(cpu->inflight[i], sizeof(CPU_Stage), 1, fp) == 1;
+    }
+
+    for (page = 0; page < NUM_CHECKPOINT_PAGES(&cpu->data_memory) && ok;
+         ++page)
+    {
+        if (page_is_zero(cpu, page))
+        {
+            continue;
+        }
+
+        memset(words, 0, sizeof(words));
+        p = checkpoint_page(&cpu->data_memory, page, &num_words);
+        memcpy(words, p, sizeof(int32_t) * num_words);
+
+        page_index = page;
+        ok &= fwrite(&page_index, sizeof(page_index), 1, fp) == 1;
+        ok &= fwrite(words, sizeof(words), 1, fp) == 1;
+    }
+
+    if (fclose(fp) != 0 || !ok)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Restores cpu from a checkpoint. The checkpoint must have been taken with
+ * the same program (code hash) and the same latch layout.
+ *
+ * Returns 0 on success, -1 on failure (cpu is left untouched in that case)
+ */
+int
+APEX_checkpoint_load(APEX_CPU *cpu, const char *filename)
+{
+    const APEX_Checkpoint_Header *header;
+    const unsigned char *base, *p;
+    CPU_Stage *latches[5];
+    struct stat st;
+    size_t expected;
+    uint32_t page_index;
+    int *dst;
+    int fd, page, i, words;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(APEX_Checkpoint_Header))
+    {
+        close(fd);
+        return -1;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    header = (const APEX_Checkpoint_Header *)base;
+    expected = sizeof(APEX_Checkpoint_Header)
+               + (5 + (size_t)header->num_inflight) * sizeof(CPU_Stage)
+               + (size_t)header->num_pages
+                     * (sizeof(uint32_t) + CHECKPOINT_PAGE_WORDS * sizeof(int32_t));
+
+    if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0
+        || header->version != CHECKPOINT_VERSION
+        || header->stage_size != sizeof(CPU_Stage)
+        || header->num_inflight < 0
+        || header->num_inflight > EXECUTE_MAX_INFLIGHT
+        || header->data_memory_words != cpu->data_memory.size
+        || header->code_memory_size != cpu->code_memory_size
+        || header->code_hash != APEX_checkpoint_code_hash(cpu)
+        || (size_t)st.st_size != expected)
+    {
+        munmap((void *)base, st.st_size);
+        return -1;
+    }
+
+    cpu->pc = header->pc;
+    cpu->clock = header->clock;
+    cpu->insn_completed = header->insn_completed;
+    cpu->insn_fast_forwarded = header->insn_fast_forwarded;
+    cpu->zero_flag = header->zero_flag;
+    cpu->fetch_enabled = header->fetch_enabled;
+    cpu->stop_fetch = header->stop_fetch;
+    cpu->fetch_bubbles = header->fetch_bubbles;
+    cpu->fetch_wait = header->fetch_wait;
+    cpu->fetch_missed = header->fetch_missed;
+    cpu->num_inflight = header->num_inflight;
+    memcpy(cpu->unit_busy, header->unit_busy, sizeof(cpu->unit_busy));
+    memcpy(cpu->regs, header->regs, sizeof(cpu->regs));
+
+    /* The out-of-order core renames again from the restored registers */
+    if (cpu->ooo)
+    {
+        APEX_ooo_reset(cpu->ooo);
+    }
+
+    /* Stage order, the latches the stages currently point to are reused */
+    p = base + sizeof(APEX_Checkpoint_Header);
+    stage_latches(cpu, latches);
+    for (i = 0; i < 5; ++i)
+    {
+        memcpy(latches[i], p, sizeof(CPU_Stage));
+        p += sizeof(CPU_Stage);
+    }
+    for (i = 0; i < cpu->num_inflight; ++i)
+    {
+        memcpy(cpu->inflight[i], p, sizeof(CPU_Stage));
+        p += sizeof(CPU_Stage);
+    }
+
+    /* Absent pages are zero, so is any content of a backing file */
+    APEX_memory_clear(&cpu->data_memory);
+    for (i = 0; i < (int)header->num_pages; ++i)
+    {
+        memcpy(&page_index, p, sizeof(page_index));
+        p += sizeof(page_index);
+
+        if (page_index < NUM_CHECKPOINT_PAGES(&cpu->data_memory))
+        {
+            page = page_index;
+            dst = APEX_memory_page(&cpu->data_memory,
+                                   page / CHECKPOINT_PAGES_PER_PAGE);
+            if (dst)
+            {
+                checkpoint_page(&cpu->data_memory, page, &words);
+                memcpy(dst + (page % CHECKPOINT_PAGES_PER_PAGE)
+                                 * CHECKPOINT_PAGE_WORDS,
+                       p, words * sizeof(int32_t));
+            }
+        }
+        p += CHECKPOINT_PAGE_WORDS * sizeof(int32_t);
+    }
+
+    munmap((void *)base, st.st_size);
+    return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * apex_checkpoint.h
+ * Contains declarations for saving and restoring binary snapshots of the
+ * complete APEX_CPU state
+ */
+#ifndef _APEX_CHECKPOINT_H_
+#define _APEX_CHECKPOINT_H_
+
+#include <stdint.h>
+
+#include "apex_cpu.h"
+
+#define CHECKPOINT_MAGIC "APEXCKPT"
+
+/* Bump whenever the layout of the file or of CPU_Stage changes */
+#define CHECKPOINT_VERSION 7
+
+/* Data memory is stored sparsely in pages of this many words */
+#define CHECKPOINT_PAGE_WORDS 64
+
+/*
+ * On-disk layout (host byte order):
+ *   APEX_Checkpoint_Header
+ *   CPU_Stage x 5 (fetch, decode, execute, memory, writeback)
+ *   CPU_Stage x num_inflight (operations in a functional unit, oldest first)
+ *   num_pages x { uint32_t page_index; int32_t words[CHECKPOINT_PAGE_WORDS] }
+ * Pages of data memory that are all zero are not stored.
+ */
+typedef struct APEX_Checkpoint_Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t stage_size;          /* sizeof(CPU_Stage) of the writer */
+    uint64_t code_hash;           /* APEX_checkpoint_code_hash of the program */
+    int32_t code_memory_size;
+    int32_t pc;
+    int32_t clock;
+    int32_t insn_completed;
+    int64_t insn_fast_forwarded;
+    int32_t zero_flag;
+    int32_t fetch_enabled;
+    int32_t stop_fetch;
+    int32_t fetch_bubbles;
+    int32_t fetch_wait;
+    int32_t fetch_missed;
+    int32_t num_inflight;
+    int32_t unit_busy[NUM_FUNCTIONAL_UNITS];
+    int32_t regs[REG_FILE_SIZE];
+    uint32_t data_memory_words;
+    uint32_t num_pages;
+} APEX_Checkpoint_Header;
+
+uint64_t APEX_checkpoint_code_hash(const APEX_CPU *cpu);
+uint64_t APEX_checkpoint_data_hash(const APEX_CPU *cpu);
+int APEX_checkpoint_save(const APEX_CPU *cpu, const char *filename);
+int APEX_checkpoint_load(APEX_CPU *cpu, const char *filename);
+#endif
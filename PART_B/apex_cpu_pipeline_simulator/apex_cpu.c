@@ -11,154 +11,1137 @@
 #include <string.h>
 
 #include "apex_cpu.h"
+#include "apex_func.h"
 #include "apex_macros.h"
+#include "apex_ooo.h"
+#include "apex_trace.h"
 
 /* Converts the PC(4000 series) into array index for code memory
  *
  * Note: You are not supposed to edit this function
  */
+int
+get_code_memory_index_from_pc(const int pc)
+{
+    return (pc - 4000) / 4;
+}
+
+/* TRUE when cpu->pc points at an instruction of code memory */
+int
+APEX_cpu_pc_in_code(const APEX_CPU *cpu)
+{
+    const int index = get_code_memory_index_from_pc(cpu->pc);
+
+    return index >= 0 && index < cpu->code_memory_size;
+}
+
+/*
+ * Reports what a stage did this cycle: a binary record when tracing to a
+ * file, the stage text otherwise
+ */
+static void
+trace_stage(APEX_CPU *cpu, const int stage_id, const int state,
+            const CPU_Stage *stage)
+{
+    if (cpu->trace)
+    {
+        APEX_trace_stage(cpu->trace, stage_id, state, stage->pc);
+        return;
+    }
+
+    if (!ENABLE_DEBUG_MESSAGES || cpu->log_level < APEX_LOG_STAGE)
+    {
+        return;
+    }
+
+    if (state == TRACE_STATE_EMPTY)
+    {
+        APEX_trace_print_stage(cpu->out, stage_id, state, 0, NULL);
+    }
+    else
+    {
+        APEX_trace_print_stage(cpu->out, stage_id, state, stage->pc,
+                               &cpu->code_memory[stage->insn]);
+    }
+}
+
+/* Debug function which prints the register file
+ *
+ * Note: You are not supposed to edit this function
+ */
+static void
+print_reg_file(const APEX_CPU *cpu)
+{
+    if (cpu->trace)
+    {
+        APEX_trace_regs(cpu->trace, cpu->regs);
+    }
+    else if (cpu->log_level >= APEX_LOG_FULL)
+    {
+        APEX_trace_print_regs(cpu->out, cpu->regs);
+    }
+}
+
+
+/* Latch contents of an empty stage */
+static const CPU_Stage empty_latch = { .result_tag = -1 };
+
+/*
+ * Execute handlers: one per opcode
+ */
+static void
+execute_add(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    stage->result = stage->rs1_value + stage->rs2_value;
+    stage->result_tag = cpu->decoded[stage->insn].rd;
+}
+
+static void
+execute_addl(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    stage->result = stage->rs1_value + cpu->decoded[stage->insn].imm;
+    stage->result_tag = cpu->decoded[stage->insn].rd;
+}
+
+static void
+execute_sub(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    stage->result = stage->rs1_value - stage->rs2_value;
+    stage->result_tag = cpu->decoded[stage->insn].rd;
+}
+
+static void
+execute_subl(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    stage->result = stage->rs1_value - cpu->decoded[stage->insn].imm;
+    stage->result_tag = cpu->decoded[stage->insn].rd;
+}
+
+static void
+execute_mul(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    stage->result = stage->rs1_value * stage->rs2_value;
+    stage->result_tag = cpu->decoded[stage->insn].rd;
+}
+
+static void
+execute_div(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    /* Division by zero yields 0 instead of trapping the host */
+    if (stage->rs2_value == 0)
+    {
+        stage->result = 0;
+    }
+    else
+    {
+        stage->result = stage->rs1_value / stage->rs2_value;
+    }
+    stage->result_tag = cpu->decoded[stage->insn].rd;
+}
+
+static void
+execute_and(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    stage->result = stage->rs1_value & stage->rs2_value;
+    stage->result_tag = cpu->decoded[stage->insn].rd;
+}
+
+static void
+execute_or(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    stage->result = stage->rs1_value | stage->rs2_value;
+    stage->result_tag = cpu->decoded[stage->insn].rd;
+}
 
+static void
+execute_xor(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    stage->result = stage->rs1_value ^ stage->rs2_value;
+    stage->result_tag = cpu->decoded[stage->insn].rd;
+}
+
+static void
+execute_load(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    stage->result = stage->rs1_value + cpu->decoded[stage->insn].imm;
+    stage->result_tag = cpu->decoded[stage->insn].rd;
+    stage->memory_address = stage->result;
+}
+
+static void
+execute_ldr(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    stage->result = stage->rs1_value + stage->rs2_value;
+    stage->result_tag = cpu->decoded[stage->insn].rd;
+    stage->memory_address = stage->result;
+}
+
+static void
+execute_store(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    /* mem[rs2 + imm] <- rs1 */
+    stage->memory_address = stage->rs2_value + cpu->decoded[stage->insn].imm;
+}
 
+static void
+execute_str(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    /* mem[rs2 + rs3] <- rs1 */
+    stage->memory_address = stage->rs2_value + stage->rs3_value;
+}
+
+static void
+execute_cmp(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    if (stage->rs1_value == stage->rs2_value)
+    {
+        cpu->zero_flag = TRUE;
+    }
+    else 
+    {
+        cpu->zero_flag = FALSE;
+    }
+}
+
+/* TRUE for BZ and BNZ */
 static int
-get_code_memory_index_from_pc(const int pc)
+is_branch(const APEX_Decoded *ins)
 {
-    return (pc - 4000) / 4;
+    return ins->opcode == OPCODE_BZ || ins->opcode == OPCODE_BNZ;
 }
 
+/* TRUE if the BZ/BNZ in the latch is taken, FALSE for anything else */
+static int
+branch_taken(const APEX_CPU *cpu, const CPU_Stage *stage)
+{
+    switch (cpu->decoded[stage->insn].opcode)
+    {
+        case OPCODE_BZ:
+            return cpu->zero_flag == TRUE;
+
+        case OPCODE_BNZ:
+            return cpu->zero_flag == FALSE;
+    }
+    return FALSE;
+}
+
+/* BZ, BNZ: redirect fetch to the right path if it was mispredicted */
 static void
-print_instruction(const CPU_Stage *stage)
+execute_branch(APEX_CPU *cpu, CPU_Stage *stage)
 {
-    switch (stage->opcode)
+    if (!cpu->control.flush)
+    {
+        return;
+    }
+
+    /* Calculate new PC, and send it to fetch unit. Decode and fetch are
+     * flushed in this cycle (see control_cycle), so the new PC is fetched
+     * from the next one. */
+    cpu->pc = cpu->control.taken ? stage->pc + cpu->decoded[stage->insn].imm
+                                 : stage->pc + 4;
+
+    /* Make sure fetch stage is enabled to start fetching from new PC */
+    cpu->fetch_enabled = TRUE;
+
+    /* Configured branch penalty on top of the cycle above */
+    cpu->fetch_bubbles = cpu->config.branch_penalty;
+
+    /* A line still coming in for the wrong path is not waited for */
+    cpu->fetch_wait = 0;
+    cpu->fetch_missed = FALSE;
+}
+
+static void
+execute_movc(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    stage->result = cpu->decoded[stage->insn].imm;
+    
+    /* Set the zero flag based on the result buffer */
+    if (stage->result == 0)
+    {
+        cpu->zero_flag = TRUE;
+    } 
+    else 
+    {
+        cpu->zero_flag = FALSE;
+    }
+}
+
+/*
+ * Older instructions still in memory or in a unit when execute runs,
+ * writeback has already retired its own. RDCNT and CLRCNT count them so
+ * that the instruction counter is exact in program order.
+ */
+static long
+older_in_flight(const APEX_CPU *cpu)
+{
+    return cpu->memory->has_insn + cpu->num_inflight;
+}
+
+/* RDCNT: counters are read in execute, see APEX_cpu_read_counter */
+static void
+execute_rdcnt(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    stage->result = APEX_cpu_read_counter(cpu, cpu->decoded[stage->insn].imm,
+                                          older_in_flight(cpu));
+}
+
+static void
+execute_clrcnt(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    APEX_cpu_clear_counters(cpu, older_in_flight(cpu));
+}
+
+static void
+execute_none(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    /* HALT, NOP */
+}
+
+/*
+ * Memory handlers
+ */
+static void
+memory_none(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    /* No work for ALU operations, branches, HALT and NOP */
+}
+
+/* LOAD, LDR */
+static void
+memory_load(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    /* Read from data memory */
+    stage->result = APEX_memory_read(&cpu->data_memory, stage->memory_address);
+    stage->result_tag = cpu->decoded[stage->insn].rd;
+}
+
+/* STORE, STR */
+static void
+memory_store(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    /* Write to data memory */
+    APEX_memory_write(&cpu->data_memory, stage->memory_address,
+                      stage->rs1_value);
+}
+
+/*
+ * Writeback handlers
+ */
+static void
+writeback_none(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    /* STORE, STR, CMP, branches, HALT, NOP and CLRCNT don't write a register */
+}
+
+static void
+writeback_reg(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    cpu->regs[cpu->decoded[stage->insn].rd] = stage->result;
+}
+
+/*
+ * Stage handlers of every opcode. create_code_memory binds these into the
+ * pre-decoded table so that no stage has to switch on the opcode per cycle.
+ */
+const APEX_Opcode_Handlers APEX_opcode_handlers[NUM_OPCODES] = {
+    [OPCODE_ADD]   = { execute_add,    memory_none,  writeback_reg },
+    [OPCODE_SUB]   = { execute_sub,    memory_none,  writeback_reg },
+    [OPCODE_MUL]   = { execute_mul,    memory_none,  writeback_reg },
+    [OPCODE_DIV]   = { execute_div,    memory_none,  writeback_reg },
+    [OPCODE_AND]   = { execute_and,    memory_none,  writeback_reg },
+    [OPCODE_OR]    = { execute_or,     memory_none,  writeback_reg },
+    [OPCODE_XOR]   = { execute_xor,    memory_none,  writeback_reg },
+    [OPCODE_MOVC]  = { execute_movc,   memory_none,  writeback_reg },
+    [OPCODE_LOAD]  = { execute_load,   memory_load,  writeback_reg },
+    [OPCODE_STORE] = { execute_store,  memory_store, writeback_none },
+    [OPCODE_BZ]    = { execute_branch, memory_none,  writeback_none },
+    [OPCODE_BNZ]   = { execute_branch, memory_none,  writeback_none },
+    [OPCODE_HALT]  = { execute_none,   memory_none,  writeback_none },
+    [OPCODE_ADDL]  = { execute_addl,   memory_none,  writeback_reg },
+    [OPCODE_SUBL]  = { execute_subl,   memory_none,  writeback_reg },
+    [OPCODE_LDR]   = { execute_ldr,    memory_load,  writeback_reg },
+    [OPCODE_STR]   = { execute_str,    memory_store, writeback_none },
+    [OPCODE_CMP]   = { execute_cmp,    memory_none,  writeback_none },
+    [OPCODE_NOP]   = { execute_none,   memory_none,  writeback_none },
+    [OPCODE_RDCNT] = { execute_rdcnt,  memory_none,  writeback_reg },
+    [OPCODE_CLRCNT] = { execute_clrcnt, memory_none, writeback_none },
+};
+
+/* Functional unit that executes the instruction */
+int
+APEX_functional_unit(const APEX_Decoded *ins)
+{
+    switch (ins->opcode)
     {
-        case OPCODE_ADD:
-        case OPCODE_SUB:
         case OPCODE_MUL:
+            return FU_MUL;
+
         case OPCODE_DIV:
-        case OPCODE_AND:
-        case OPCODE_OR:
-        case OPCODE_XOR:
-        {
-            printf("%s,R%d,R%d,R%d ", stage->opcode_str, stage->rd, stage->rs1,
-                    stage->rs2);
+            return FU_DIV;
+
+        case OPCODE_LOAD:
+        case OPCODE_LDR:
+        case OPCODE_STORE:
+        case OPCODE_STR:
+            return FU_AGU;
+
+        case OPCODE_BZ:
+        case OPCODE_BNZ:
+        case OPCODE_HALT:
+        case OPCODE_NOP:
+        case OPCODE_CLRCNT:
+            return FU_NONE;
+    }
+    return FU_ALU;
+}
+
+/*
+ * Value of counter id since the start of the run, before any CLRCNT.
+ * pending is the number of older instructions not yet added to the CPU's
+ * instruction counts (in flight in the pipeline, or executed by a run of
+ * the functional engine, which adds them at the end).
+ */
+static long
+raw_counter(const APEX_CPU *cpu, const int id, const long pending)
+{
+    switch (id)
+    {
+        case COUNTER_CYCLES:
+            return cpu->clock;
+
+        case COUNTER_INSTRUCTIONS:
+            return cpu->insn_completed + cpu->insn_fast_forwarded + pending;
+
+        case COUNTER_STALLS:
+            return cpu->decode_stalls;
+
+        case COUNTER_FLUSHES:
+            return cpu->bpred.mispredicts + (cpu->ooo ? cpu->ooo->replays : 0);
+
+        case COUNTER_DCACHE_MISSES:
+            return cpu->dcache.read_misses + cpu->dcache.write_misses;
+
+        case COUNTER_ICACHE_MISSES:
+            return cpu->icache.read_misses;
+    }
+    return 0;
+}
+
+/*
+ * RDCNT: counter id (COUNTER_*) since the last CLRCNT, truncated to a
+ * register. Retired instructions are counted in program order: every older
+ * one, CLRCNT itself included, but not the RDCNT.
+ */
+int
+APEX_cpu_read_counter(const APEX_CPU *cpu, const int id, const long pending)
+{
+    return (int)(raw_counter(cpu, id, pending) - cpu->counter_base[id]);
+}
+
+/* CLRCNT: every counter starts over from 0 */
+void
+APEX_cpu_clear_counters(APEX_CPU *cpu, const long pending)
+{
+    int id;
+
+    for (id = 0; id < NUM_COUNTERS; ++id)
+    {
+        cpu->counter_base[id] = raw_counter(cpu, id, pending);
+    }
+}
+
+static const char *const unit_names[NUM_FUNCTIONAL_UNITS] = {
+    [FU_ALU] = "ALU", [FU_MUL] = "MUL", [FU_DIV] = "DIV", [FU_AGU] = "AGU",
+};
+
+static const char *const cause_names[NUM_CYCLE_CAUSES] = {
+    [CYCLE_RETIRING] = "Retiring",     [CYCLE_RAW] = "RAW stall",
+    [CYCLE_FLUSH] = "Branch flush",    [CYCLE_STRUCTURAL] = "Structural",
+    [CYCLE_FRONTEND] = "Front-end",    [CYCLE_DRAIN] = "Drain",
+};
+
+static const char *const bypass_names[NUM_BYPASS_PATHS] = {
+    [BYPASS_MEMORY] = "Memory -> Execute",
+    [BYPASS_WRITEBACK] = "Writeback -> Execute",
+    [BYPASS_DECODE] = "Writeback -> Decode",
+};
+
+int
+APEX_unit_latency(const APEX_Pipeline_Config *config, const int unit)
+{
+    switch (unit)
+    {
+        case FU_MUL:
+            return config->mul_latency;
+
+        case FU_DIV:
+            return config->div_latency;
+
+        case FU_AGU:
+            return config->agu_latency;
+    }
+    return config->alu_latency;
+}
+
+/* Cycles after an issue before unit takes the next operation */
+int
+APEX_unit_interval(const APEX_Pipeline_Config *config, const int unit)
+{
+    int interval;
+
+    switch (unit)
+    {
+        case FU_MUL:
+            interval = config->mul_interval;
             break;
-        }
 
-        case OPCODE_MOVC:
-        {
-            printf("%s,R%d,#%d ", stage->opcode_str, stage->rd, stage->imm);
+        case FU_DIV:
+            interval = config->div_interval;
             break;
-        }
 
-        case OPCODE_ADDL:
-        case OPCODE_SUBL:
-        {
-            printf("%s,R%d,R%d,#%d ", stage->opcode_str, stage->rd, stage->rs1,
-                    stage->imm);
+        case FU_AGU:
+            interval = config->agu_interval;
             break;
-        }
 
-        case OPCODE_LDR:
-        {
-            printf("%s,R%d,R%d,R%d ", stage->opcode_str, stage->rd, stage->rs1,
-                    stage->imm);
+        default:
+            interval = config->alu_interval;
             break;
-        }
-        
-        case OPCODE_STR:
+    }
+
+    /* 0: the unit is not pipelined */
+    return interval ? interval : APEX_unit_latency(config, unit);
+}
+
+/* Cycles the instruction in the latch spends in execute and its unit */
+static int
+execute_latency(const APEX_CPU *cpu, const CPU_Stage *stage)
+{
+    const int unit = APEX_functional_unit(&cpu->decoded[stage->insn]);
+
+    return unit == FU_NONE ? 1 : APEX_unit_latency(&cpu->config, unit);
+}
+
+/*
+ * Cycles the instruction in the latch spends in memory. With a data cache
+ * this looks the access up, so it is called once, in the first cycle.
+ */
+static int
+memory_latency(APEX_CPU *cpu, const CPU_Stage *stage)
+{
+    const APEX_Stage_Handler memory = cpu->decoded[stage->insn].handler.memory;
+    int cycles;
+
+    if (memory != memory_load && memory != memory_store)
+    {
+        return 1;
+    }
+
+    if (!cpu->dcache.num_sets)
+    {
+        return cpu->config.mem_latency;
+    }
+
+    /* Data memory is word addressed, the cache works on bytes */
+    cycles = APEX_cache_access(&cpu->dcache,
+                               (unsigned int)stage->memory_address * 4,
+                               memory == memory_store, stage->pc, cpu->clock);
+
+    /* Latches count cycles in 16 bits */
+    return cycles < 65535 ? cycles : 65535;
+}
+
+/* Register bits of a scoreboard mask, the zero flag left out */
+#define REGISTER_BITS ((1u << REG_FILE_SIZE) - 1)
+
+/* TRUE if the instruction sets the zero flag that BZ/BNZ read */
+static int
+sets_zero_flag(const APEX_Decoded *ins)
+{
+    return ins->opcode == OPCODE_CMP || ins->opcode == OPCODE_MOVC;
+}
+
+/* TRUE if the instruction in the latch is a LOAD or LDR */
+static int
+is_load(const APEX_CPU *cpu, const CPU_Stage *stage)
+{
+    return cpu->decoded[stage->insn].handler.memory == memory_load;
+}
+
+/* Registers (and the zero flag) the instruction in the latch writes */
+static unsigned int
+dest_mask(const APEX_CPU *cpu, const CPU_Stage *stage)
+{
+    const APEX_Decoded *ins = &cpu->decoded[stage->insn];
+    unsigned int mask = 0;
+
+    if (!stage->has_insn)
+    {
+        return 0;
+    }
+    if (ins->handler.writeback == writeback_reg)
+    {
+        mask |= 1u << ins->rd;
+    }
+    if (sets_zero_flag(ins))
+    {
+        mask |= 1u << SCOREBOARD_FLAG;
+    }
+    return mask;
+}
+
+/*
+ * Enters the instruction in the latch as the youngest writer of its
+ * destinations, execute can have the values from clock ready on
+ */
+static void
+record_writer(APEX_CPU *cpu, const CPU_Stage *stage, const int producer,
+              const int ready)
+{
+    APEX_Scoreboard *sb = &cpu->scoreboard;
+    unsigned int mask = dest_mask(cpu, stage);
+    int reg;
+
+    /* Writeback writes the register file in this cycle */
+    if (producer != PRODUCER_WRITEBACK)
+    {
+        sb->pending |= mask & REGISTER_BITS;
+    }
+    for (reg = 0; mask; ++reg, mask >>= 1)
+    {
+        if (mask & 1)
         {
-            printf("%s,R%d,R%d,R%d ", stage->opcode_str, stage->rs1, stage->rs2,
-                    stage->rs3);
-            break;
+            sb->producer[reg] = producer;
+            sb->ready[reg] = ready;
+            sb->latch[reg] = stage;
         }
+    }
+}
+
+/*
+ * Builds the scoreboard of this cycle from the latches beyond execute,
+ * oldest writer first so that the youngest one of each register wins (a
+ * later writer never passes an earlier one still in a unit, see
+ * execute_waits). Results are forwarded from memory and writeback: a load
+ * has its data once it reaches writeback, an operation in a unit once it
+ * reaches memory. The zero flag is written in execute, it is only late while
+ * its writer is in a unit.
+ */
+static void
+build_scoreboard(APEX_CPU *cpu)
+{
+    APEX_Scoreboard *sb = &cpu->scoreboard;
+    const CPU_Stage *op;
+    int i;
+
+    sb->pending = 0;
+    memset(sb->producer, PRODUCER_NONE, sizeof(sb->producer));
+
+    record_writer(cpu, cpu->writeback, PRODUCER_WRITEBACK, cpu->clock);
+    if (cpu->memory->has_insn && is_load(cpu, cpu->memory))
+    {
+        record_writer(cpu, cpu->memory, PRODUCER_MEMORY,
+                      cpu->clock + cpu->control.memory_cycles);
+    }
+    else
+    {
+        record_writer(cpu, cpu->memory, PRODUCER_MEMORY, cpu->clock);
+    }
+    for (i = 0; i < cpu->num_inflight; ++i)
+    {
+        op = cpu->inflight[i];
+        record_writer(cpu, op, PRODUCER_UNIT,
+                      cpu->clock + (op->cycles_left > 1 ? op->cycles_left : 1));
+    }
+}
+
+/*
+ * Without forwarding, decode waits until no instruction in execute, a unit
+ * or memory is going to write one of its sources
+ */
+static int
+decode_interlocked(const APEX_CPU *cpu)
+{
+    const APEX_Decoded *ins = &cpu->decoded[cpu->decode->insn];
 
-        case OPCODE_CMP:
+    if (cpu->config.forwarding)
+    {
+        return FALSE;
+    }
+    return ((cpu->scoreboard.pending | dest_mask(cpu, cpu->execute))
+            & ins->src_mask & REGISTER_BITS) != 0;
+}
+
+/*
+ * Register file read in decode. Writeback writes the register file in the
+ * same cycle, so its result is passed straight through.
+ */
+static int
+read_register(APEX_CPU *cpu, const APEX_Decoded *ins, const int reg)
+{
+    const APEX_Scoreboard *sb = &cpu->scoreboard;
+
+    if (sb->producer[reg] != PRODUCER_WRITEBACK)
+    {
+        return cpu->regs[reg];
+    }
+    if (ins->src_mask & 1u << reg)
+    {
+        cpu->bypass_uses[BYPASS_DECODE]++;
+    }
+    return sb->latch[reg]->result;
+}
+
+static void
+read_registers(APEX_CPU *cpu, CPU_Stage *stage)
+{
+    const APEX_Decoded *ins = &cpu->decoded[stage->insn];
+
+    stage->rs1_value = read_register(cpu, ins, ins->rs1);
+    stage->rs2_value = read_register(cpu, ins, ins->rs2);
+    stage->rs3_value = read_register(cpu, ins, ins->rs3);
+}
+
+/* TRUE if the youngest writer of reg has its result on the bypass */
+static int
+bypass_ready(const APEX_CPU *cpu, const int reg)
+{
+    const APEX_Scoreboard *sb = &cpu->scoreboard;
+
+    return sb->producer[reg] != PRODUCER_NONE && sb->ready[reg] <= cpu->clock;
+}
+
+/*
+ * Source value of an instruction about to execute: forwarded from the
+ * youngest writer if its result is on the bypass this cycle, else the value
+ * read in decode. A writer whose result is not there yet makes execute wait
+ * (see execute_waits).
+ */
+static int
+forward_operand(const APEX_CPU *cpu, const int reg, const int value)
+{
+    return bypass_ready(cpu, reg) ? cpu->scoreboard.latch[reg]->result : value;
+}
+
+static void
+forward_operands(const APEX_CPU *cpu, CPU_Stage *stage)
+{
+    const APEX_Decoded *ins = &cpu->decoded[stage->insn];
+
+    stage->rs1_value = forward_operand(cpu, ins->rs1, stage->rs1_value);
+    stage->rs2_value = forward_operand(cpu, ins->rs2, stage->rs2_value);
+    stage->rs3_value = forward_operand(cpu, ins->rs3, stage->rs3_value);
+}
+
+/*
+ * Counts the sources of the instruction issuing in execute that came over
+ * a bypass, by the stage of their writer
+ */
+static void
+count_bypasses(APEX_CPU *cpu, const APEX_Decoded *ins)
+{
+    unsigned int sources = ins->src_mask & REGISTER_BITS;
+    int reg;
+
+    for (reg = 0; sources; ++reg, sources >>= 1)
+    {
+        if ((sources & 1) && bypass_ready(cpu, reg))
         {
-            printf("%s,R%d,R%d ", stage->opcode_str, stage->rs1, stage->rs2);
-            break;
+            cpu->bypass_uses[cpu->scoreboard.producer[reg]
+                             == PRODUCER_WRITEBACK ? BYPASS_WRITEBACK
+                                                   : BYPASS_MEMORY]++;
         }
+    }
+}
 
+/*
+ * TRUE while the instruction in execute cannot issue for a data hazard: the
+ * value of one of its sources (the zero flag for BZ/BNZ) is not ready this
+ * cycle, i.e. it is being loaded or computed in a unit. A later writer of a
+ * register still being computed waits as well (it would complete first), and
+ * so does HALT behind any operation in a unit.
+ */
+static int
+execute_waits(const APEX_CPU *cpu)
+{
+    const APEX_Decoded *ins = &cpu->decoded[cpu->execute->insn];
+    const APEX_Scoreboard *sb = &cpu->scoreboard;
+    unsigned int sources = ins->src_mask;
+    int reg;
 
-        case OPCODE_LOAD:
+    if (cpu->execute->cycles_left != 0)
+    {
+        return FALSE;
+    }
+
+    if (ins->opcode == OPCODE_HALT)
+    {
+        return cpu->num_inflight > 0;
+    }
+
+    for (reg = 0; sources; ++reg, sources >>= 1)
+    {
+        if ((sources & 1) && sb->producer[reg] != PRODUCER_NONE
+            && sb->ready[reg] > cpu->clock)
         {
-            printf("%s,R%d,R%d,#%d ", stage->opcode_str, stage->rd, stage->rs1,
-                    stage->imm);
-            break;
+            return TRUE;
         }
+    }
 
-        case OPCODE_STORE:
+    return ins->handler.writeback == writeback_reg
+           && sb->producer[ins->rd] == PRODUCER_UNIT;
+}
+
+/*
+ * TRUE if the unit of the instruction in execute cannot take it this cycle:
+ * the unit is still busy with an earlier operation, or a multi-cycle
+ * operation finds every in-flight latch taken
+ */
+static int
+unit_blocked(const APEX_CPU *cpu, const int cycles)
+{
+    const int unit = APEX_functional_unit(&cpu->decoded[cpu->execute->insn]);
+
+    if (cpu->execute->cycles_left != 0 || unit == FU_NONE)
+    {
+        return FALSE;
+    }
+    return cpu->unit_busy[unit] > 0
+           || (cycles > 1 && cpu->num_inflight == EXECUTE_MAX_INFLIGHT);
+}
+
+/*
+ * Instruction cache lookup of the PC fetch is about to read, done once per
+ * PC. Returns TRUE while fetch still waits for the line.
+ */
+int
+APEX_cpu_fetch_waits(APEX_CPU *cpu)
+{
+    int cycles;
+
+    if (cpu->fetch_wait > 0)
+    {
+        return TRUE;
+    }
+    if (cpu->fetch_missed)
+    {
+        /* The line has arrived */
+        return FALSE;
+    }
+
+    cycles = APEX_cache_access(&cpu->icache, cpu->pc, FALSE, cpu->pc,
+                               cpu->clock);
+    if (cycles > 1)
+    {
+        cpu->fetch_wait = cycles - 1;
+        cpu->fetch_missed = TRUE;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * Works out, from the current latches only, which stages hold on to their
+ * instruction this cycle and whether a taken branch flushes decode and
+ * fetch. The stages themselves then only need their own latch and this.
+ */
+static void
+control_cycle(APEX_CPU *cpu)
+{
+    APEX_Cycle_Control *control = &cpu->control;
+    const CPU_Stage *execute = cpu->execute;
+    int i;
+
+    /* Cycles still needed in memory and execute, this one included */
+    control->memory_cycles = cpu->memory->cycles_left;
+    if (cpu->memory->has_insn && control->memory_cycles == 0)
+    {
+        control->memory_cycles = memory_latency(cpu, cpu->memory);
+    }
+    control->execute_cycles = execute->cycles_left;
+    if (execute->has_insn && control->execute_cycles == 0)
+    {
+        control->execute_cycles = execute_latency(cpu, execute);
+    }
+    build_scoreboard(cpu);
+
+    control->memory_stall = cpu->memory->has_insn
+                            && control->memory_cycles > 1;
+
+    /* The oldest operation done in its unit moves on to memory */
+    control->unit_done = -1;
+    for (i = 0; i < cpu->num_inflight && !control->memory_stall; ++i)
+    {
+        if (cpu->inflight[i]->cycles_left <= 1)
         {
-            printf("%s,R%d,R%d,#%d ", stage->opcode_str, stage->rs1, stage->rs2,
-                    stage->imm);
+            control->unit_done = i;
             break;
         }
+    }
 
-        case OPCODE_BZ:
-        case OPCODE_BNZ:
+    control->execute_wait = execute->has_insn && execute_waits(cpu);
+    control->unit_stall = execute->has_insn && !control->execute_wait
+                          && unit_blocked(cpu, control->execute_cycles);
+    control->execute_wait = control->execute_wait || control->unit_stall;
+
+    /* A multi-cycle operation spends all but its first cycle in the unit,
+     * execute is free again in the next cycle */
+    control->execute_to_unit = execute->has_insn && execute->cycles_left == 0
+                               && !control->execute_wait
+                               && control->execute_cycles > 1;
+
+    /* Otherwise memory has to take the instruction, an older one leaving
+     * its unit goes first */
+    control->execute_stall
+        = execute->has_insn && !control->execute_to_unit
+          && (control->execute_wait || control->memory_stall
+              || control->unit_done >= 0);
+
+    /* A branch resolves in its first execute cycle; fetch went on at the
+     * PC it predicted, which travels in result */
+    control->resolve = execute->has_insn && execute->cycles_left == 0
+                       && !control->execute_wait
+                       && is_branch(&cpu->decoded[execute->insn]);
+    control->taken = control->resolve && branch_taken(cpu, execute);
+    control->flush
+        = control->resolve
+          && execute->result != (control->taken
+                                 ? execute->pc + cpu->decoded[execute->insn].imm
+                                 : execute->pc + 4);
+
+    control->decode_stall
+        = cpu->decode->has_insn
+          && (control->execute_stall || decode_interlocked(cpu));
+
+    /* Fetch holds the PC while decode is stalled, and the new PC of a
+     * mispredicted branch is fetched from the next cycle. There is nothing
+     * to fetch past the end of code memory. */
+    control->fetch = cpu->fetch_enabled && !cpu->stop_fetch
+                     && cpu->fetch_bubbles == 0 && !control->decode_stall
+                     && !control->flush && APEX_cpu_pc_in_code(cpu);
+
+    /* A missed line keeps coming in while decode is stalled */
+    control->fetch_miss = FALSE;
+    if (cpu->icache.num_sets && !control->flush
+        && (control->fetch || cpu->fetch_wait > 0))
+    {
+        control->fetch_miss = APEX_cpu_fetch_waits(cpu);
+        control->fetch = control->fetch && !control->fetch_miss;
+    }
+}
+
+/*
+ * Source the instruction in execute waits for (see execute_waits): the
+ * first one whose value is not ready, else its destination, which a unit
+ * still has to write. -1 for HALT waiting for the units to empty.
+ */
+static int
+waiting_source(const APEX_CPU *cpu)
+{
+    const APEX_Decoded *ins = &cpu->decoded[cpu->execute->insn];
+    const APEX_Scoreboard *sb = &cpu->scoreboard;
+    unsigned int sources = ins->src_mask;
+    int reg;
+
+    if (ins->opcode == OPCODE_HALT)
+    {
+        return -1;
+    }
+    for (reg = 0; sources; ++reg, sources >>= 1)
+    {
+        if ((sources & 1) && sb->producer[reg] != PRODUCER_NONE
+            && sb->ready[reg] > cpu->clock)
         {
-            printf("%s,#%d ", stage->opcode_str, stage->imm);
-            break;
+            return reg;
         }
+    }
+    return ins->rd;
+}
 
-        case OPCODE_HALT:
+/* First source decode is interlocked on (see decode_interlocked) */
+static int
+interlocked_source(const APEX_CPU *cpu)
+{
+    unsigned int sources = (cpu->scoreboard.pending | dest_mask(cpu, cpu->execute))
+                           & cpu->decoded[cpu->decode->insn].src_mask
+                           & REGISTER_BITS;
+    int reg = 0;
+
+    for (; !(sources & 1); ++reg, sources >>= 1)
+    {
+    }
+    return reg;
+}
+
+/*
+ * CPI stack: charges the cycle to exactly one cause, seen from execute,
+ * where every instruction issues once and no wrong path instruction ever
+ * gets to. A cycle that issues is retiring. Otherwise the instruction that
+ * cannot issue is charged, or, with execute empty, what kept the next one
+ * away: a decode interlock, the flush of a mispredicted branch, the end of
+ * the program or fetch. Runs after control_cycle, writeback does not touch
+ * anything it looks at.
+ */
+static void
+account_cycle(APEX_CPU *cpu)
+{
+    const APEX_Cycle_Control *control = &cpu->control;
+    const CPU_Stage *execute = cpu->execute;
+    int cause, pc, reg, index;
+    int interlock = -1;
+
+    if (execute->has_insn && execute->cycles_left != 0)
+    {
+        /* Issued already, memory is not taking it */
+        cause = CYCLE_STRUCTURAL;
+        pc = execute->pc;
+        cpu->structural_cycles[STRUCTURAL_MEMORY]++;
+    }
+    else if (execute->has_insn && control->unit_stall)
+    {
+        cause = CYCLE_STRUCTURAL;
+        pc = execute->pc;
+        cpu->structural_cycles[APEX_functional_unit(
+            &cpu->decoded[execute->insn])]++;
+    }
+    else if (execute->has_insn && control->execute_wait)
+    {
+        reg = waiting_source(cpu);
+        cause = reg < 0 ? CYCLE_DRAIN : CYCLE_RAW;
+        pc = execute->pc;
+        if (reg >= 0)
         {
-            printf("%s", stage->opcode_str);
-            break;
+            cpu->raw_cycles[reg]++;
         }
     }
+    else if (execute->has_insn)
+    {
+        cause = CYCLE_RETIRING;
+        pc = execute->pc;
+        cpu->flush_pc = control->flush ? execute->pc : -1;
+        if (cpu->decoded[execute->insn].opcode == OPCODE_HALT)
+        {
+            cpu->drain_pc = execute->pc;
+        }
+    }
+    else if (cpu->decode->has_insn
+             && (decode_interlocked(cpu) || cpu->interlock_source >= 0))
+    {
+        /* Until it issues, decode reading the value included */
+        reg = decode_interlocked(cpu) ? interlocked_source(cpu)
+                                      : cpu->interlock_source;
+        cause = CYCLE_RAW;
+        pc = cpu->decode->pc;
+        cpu->raw_cycles[reg]++;
+        interlock = reg;
+    }
+    else if (cpu->flush_pc >= 0)
+    {
+        cause = CYCLE_FLUSH;
+        pc = cpu->flush_pc;
+    }
+    else if (cpu->drain_pc >= 0 || cpu->stop_fetch)
+    {
+        cause = CYCLE_DRAIN;
+        pc = cpu->drain_pc >= 0 ? cpu->drain_pc : cpu->pc;
+    }
+    else
+    {
+        /* Charged to the PC fetch is working on */
+        cause = CYCLE_FRONTEND;
+        pc = cpu->pc;
+    }
+
+    cpu->interlock_source = interlock;
+    cpu->cycle_causes[cause]++;
+    index = get_code_memory_index_from_pc(pc);
+    if (index >= 0 && index < cpu->code_memory_size)
+    {
+        cpu->pc_cycles[index * NUM_CYCLE_CAUSES + cause]++;
+    }
 }
 
-/* Debug function which prints the CPU stage content
- *
- * Note: You can edit this function to print in more detail
+/*
+ * Clock edge: every instruction whose stage did not hold on to it moves to
+ * the next stage. Latches are handed on by swapping the stage pointers, from
+ * writeback backwards so that each one lands in a latch that was just freed.
  */
 static void
-print_stage_content(const char *name, const CPU_Stage *stage)
+advance(CPU_Stage **from, CPU_Stage **to)
 {
-    printf("%-15s: pc(%d) ", name, stage->pc);
-    print_instruction(stage);
-    printf("\n");
+    CPU_Stage *empty = *to;
+
+    *to = *from;
+    *from = empty;
+    empty->has_insn = FALSE;
 }
 
-/* Debug function which prints the register file
- *
- * Note: You are not supposed to edit this function
- */
+/* In-flight operation k moves on to memory, the younger ones close up */
 static void
-print_reg_file(const APEX_CPU *cpu)
+leave_unit(APEX_CPU *cpu, const int k)
 {
+    CPU_Stage *spare;
     int i;
 
-    printf("----------\n%s\n----------\n", "Registers:");
-
-    for (int i = 0; i < REG_FILE_SIZE / 2; ++i)
+    advance(&cpu->inflight[k], &cpu->memory);
+    spare = cpu->inflight[k];
+    for (i = k + 1; i < cpu->num_inflight; ++i)
     {
-        printf("R%-3d[%-3d] ", i, cpu->regs[i]);
-
-        
+        cpu->inflight[i - 1] = cpu->inflight[i];
     }
+    cpu->inflight[--cpu->num_inflight] = spare;
+}
 
-    printf("\n");
+static void
+commit_latches(APEX_CPU *cpu)
+{
+    const APEX_Cycle_Control *control = &cpu->control;
+    const CPU_Stage *branch = cpu->execute;
 
-    for (i = (REG_FILE_SIZE / 2); i < REG_FILE_SIZE; ++i)
+    /* The predictor learns the branch resolved in execute, and repairs its
+     * history after a misprediction */
+    if (control->resolve)
     {
-        printf("R%-3d[%-3d] ", i, cpu->regs[i]);
-        
+        APEX_bpred_update(&cpu->bpred, branch->pc,
+                          (unsigned int)branch->memory_address,
+                          control->taken,
+                          branch->pc + cpu->decoded[branch->insn].imm,
+                          control->flush);
     }
 
-    printf("\n");
-}
-
+    /* Writeback retired its instruction */
+    cpu->writeback->has_insn = FALSE;
 
-int comparator(int a,int b)
-{
-    if(a == b)
+    if (cpu->memory->has_insn && !control->memory_stall)
     {
-        return TRUE;
+        advance(&cpu->memory, &cpu->writeback);
+    }
+    if (control->unit_done >= 0)
+    {
+        leave_unit(cpu, control->unit_done);
+    }
+    if (control->execute_to_unit)
+    {
+        advance(&cpu->execute, &cpu->inflight[cpu->num_inflight++]);
+    }
+    else if (cpu->execute->has_insn && !control->execute_stall)
+    {
+        advance(&cpu->execute, &cpu->memory);
+    }
+    if (control->flush)
+    {
+        cpu->decode->has_insn = FALSE;
+    }
+    else if (cpu->decode->has_insn && !control->decode_stall)
+    {
+        advance(&cpu->decode, &cpu->execute);
+    }
+    if (control->fetch)
+    {
+        advance(&cpu->fetch, &cpu->decode);
     }
-    return FALSE;
 }
 
-
 /*
  * Fetch Stage of APEX Pipeline
  *
@@ -167,73 +1150,82 @@ int comparator(int a,int b)
 static void
 APEX_fetch(APEX_CPU *cpu)
 {
-    APEX_Instruction *current_ins;
+    const APEX_Decoded *current_ins;
+    unsigned int history;
 
-    if (cpu->fetch.has_insn)
+    /* A mispredicted branch in execute enables fetch again */
+    if ((cpu->fetch_enabled || cpu->control.flush) && !cpu->stop_fetch)
     {
-        /* This fetches new branch target instruction from next cycle */
-
+        /* The new PC is fetched from the next cycle */
+        if (cpu->control.flush)
+        {
+            return;
+        }
 
-        if (cpu->fetch_from_next_cycle == TRUE)
+        if (cpu->fetch_bubbles > 0)
         {
-            cpu->fetch_from_next_cycle = FALSE;
+            cpu->fetch_bubbles--;
+            return;
+        }
 
-            /* Skip this cycle*/
+        /* The line of the PC is still on its way from memory */
+        if (cpu->control.fetch_miss)
+        {
+            cpu->fetch_wait--;
+            cpu->fetch_stalls++;
             return;
         }
 
-        /* Store current PC in fetch latch */
-        cpu->fetch.pc = cpu->pc;
-
-        /* Index into code memory using this pc and copy all instruction fields
-        / * into fetch latch  */
-        current_ins = &cpu->code_memory[get_code_memory_index_from_pc(cpu->pc)];
-        strcpy(cpu->fetch.opcode_str, current_ins->opcode_str);
-        cpu->fetch.opcode = current_ins->opcode;
-        cpu->fetch.rd = current_ins->rd;
-        cpu->fetch.rs1 = current_ins->rs1;
-        cpu->fetch.rs2 = current_ins->rs2;
-        cpu->fetch.rs3 = current_ins->rs3;
-        cpu->fetch.imm = current_ins->imm;
-        
-        
-        /* Update PC for next instruction */
-        
-        
-            cpu->pc += 4;
-            /* Copy data from fetch latch to decode latch*/
-            cpu->decode = cpu->fetch;
-    
-        
+        /* The program ran off the end of code memory, or a predicted
+         * target is outside it; a flush may still bring the PC back */
+        if (!APEX_cpu_pc_in_code(cpu))
+        {
+            trace_stage(cpu, TRACE_STAGE_FETCH, TRACE_STATE_EMPTY, cpu->fetch);
+            return;
+        }
 
-        if (ENABLE_DEBUG_MESSAGES)
+        /* Decode is stalled, hold the PC */
+        if (!cpu->control.fetch)
         {
-            print_stage_content("Fetch", &cpu->fetch);
+            return;
         }
-        
+        cpu->fetch_missed = FALSE;
+
+        /* Store current PC in a fresh fetch latch */
+        *cpu->fetch = empty_latch;
+        cpu->fetch->pc = cpu->pc;
+        cpu->fetch->has_insn = TRUE;
 
-        if(cpu->fetch.opcode == OPCODE_NOP)
+        /* Only the index into the pre-decoded table travels down the
+         * pipeline, the operands are read from there by each stage */
+        cpu->fetch->insn = get_code_memory_index_from_pc(cpu->pc);
+        current_ins = &cpu->decoded[cpu->fetch->insn];
+
+        /* Update PC for next instruction, predicted for a branch */
+        if (is_branch(current_ins))
+        {
+            cpu->fetch->result = APEX_bpred_predict(&cpu->bpred, cpu->pc,
+                                                    &history);
+            cpu->fetch->memory_address = (int)history;
+            cpu->pc = cpu->fetch->result;
+        }
+        else
         {
-            printf("NOP");
+            cpu->pc += 4;
         }
+
+        trace_stage(cpu, TRACE_STAGE_FETCH, TRACE_STATE_ACTIVE, cpu->fetch);
+
         /* Stop fetching new instructions if HALT is fetched */
-        if (cpu->fetch.opcode == OPCODE_HALT )
+        if (current_ins->opcode == OPCODE_HALT)
         {
-            //cpu->pc += 4;
-            //cpu->decode = cpu->fetch;
-            cpu->fetch.has_insn = FALSE;
+            cpu->fetch_enabled = FALSE;
         }
-        
     }
     else
         {
-            printf("Fetch : Empty\n");
+            trace_stage(cpu, TRACE_STAGE_FETCH, TRACE_STATE_EMPTY, cpu->fetch);
         }
-
-    //for (int i =0;i<16;i++)
-    //{
-    //    printf("Register Status: %d \n",cpu->regs_status[i]);
-    //}
 }
 
 /*
@@ -244,230 +1236,27 @@ APEX_fetch(APEX_CPU *cpu)
 static void
 APEX_decode(APEX_CPU *cpu)
 {
-    
-    if (cpu->decode.has_insn)
+    if (cpu->decode->has_insn && !cpu->control.flush)
     {
-        /* Read operands from register file based on the instruction type */
-        
-        switch (cpu->decode.opcode)
+        /* Execute is busy or a source is not written yet */
+        if (cpu->control.decode_stall)
         {
-            case OPCODE_ADD:
-            case OPCODE_SUB:
-            case OPCODE_MUL:
-            case OPCODE_DIV:
-            case OPCODE_AND:
-            case OPCODE_OR:
-            case OPCODE_XOR:
-            {
-                        //printf("%d\t %d\t%d\t%d",cpu->writeback.
-                        //result_bus.tag,cpu->writeback.result_bus.buffer,cpu->execute.
-                        //result_bus.tag,cpu->execute.result_bus.buffer);
-                if(cpu->regs_status[cpu->decode.rs1] == 1 && cpu->regs_status[cpu->decode.rs2] == 1)
-                {
-                    cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                    cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                    cpu->regs_status[cpu->decode.rd] = 0;
-                    cpu->decode.checker = 0;
-                }
-                else
-                {
-
-                    ///For Memory :
-                    if(comparator(cpu->decode.rs1,cpu->writeback.result_bus.tag))
-                    {
-
-                        ///printf("%d\t %d",cpu->writeback.
-                        //result_bus.tag,cpu->writeback.result_bus.buffer);
-                        cpu->decode.rs1_value = cpu->writeback.result_bus.buffer;
-                        cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                    }
-
-                    else if(comparator(cpu->decode.rs2,cpu->writeback.result_bus.tag))
-                    {
-                        cpu->decode.rs2_value = cpu->writeback.result_bus.buffer;
-                        cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                    }
-
-                //For execute :
-                    else if(comparator(cpu->decode.rs1,cpu->execute.result_bus.tag))
-                    {
-                        cpu->decode.rs1_value = cpu->execute.result_bus.buffer;
-                        cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-
-                    }
-
-                    else if(comparator(cpu->decode.rs2,cpu->execute.result_bus.tag))
-                    {
-                        cpu->decode.rs2_value = cpu->execute.result_bus.buffer;
-                        cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-
-                    }
-                    else 
-                    {
-                        cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                        cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                    }
-                    cpu->regs_status[cpu->decode.rd] = 0;
-                    cpu->decode.checker = 0;
-                }
-                break;
-            }
-
-            case OPCODE_ADDL:
-            case OPCODE_SUBL:
-            case OPCODE_LOAD:
-            {
-                if(cpu->regs_status[cpu->decode.rs1] == 1 )
-                {
-                    cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                    cpu->regs_status[cpu->decode.rd] = 0;
-                    cpu->decode.checker = 0;
-                }
-                else
-                {
-                    if(comparator(cpu->decode.rs1,cpu->writeback.result_bus.tag))
-                    {
-                        cpu->decode.rs1_value = cpu->writeback.result_bus.buffer;
-                    }
-                    else 
-                        cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-
-                    if(comparator(cpu->decode.rs1,cpu->execute.result_bus.tag))
-                    {
-                        cpu->decode.rs1_value = cpu->execute.result_bus.buffer;
-                    }
-                    else 
-                        cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];                   
-
-                    cpu->regs_status[cpu->decode.rd] = 0;
-                    cpu->decode.checker = 0;
-                
-                }
-                break;
-            }
-
-
-            case OPCODE_STR:
-            {
-                if(comparator(cpu->decode.rs1,cpu->memory.rd))
-                {
-                    cpu->decode.rs1_value = cpu->memory.result_bus.buffer;
-                }
-                if(comparator(cpu->decode.rs1,cpu->execute.rd))
-                {
-                    cpu->decode.rs1_value = cpu->execute.result_bus.buffer;
-                }
-                else
-                {
-                    cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                }
-                ///
-                if(comparator(cpu->decode.rs2,cpu->memory.rd))
-                {
-                    cpu->decode.rs2_value = cpu->memory.result_bus.buffer;
-                }
-                if(comparator(cpu->decode.rs2,cpu->execute.rd))
-                {
-                    cpu->decode.rs2_value = cpu->execute.result_bus.buffer;
-                }
-                else
-                {
-                    cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                }
-
-                //
-                if(comparator(cpu->decode.rs3,cpu->memory.rd))
-                {
-                    cpu->decode.rs3_value = cpu->memory.result_bus.buffer;
-                }
-                if(comparator(cpu->decode.rs3,cpu->execute.rd))
-                {
-                    cpu->decode.rs3_value = cpu->execute.result_bus.buffer;
-                }
-                else
-                {
-                    cpu->decode.rs3_value = cpu->regs[cpu->decode.rs3];
-                }
-                break;
-            }
-            case OPCODE_LDR:
-            case OPCODE_CMP:
-            case OPCODE_STORE:
-            {
-                if(comparator(cpu->decode.rs1,cpu->memory.rd))
-                {
-                    cpu->decode.rs1_value = cpu->memory.result_bus.buffer;
-                }
-                if(comparator(cpu->decode.rs1,cpu->execute.rd))
-                {
-                    cpu->decode.rs1_value = cpu->execute.result_bus.buffer;
-                }
-                else
-                {
-                    cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                }
-
-                if(comparator(cpu->decode.rs2,cpu->memory.rd))
-                {
-                    cpu->decode.rs2_value = cpu->memory.result_bus.buffer;
-                }
-                if(comparator(cpu->decode.rs2,cpu->execute.rd))
-                {
-                    cpu->decode.rs2_value = cpu->execute.result_bus.buffer;
-                }
-                else
-                {
-                    cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                }
-                    //cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                    
-                
-                
-                break;
-            }
-
-            case OPCODE_MOVC:
-            {
-                
-                break;
-            }
-            case OPCODE_HALT:
-            {
-                /* MOVC doesn't have register operands */
-                cpu->execute = cpu->decode;
-                //printf("d/rf");
-                cpu->decode.has_insn = FALSE;
-                break;
-            }
-
-            case OPCODE_NOP:
-            {
-                printf("NOP");
-                break;
-            }
+            cpu->decode_stalls++;
+            trace_stage(cpu, TRACE_STAGE_DECODE, TRACE_STATE_STALL, cpu->decode);
+            return;
         }
 
-        /* Copy data from decode latch to execute latch*/
+        /* Read operands from register file */
+        read_registers(cpu, cpu->decode);
 
-        
-        //if (tempo)
-        //{
-          //  printf("checking validity");
-        
-        cpu->execute = cpu->decode;
-        cpu->decode.has_insn = FALSE;
-        cpu->execute.has_insn = TRUE;
-        
-        if (ENABLE_DEBUG_MESSAGES)
-        {
-            print_stage_content("Decode/RF", &cpu->decode);
-        }
-        
-    
+        /* Execute starts over with this instruction */
+        cpu->decode->cycles_left = 0;
+
+        trace_stage(cpu, TRACE_STAGE_DECODE, TRACE_STATE_ACTIVE, cpu->decode);
     }
     else
         {
-            printf("Decode :  Empty\n");
+            trace_stage(cpu, TRACE_STAGE_DECODE, TRACE_STATE_EMPTY, cpu->decode);
         }
 }
 
@@ -476,224 +1265,91 @@ APEX_decode(APEX_CPU *cpu)
  *
  * Note: You are free to edit this function according to your implementation
  */
-
 static void
 APEX_execute(APEX_CPU *cpu)
 {
-    if (cpu->execute.has_insn)
-    {
-        /* Execute logic based on instruction type */
+    const APEX_Decoded *ins;
+    int i, unit;
 
-        switch (cpu->execute.opcode)
+    /* Operations in the units count down, the one leaving for memory
+     * starts over there */
+    for (i = 0; i < cpu->num_inflight; ++i)
+    {
+        if (i == cpu->control.unit_done)
         {
-            case OPCODE_ADD:
-            {
-                cpu->execute.result_bus.buffer 
-                    = cpu->execute.rs1_value + cpu->execute.rs2_value ;
-                
-                cpu->execute.result_bus.tag = cpu->execute.rd;
-
-                
-                
-                break;
-            }
-
-            case OPCODE_ADDL:
-            {
-                cpu->execute.result_bus.buffer = cpu->execute.rs1_value + cpu->execute.imm ;
-                cpu->execute.result_bus.tag = cpu->execute.rd;
-
-                
-                break;
-            }
-
-            case OPCODE_SUB:
-            {
-                cpu->execute.result_bus.buffer = (cpu->execute.rs1_value) - (cpu->execute.rs2_value);
-                cpu->execute.result_bus.tag = cpu->execute.rd;
-
-                
-                break;
-            }
-
-            case OPCODE_SUBL:
-            {
-                cpu->execute.result_bus.buffer = cpu->execute.rs1_value - cpu->execute.imm ;
-                cpu->execute.result_bus.tag = cpu->execute.rd;
-
-                
-                break;
-            }
-
-            case OPCODE_MUL:
-            {
-                cpu->execute.result_bus.buffer = cpu->execute.rs1_value *  (cpu->execute.rs2_value) ;
-                cpu->execute.result_bus.tag = cpu->execute.rd;
-
-                
-                break;
-            }
-            case OPCODE_DIV:
-            {
-                cpu->execute.result_bus.buffer = (cpu->execute.rs1_value) * (1 / (cpu->execute.rs2_value) );
-                cpu->execute.result_bus.tag = cpu->execute.rd;
-
-                
-                break;
-            }
-
-
-            case OPCODE_AND:
-            {
-                cpu->execute.result_bus.buffer = (cpu->execute.rs1_value) & (cpu->execute.rs2_value);
-                cpu->execute.result_bus.tag = cpu->execute.rd;
-
-                
-                break;
-            }
-
-            case OPCODE_OR:
-            {
-                cpu->execute.result_bus.buffer = (cpu->execute.rs1_value )|(cpu->execute.rs2_value);
-                cpu->execute.result_bus.tag = cpu->execute.rd;
-
-                
-                break;
-            }
-
-            case OPCODE_XOR:
-            {
-                cpu->execute.result_bus.buffer = (cpu->execute.rs1_value )^(cpu->execute.rs2_value);
-                cpu->execute.result_bus.tag = cpu->execute.rd;
-
-                
-                break;
-            }
-
-            case OPCODE_LOAD:
-            {
-                cpu->execute.result_bus.buffer = cpu->execute.rs1_value + cpu->execute.imm;
-                cpu->execute.result_bus.tag = cpu->execute.rd;
-
-                
-                break;
-            }
-
-            case OPCODE_LDR:
-            {
-                cpu->execute.result_bus.buffer = cpu->execute.rs1_value + cpu->execute.rs2_value;
-                cpu->execute.result_bus.tag = cpu->execute.rd;
-                
-                
-                break;
-            }
-
-            case OPCODE_STORE:
-            {
-                cpu->execute.result_bus.buffer = cpu->execute.rs1_value + cpu->execute.imm;
-                break;
-            }
+            cpu->inflight[i]->cycles_left = 0;
+        }
+        else if (cpu->inflight[i]->cycles_left > 1)
+        {
+            cpu->inflight[i]->cycles_left--;
+        }
+    }
+    for (unit = 0; unit < NUM_FUNCTIONAL_UNITS; ++unit)
+    {
+        if (cpu->unit_busy[unit] > 0)
+        {
+            cpu->unit_busy[unit]--;
+        }
+    }
 
-            case OPCODE_STR:
-            {
-                cpu->execute.result_bus.buffer = cpu->execute.rs1_value + cpu->execute.rs2_value;
-                break;
-            }
+    if (cpu->execute->has_insn)
+    {
+        ins = &cpu->decoded[cpu->execute->insn];
+        unit = APEX_functional_unit(ins);
 
-            case OPCODE_CMP:
+        /* Execute logic based on instruction type, in the first cycle the
+         * operands are available */
+        if (cpu->execute->cycles_left == 0)
+        {
+            if (cpu->config.forwarding)
             {
-                if (cpu->execute.rs1_value == cpu->execute.rs2_value)
-                {
-                    cpu->zero_flag = TRUE;
-                    break;
-                }
-                else 
-                {
-                    cpu->zero_flag = FALSE;
-                    break;
-                }
+                forward_operands(cpu, cpu->execute);
             }
 
-
-            case OPCODE_BZ:
+            if (cpu->control.unit_stall)
             {
-                if (cpu->zero_flag == TRUE)
-                {
-                    /* Calculate new PC, and send it to fetch unit */
-                    cpu->pc = cpu->execute.pc + cpu->execute.imm;
-                    
-                    /* Since we are using reverse callbacks for pipeline stages, 
-                        * this will prevent the new instruction from being fetched in the current cycle*/
-                    cpu->fetch_from_next_cycle = TRUE;
-
-                    /* Flush previous stages */
-                    cpu->decode.has_insn = FALSE;
-
-                    /* Make sure fetch stage is enabled to start fetching from new PC */
-                    cpu->fetch.has_insn = TRUE;
-                }
-                break;
+                cpu->unit_stalls[unit]++;
             }
-
-            case OPCODE_BNZ:
+            else if (!cpu->control.execute_wait)
             {
-                if (cpu->zero_flag == FALSE)
+                if (cpu->config.forwarding)
                 {
-                    /* Calculate new PC, and send it to fetch unit */
-                    cpu->pc = cpu->execute.pc + cpu->execute.imm;
-                    
-                    /* Since we are using reverse callbacks for pipeline stages, 
-                        * this will prevent the new instruction from being fetched in the current cycle*/
-                    cpu->fetch_from_next_cycle = TRUE;
-
-                    /* Flush previous stages */
-                    cpu->decode.has_insn = FALSE;
-
-                    /* Make sure fetch stage is enabled to start fetching from new PC */
-                    cpu->fetch.has_insn = TRUE;
+                    count_bypasses(cpu, ins);
                 }
-                break;
-            }
-
-            case OPCODE_MOVC: 
-            {
-                cpu->execute.result_bus.buffer = cpu->execute.imm;
-                
-                /* Set the zero flag based on the result buffer */
-                if (cpu->execute.result_bus.buffer == 0)
-                {
-                    cpu->zero_flag = TRUE;
-                } 
-                else 
+                ins->handler.execute(cpu, cpu->execute);
+                cpu->execute->cycles_left = cpu->control.execute_cycles;
+                if (unit != FU_NONE)
                 {
-                    cpu->zero_flag = FALSE;
+                    cpu->unit_ops[unit]++;
+                    cpu->unit_busy[unit]
+                        = APEX_unit_interval(&cpu->config, unit) - 1;
                 }
-                break;
-            }
-            case OPCODE_HALT:
-            {
-                break;
-            }
-            case OPCODE_NOP:
-            {
-                printf("NOP");
-                break;
             }
         }
 
-        /* Copy data from execute latch to memory latch*/
-        cpu->memory = cpu->execute;
-        cpu->execute.has_insn = FALSE;
+        /* The rest of a multi-cycle operation is spent in its unit */
+        if (cpu->control.execute_to_unit)
+        {
+            cpu->execute->cycles_left = cpu->control.execute_cycles - 1;
+            trace_stage(cpu, TRACE_STAGE_EXECUTE, TRACE_STATE_ACTIVE, cpu->execute);
+            return;
+        }
 
-        if (ENABLE_DEBUG_MESSAGES)
+        /* Waiting for an operand or its unit, or memory is busy */
+        if (cpu->control.execute_stall)
         {
-            print_stage_content("Execute", &cpu->execute);
+            trace_stage(cpu, TRACE_STAGE_EXECUTE, TRACE_STATE_STALL, cpu->execute);
+            return;
         }
-        
+
+        /* Memory starts over with this instruction */
+        cpu->execute->cycles_left = 0;
+
+        trace_stage(cpu, TRACE_STAGE_EXECUTE, TRACE_STATE_ACTIVE, cpu->execute);
     }
     else
         {
-            printf("Execute : Empty\n");
+            trace_stage(cpu, TRACE_STAGE_EXECUTE, TRACE_STATE_EMPTY, cpu->execute);
         }
 }
 
@@ -702,78 +1358,30 @@ APEX_execute(APEX_CPU *cpu)
  *
  * Note: You are free to edit this function according to your implementation
  */
-static void
-APEX_memory(APEX_CPU *cpu)
-{
-    if (cpu->memory.has_insn )
-    {
-        switch (cpu->memory.opcode)
-        {
-            case OPCODE_ADD:
-            case OPCODE_SUB:
-            case OPCODE_MUL:
-            case OPCODE_DIV:
-            case OPCODE_ADDL:
-            case OPCODE_SUBL:
-            case OPCODE_AND:
-            case OPCODE_OR:
-            case OPCODE_XOR:
-            case OPCODE_CMP:
-            case OPCODE_MOVC:
-            {
-                /* No work for ADD */
-                
-                break;
-            }
-
-            case OPCODE_LOAD:
-            case OPCODE_LDR:
-            {
-                /* Read from data memory */
-                cpu->memory.result_bus.buffer = cpu->data_memory[cpu->memory.memory_address];
-                cpu->memory.result_bus.tag = cpu->memory.rd;
-
-                
-                break;
-            }
-
-            case OPCODE_STORE:
-            {
-                cpu->memory.result_bus.buffer = cpu->memory.rs1_value;
-                
-                break;
-            }
-            case OPCODE_STR:
-            {
-                cpu->memory.result_bus.buffer = cpu->memory.rs1_value;
-                
-                break;
-            }
-            case OPCODE_HALT:
-            {
-                break;
-            }
-            case OPCODE_NOP:
-            {
-                printf("NOP");
-                break;
-            }
-            
+static void
+APEX_memory(APEX_CPU *cpu)
+{
+    if (cpu->memory->has_insn )
+    {
+        if (cpu->memory->cycles_left == 0)
+        {
+            cpu->decoded[cpu->memory->insn].handler.memory(cpu, cpu->memory);
+            cpu->memory->cycles_left = cpu->control.memory_cycles;
         }
 
-        /* Copy data from memory latch to writeback latch*/
-        cpu->writeback = cpu->memory;
-        cpu->memory.has_insn = FALSE;
-
-        if (ENABLE_DEBUG_MESSAGES)
+        /* Memory access takes more than one cycle */
+        if (cpu->control.memory_stall)
         {
-            print_stage_content("Memory", &cpu->memory);
+            cpu->memory->cycles_left--;
+            trace_stage(cpu, TRACE_STAGE_MEMORY, TRACE_STATE_STALL, cpu->memory);
+            return;
         }
-        
+
+        trace_stage(cpu, TRACE_STAGE_MEMORY, TRACE_STATE_ACTIVE, cpu->memory);
     }
     else
         {
-            printf("Memory : Empty\n");
+            trace_stage(cpu, TRACE_STAGE_MEMORY, TRACE_STATE_EMPTY, cpu->memory);
         }
 }
 
@@ -785,79 +1393,74 @@ APEX_memory(APEX_CPU *cpu)
 static int
 APEX_writeback(APEX_CPU *cpu)
 {
-    if (cpu->writeback.has_insn)
+    if (cpu->writeback->has_insn)
     {
         /* Write result to register file based on instruction type */
-        switch (cpu->writeback.opcode)
-        {
-            case OPCODE_ADD:
-            case OPCODE_SUB:
-            case OPCODE_MUL:
-            case OPCODE_DIV:
-            case OPCODE_ADDL:
-            case OPCODE_SUBL:
-            case OPCODE_AND:
-            case OPCODE_OR:
-            case OPCODE_XOR:
-            {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_bus.buffer;
-                
-                break;
-            }
-
-            case OPCODE_LOAD:
-            case OPCODE_LDR:
-            {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_bus.buffer;
-                
-                break;
-            }
-
-            case OPCODE_MOVC: 
-            {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_bus.buffer;
-                
-                break;
-            }
-
-            case OPCODE_STORE:
-            case OPCODE_STR:
-            case OPCODE_CMP:
-            {
-                break;
-            }
-            case OPCODE_NOP:
-            {
-                printf("NOP");
-                break;
-            }
-        }
+        cpu->decoded[cpu->writeback->insn].handler.writeback(cpu, cpu->writeback);
 
         cpu->insn_completed++;
-        cpu->writeback.has_insn = FALSE;
 
-        if (ENABLE_DEBUG_MESSAGES)
-        {
-            print_stage_content("Writeback", &cpu->writeback);
-        }
-        
+        trace_stage(cpu, TRACE_STAGE_WRITEBACK, TRACE_STATE_ACTIVE, cpu->writeback);
 
-        if (cpu->writeback.opcode == OPCODE_HALT)
+        if (cpu->decoded[cpu->writeback->insn].opcode == OPCODE_HALT)
         {
             /* Stop the APEX simulator */
-            //printf("WRItebAck ");
             return TRUE;
         }
-        
     }
     else
         {
-            printf("Writeback : Empty\n");
+            trace_stage(cpu, TRACE_STAGE_WRITEBACK, TRACE_STATE_EMPTY, cpu->writeback);
         }
     /* Default */
     return 0;
 }
 
+/*
+ * Empties all pipeline latches so the detailed model can (re)start fetching
+ * at cpu->pc, e.g. after the functional engine has fast-forwarded the
+ * architectural state. Result bus tags are invalidated so that stale latches
+ * are never picked up by the forwarding logic.
+ */
+void
+APEX_cpu_reset_pipeline(APEX_CPU *cpu)
+{
+    int i;
+
+    for (i = 0; i < 5 + EXECUTE_MAX_INFLIGHT; ++i)
+    {
+        cpu->latches[i] = empty_latch;
+    }
+    for (i = 0; i < EXECUTE_MAX_INFLIGHT; ++i)
+    {
+        cpu->inflight[i] = &cpu->latches[5 + i];
+    }
+    cpu->num_inflight = 0;
+    memset(cpu->unit_busy, 0, sizeof(cpu->unit_busy));
+    cpu->fetch = &cpu->latches[0];
+    cpu->decode = &cpu->latches[1];
+    cpu->execute = &cpu->latches[2];
+    cpu->memory = &cpu->latches[3];
+    cpu->writeback = &cpu->latches[4];
+    memset(&cpu->control, 0, sizeof(cpu->control));
+    memset(&cpu->scoreboard, 0, sizeof(cpu->scoreboard));
+
+    cpu->fetch_bubbles = 0;
+    cpu->fetch_wait = 0;
+    cpu->fetch_missed = FALSE;
+    cpu->stop_fetch = FALSE;
+    cpu->flush_pc = -1;
+    cpu->drain_pc = -1;
+    cpu->interlock_source = -1;
+    if (cpu->ooo)
+    {
+        APEX_ooo_reset(cpu->ooo);
+    }
+
+    /* To start fetch stage */
+    cpu->fetch_enabled = TRUE;
+}
+
 /*
  * This function creates and initializes APEX cpu.
  *
@@ -866,14 +1469,175 @@ APEX_writeback(APEX_CPU *cpu)
 APEX_CPU *
 APEX_cpu_init(const char *filename,const char *disp_sim)
 {
-    int i;
+    return APEX_cpu_init_with_output(filename, disp_sim, stdout, stderr,
+                                     APEX_LOG_FULL);
+}
+
+/*
+ * Same as APEX_cpu_init, but everything the cpu prints goes to out and err
+ * instead of stdout and stderr, and only as much as log_level asks for. Used
+ * by the batch runner to keep the output of concurrent runs apart.
+ */
+APEX_CPU *
+APEX_cpu_init_with_output(const char *filename, const char *disp_sim,
+                          FILE *out, FILE *err, const int log_level)
+{
+    APEX_Instruction *code_memory;
+    APEX_Decoded *decoded;
     APEX_CPU *cpu;
+    int size;
 
     if (!filename)
     {
         return NULL;
     }
-    
+
+    /* Parse input file and create code memory */
+    code_memory = create_code_memory(filename, &size, &decoded);
+    if (!code_memory)
+    {
+        return NULL;
+    }
+
+    cpu = APEX_cpu_init_shared(code_memory, decoded, size, disp_sim, out, err,
+                               log_level);
+    if (!cpu)
+    {
+        free(code_memory);
+        free(decoded);
+        return NULL;
+    }
+
+    cpu->owns_code = TRUE;
+    return cpu;
+}
+
+/* No cache; the other settings apply once a size is given */
+static void
+default_cache_config(APEX_Cache_Config *cache)
+{
+    cache->size = 0;
+    cache->ways = 2;
+    cache->line_size = 16;
+    cache->policy = CACHE_POLICY_LRU;
+    cache->write_back = TRUE;
+    cache->hit_latency = 1;
+    cache->miss_latency = 10;
+    cache->prefetch = CACHE_PREFETCH_NONE;
+    cache->prefetch_degree = 2;
+    cache->prefetch_distance = 4;
+}
+
+/*
+ * Default timing: forwarding on, single cycle execute and memory, no extra
+ * branch penalty (the original APEX pipeline)
+ */
+void
+APEX_cpu_default_config(APEX_Pipeline_Config *config)
+{
+    config->forwarding = TRUE;
+    config->branch_penalty = 0;
+    config->alu_latency = 1;
+    config->alu_interval = 1;
+    config->mul_latency = 1;
+    config->mul_interval = 1;
+    config->div_latency = 1;
+    config->div_interval = 0;
+    config->agu_latency = 1;
+    config->agu_interval = 1;
+    config->mem_latency = 1;
+
+    default_cache_config(&config->dcache);
+    default_cache_config(&config->icache);
+
+    /* No prediction; the other settings apply once a predictor is chosen */
+    config->bpred.kind = BPRED_NONE;
+    config->bpred.size = 1024;
+    config->bpred.history = 12;
+    config->bpred.btb_size = 64;
+
+    /* Scalar and in order; the sizes apply once the out-of-order core or a
+     * wider pipeline is chosen */
+    config->ooo = FALSE;
+    config->rob_size = 32;
+    config->iq_size = 16;
+    config->phys_regs = 48;
+    config->width = 1;
+    config->mem_ports = 1;
+    config->branch_ports = 1;
+    config->lsq_size = 16;
+    config->lsq_policy = LSQ_RESOLVED;
+}
+
+/*
+ * Sets the timing of cpu and builds its (empty) caches, (cold) branch
+ * predictor and, for out-of-order issue or a width above 1, the superscalar
+ * core
+ *
+ * Returns 0 on success, -1 if a cache geometry, the predictor or the shape
+ * of the superscalar core is not valid
+ */
+int
+APEX_cpu_configure(APEX_CPU *cpu, const APEX_Pipeline_Config *config)
+{
+    APEX_cache_free(&cpu->dcache);
+    APEX_cache_free(&cpu->icache);
+    APEX_bpred_free(&cpu->bpred);
+    APEX_ooo_free(cpu->ooo);
+    cpu->ooo = NULL;
+    cpu->config = *config;
+    if (APEX_cache_init(&cpu->dcache, &config->dcache) != 0
+        || APEX_cache_init(&cpu->icache, &config->icache) != 0
+        || APEX_bpred_init(&cpu->bpred, &config->bpred) != 0)
+    {
+        return -1;
+    }
+    if (config->ooo || config->width > 1)
+    {
+        cpu->ooo = APEX_ooo_create(config);
+        if (!cpu->ooo)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Replaces the data memory of cpu by a zeroed one of words words, preloaded
+ * from filename when it is not NULL. Meant to be called right after init.
+ *
+ * Returns 0 on success, -1 on failure (the old memory is kept then)
+ */
+int
+APEX_cpu_set_data_memory(APEX_CPU *cpu, const unsigned int words,
+                         const char *filename)
+{
+    APEX_Memory mem;
+
+    if (APEX_memory_init(&mem, words, filename) != 0)
+    {
+        return -1;
+    }
+
+    APEX_memory_free(&cpu->data_memory);
+    cpu->data_memory = mem;
+    return 0;
+}
+
+/*
+ * Creates an APEX cpu running an already parsed program. The code memory is
+ * only read, so any number of cpus (also on different threads) can share
+ * one image; it stays owned by the caller and must outlive the cpus.
+ */
+APEX_CPU *
+APEX_cpu_init_shared(APEX_Instruction *code_memory, APEX_Decoded *decoded,
+                     const int size, const char *disp_sim, FILE *out,
+                     FILE *err, const int log_level)
+{
+    int i;
+    APEX_CPU *cpu;
+
     cpu = calloc(1, sizeof(APEX_CPU));
 
     if (!cpu)
@@ -881,18 +1645,20 @@ APEX_cpu_init(const char *filename,const char *disp_sim)
         return NULL;
     }
 
+    cpu->out = out;
+    cpu->err = err;
+    cpu->log_level = log_level;
+
     /* Initialize PC, Registers and all pipeline stages */
     cpu->pc = 4000;
     memset(cpu->regs, 0, sizeof(int) * REG_FILE_SIZE); 
-    
-    //Making it valid
-    memset(cpu->regs_status, 0 ,sizeof(int) * REG_FILE_SIZE);
-    
-    for (int i=0;i<16;i++)
+
+    /* Pages of data memory are only allocated when written */
+    if (APEX_memory_init(&cpu->data_memory, DATA_MEMORY_SIZE, NULL) != 0)
     {
-        cpu->regs_status[i]= 0;
+        free(cpu);
+        return NULL;
     }
-    memset(cpu->data_memory, 0, sizeof(int) * DATA_MEMORY_SIZE);
 
     if(strcmp(disp_sim,"display") == 0)
     {
@@ -902,88 +1668,153 @@ APEX_cpu_init(const char *filename,const char *disp_sim)
     {
         cpu->single_step = DISABLE_SINGLE_STEP;
     }
-    
 
-    /* Parse input file and create code memory */
-    cpu->code_memory = create_code_memory(filename, &cpu->code_memory_size);
-    if (!cpu->code_memory)
+    APEX_cpu_default_config(&cpu->config);
+
+    cpu->code_memory = code_memory;
+    cpu->decoded = decoded;
+    cpu->code_memory_size = size;
+
+    cpu->pc_cycles = calloc((size_t)size * NUM_CYCLE_CAUSES, sizeof(long));
+    if (!cpu->pc_cycles && size > 0)
     {
+        APEX_memory_free(&cpu->data_memory);
         free(cpu);
         return NULL;
     }
 
-    cpu->fetch.checker = 0;
-    cpu->decode.checker = 0;
-    cpu->execute.checker = 0;
-    cpu->memory.checker = 0;
-    cpu->writeback.checker = 0;
-    
+    /* Translations of any previously loaded code are stale now */
+    APEX_func_invalidate(cpu);
+
+    APEX_cpu_reset_pipeline(cpu);
 
-    if (ENABLE_DEBUG_MESSAGES)
+    if (ENABLE_DEBUG_MESSAGES && cpu->log_level >= APEX_LOG_FULL)
     {
-        fprintf(stderr,
+        fprintf(cpu->err,
                 "APEX_CPU: Initialized APEX CPU, loaded %d instructions\n",
                 cpu->code_memory_size);
-        fprintf(stderr, "APEX_CPU: PC initialized to %d\n", cpu->pc);
-        fprintf(stderr, "APEX_CPU: Printing Code Memory\n");
-        printf("%-9s %-9s %-9s %-9s %-9s\n", "opcode_str", "rd", "rs1", "rs2",
+        fprintf(cpu->err, "APEX_CPU: PC initialized to %d\n", cpu->pc);
+        fprintf(cpu->err, "APEX_CPU: Printing Code Memory\n");
+        fprintf(cpu->out, "%-9s %-9s %-9s %-9s %-9s\n", "opcode_str", "rd", "rs1", "rs2",
                 "imm");
 
         for (i = 0; i < cpu->code_memory_size; ++i)
         {
-            printf("%-9s %-9d %-9d %-9d %-9d\n", cpu->code_memory[i].opcode_str,
+            fprintf(cpu->out, "%-9s %-9d %-9d %-9d %-9d\n", cpu->code_memory[i].opcode_str,
                     cpu->code_memory[i].rd, cpu->code_memory[i].rs1,
                     cpu->code_memory[i].rs2, cpu->code_memory[i].imm);
         }
         
     }
 
-    /* To start fetch stage */
-    cpu->fetch.has_insn = TRUE;
     return cpu;
 }
 
+/*
+ * Simulates one clock cycle of the pipeline in three steps: control_cycle
+ * decides stalls and flushes from the current latches, every stage updates
+ * the latch of its own instruction (which becomes the next state), and
+ * commit_latches moves the latches on at the clock edge. The stages can be
+ * evaluated in any order; they are called in the order their text is
+ * printed. State outside the latches is written by one stage per cycle at
+ * most (the register file is bypassed in decode). Returns TRUE when HALT
+ * retired in writeback (the remaining stages are not evaluated in that
+ * cycle) or when memory accessed a word outside data memory
+ * (cpu->data_memory.fault is set then). The caller advances cpu->clock.
+ */
+int
+APEX_cpu_cycle(APEX_CPU *cpu)
+{
+    if (cpu->trace)
+    {
+        APEX_trace_cycle(cpu->trace, cpu->clock);
+    }
+    else if (ENABLE_DEBUG_MESSAGES && cpu->log_level >= APEX_LOG_STAGE)
+    {
+        APEX_trace_print_cycle(cpu->out, cpu->clock);
+    }
+
+    /* The superscalar core has its own stages, see apex_ooo.c */
+    if (cpu->ooo)
+    {
+        if (APEX_ooo_cycle(cpu))
+        {
+            return TRUE;
+        }
+        print_reg_file(cpu);
+        return FALSE;
+    }
+
+    control_cycle(cpu);
+
+    if (APEX_writeback(cpu))
+    {
+        /* Halt in writeback stage */
+        return TRUE;
+    }
+
+    /* Like cpu->clock, the CPI stack leaves out the cycle HALT retires in */
+    account_cycle(cpu);
+
+    APEX_memory(cpu);
+    APEX_execute(cpu);
+    APEX_decode(cpu);
+    APEX_fetch(cpu);
+    commit_latches(cpu);
+
+    print_reg_file(cpu);
+    return cpu->data_memory.fault;
+}
+
+/* TRUE when no instruction is left in any latch after fetch or in a unit */
+int
+APEX_cpu_pipeline_empty(const APEX_CPU *cpu)
+{
+    if (cpu->ooo)
+    {
+        return APEX_ooo_empty(cpu->ooo);
+    }
+    return !cpu->decode->has_insn && !cpu->execute->has_insn
+           && !cpu->memory->has_insn && !cpu->writeback->has_insn
+           && cpu->num_inflight == 0;
+}
+
 /*
  * APEX CPU simulation loop
  *
+ * Returns TRUE when the program ran to HALT
+ *
  * Note: You are free to edit this function according to your implementation
  */
-void
+int
 APEX_cpu_run(APEX_CPU *cpu,const int cycles_expected)
 {
     char user_prompt_val;
+    int halted = FALSE;
 
     while (TRUE)
     {
-        if (ENABLE_DEBUG_MESSAGES)
+        if (APEX_cpu_cycle(cpu))
         {
-            printf("--------------------------------------------\n");
-            printf("Clock Cycle #: %d\n", cpu->clock);
-            printf("--------------------------------------------\n");
-        }
-
-        if (APEX_writeback(cpu))
-        {
-            /* Halt in writeback stage */
-            printf("APEX_CPU: Simulation Complete, cycles = %d instructions = %d\n", (cpu->clock), cpu->insn_completed);
+            if (cpu->data_memory.fault)
+            {
+                APEX_cpu_report_fault(cpu);
+                fprintf(cpu->out, "APEX_CPU: Simulation Stopped, cycles = %d instructions = %d\n", (cpu->clock), cpu->insn_completed);
+                break;
+            }
+            fprintf(cpu->out, "APEX_CPU: Simulation Complete, cycles = %d instructions = %d\n", (cpu->clock), cpu->insn_completed);
+            halted = TRUE;
             break;
         }
 
-        APEX_memory(cpu);
-        APEX_execute(cpu);
-        APEX_decode(cpu);
-        APEX_fetch(cpu);
-
-        print_reg_file(cpu);
-
         if (cpu->single_step)
         {
-            printf("Press any key to advance CPU Clock or <q> to quit:\n");
+            fprintf(cpu->out, "Press any key to advance CPU Clock or <q> to quit:\n");
             scanf("%c", &user_prompt_val);
 
             if ((user_prompt_val == 'Q') || (user_prompt_val == 'q'))
             {
-                printf("APEX_CPU: Simulation Stopped, cycles = %d instructions = %d\n", (cpu->clock), cpu->insn_completed);
+                fprintf(cpu->out, "APEX_CPU: Simulation Stopped, cycles = %d instructions = %d\n", (cpu->clock), cpu->insn_completed);
                 break;
             }
         }
@@ -997,20 +1828,208 @@ APEX_cpu_run(APEX_CPU *cpu,const int cycles_expected)
         }
         
     }
-        printf("\n =============== STATE OF ARCHITECTURAL REGISTER FILE ========== \n");
+    APEX_cpu_print_arch_state(cpu);
+    return halted;
+}
 
-        for (int i = 0; i<16;i++)
-        {
-            printf("Reg[%d] | Value = %d | Status =  VALID \n", i,cpu->regs[i]);
-        }
+/*
+ * Prints the timing and use of every functional unit, unless all of them
+ * take one cycle (the original single ALU)
+ */
+static void
+print_unit_stats(const APEX_CPU *cpu)
+{
+    int unit, multi_cycle = FALSE;
+
+    for (unit = 0; unit < NUM_FUNCTIONAL_UNITS; ++unit)
+    {
+        multi_cycle = multi_cycle
+                      || APEX_unit_latency(&cpu->config, unit) > 1
+                      || APEX_unit_interval(&cpu->config, unit) > 1;
+    }
+    if (!multi_cycle)
+    {
+        return;
+    }
+
+    fprintf(cpu->out, "\n ============== FUNCTIONAL UNITS ============= \n");
+    for (unit = 0; unit < NUM_FUNCTIONAL_UNITS; ++unit)
+    {
+        fprintf(cpu->out, "%s | Latency = %d | Interval = %d | "
+                "Operations = %ld | Structural stalls = %ld\n",
+                unit_names[unit], APEX_unit_latency(&cpu->config, unit),
+                APEX_unit_interval(&cpu->config, unit), cpu->unit_ops[unit],
+                cpu->unit_stalls[unit]);
+    }
+}
+
+/* Prints how many source values each bypass path delivered */
+static void
+print_bypass_stats(const APEX_CPU *cpu)
+{
+    int path;
+
+    fprintf(cpu->out, "\n ============== BYPASS NETWORK ============= \n");
+    for (path = 0; path < NUM_BYPASS_PATHS; ++path)
+    {
+        fprintf(cpu->out, "%s | Operands = %ld\n", bypass_names[path],
+                cpu->bypass_uses[path]);
+    }
+}
+
+/*
+ * Prints the CPI stack: the cycles charged to each cause with their share
+ * of the CPI, the sources RAW stalls waited for and the resources that were
+ * busy, then the same causes for every PC that was charged a cycle
+ */
+static void
+print_cpi_stack(const APEX_CPU *cpu)
+{
+    const long insns = cpu->insn_completed;
+    const long *row;
+    long cycles, total = 0;
+    int cause, reg, unit, i, n;
+    char name[8];
+
+    for (cause = 0; cause < NUM_CYCLE_CAUSES; ++cause)
+    {
+        total += cpu->cycle_causes[cause];
+    }
 
-        printf("\n ============== STATE OF DATA MEMORY ============= \n");
+    fprintf(cpu->out, "\n ============== CPI STACK ============= \n");
+    for (cause = 0; cause < NUM_CYCLE_CAUSES; ++cause)
+    {
+        cycles = cpu->cycle_causes[cause];
+        fprintf(cpu->out, "%-12s | Cycles = %ld | CPI = %.3f | %.2f%%\n",
+                cause_names[cause], cycles,
+                insns ? (double)cycles / insns : 0.0,
+                total ? 100.0 * cycles / total : 0.0);
 
-        for (int j=0; j<100;j++)
+        if (cause == CYCLE_RAW && cycles)
+        {
+            fprintf(cpu->out, "    Waiting for:");
+            for (reg = 0, n = 0; reg < SCOREBOARD_REGS; ++reg)
+            {
+                if (cpu->raw_cycles[reg])
+                {
+                    if (reg == SCOREBOARD_FLAG)
+                    {
+                        snprintf(name, sizeof(name), "Z");
+                    }
+                    else
+                    {
+                        snprintf(name, sizeof(name), "R%d", reg);
+                    }
+                    fprintf(cpu->out, "%s %s = %ld", n++ ? " |" : "", name,
+                            cpu->raw_cycles[reg]);
+                }
+            }
+            fprintf(cpu->out, "\n");
+        }
+        if (cause == CYCLE_STRUCTURAL && cycles)
+        {
+            fprintf(cpu->out, "    Busy:");
+            for (unit = 0, n = 0; unit <= STRUCTURAL_MEMORY; ++unit)
             {
-                printf("MEM[%d] | Data Value = %d \n",j,cpu->data_memory[j]);
+                if (cpu->structural_cycles[unit])
+                {
+                    fprintf(cpu->out, "%s %s = %ld", n++ ? " |" : "",
+                            unit == STRUCTURAL_MEMORY ? "Memory"
+                                                      : unit_names[unit],
+                            cpu->structural_cycles[unit]);
+                }
             }
+            fprintf(cpu->out, "\n");
+        }
+    }
+    fprintf(cpu->out, "%-12s | Cycles = %ld | CPI = %.3f\n", "Total", total,
+            insns ? (double)total / insns : 0.0);
+
+    fprintf(cpu->out, "\n%-6s %-6s", "PC", "Opcode");
+    for (cause = 0; cause < NUM_CYCLE_CAUSES; ++cause)
+    {
+        fprintf(cpu->out, " | %12s", cause_names[cause]);
+    }
+    fprintf(cpu->out, "\n");
+    for (i = 0; i < cpu->code_memory_size; ++i)
+    {
+        row = &cpu->pc_cycles[i * NUM_CYCLE_CAUSES];
+        for (cause = 0; cause < NUM_CYCLE_CAUSES && !row[cause]; ++cause)
+        {
+        }
+        if (cause == NUM_CYCLE_CAUSES)
+        {
+            continue;
+        }
+        fprintf(cpu->out, "%-6d %-6s", 4000 + i * 4,
+                cpu->code_memory[i].opcode_str);
+        for (cause = 0; cause < NUM_CYCLE_CAUSES; ++cause)
+        {
+            fprintf(cpu->out, " | %12ld", row[cause]);
+        }
+        fprintf(cpu->out, "\n");
+    }
+}
 
+/*
+ * Prints the architectural register file, the first 100 words of data
+ * memory and the cache and branch predictor counters, used at the end of a
+ * run
+ */
+void
+APEX_cpu_print_arch_state(const APEX_CPU *cpu)
+{
+    if (cpu->log_level < APEX_LOG_SUMMARY)
+    {
+        return;
+    }
+
+    fprintf(cpu->out, "\n =============== STATE OF ARCHITECTURAL REGISTER FILE ========== \n");
+
+    for (int i = 0; i<16;i++)
+    {
+        fprintf(cpu->out, "Reg[%d] | Value = %d | Status =  VALID \n", i,cpu->regs[i]);
+    }
+
+    fprintf(cpu->out, "\n ============== STATE OF DATA MEMORY ============= \n");
+
+    for (int j=0; j<100 && j<(int)cpu->data_memory.size;j++)
+    {
+        fprintf(cpu->out, "MEM[%d] | Data Value = %d \n",j,
+                APEX_memory_peek(&cpu->data_memory, j));
+    }
+
+    APEX_cache_print_stats(&cpu->dcache, "L1 DATA CACHE", cpu->out);
+    APEX_cache_print_stats(&cpu->icache, "L1 INSTRUCTION CACHE", cpu->out);
+    if (cpu->icache.num_sets)
+    {
+        fprintf(cpu->out, "Fetch stall cycles = %ld\n", cpu->fetch_stalls);
+    }
+
+    print_unit_stats(cpu);
+    if (!cpu->ooo)
+    {
+        print_bypass_stats(cpu);
+        print_cpi_stack(cpu);
+    }
+
+    /* A misprediction flushes decode and fetch plus the branch penalty */
+    APEX_bpred_print_stats(&cpu->bpred, cpu->insn_completed,
+                           2 + cpu->config.branch_penalty, cpu->out);
+
+    if (cpu->ooo)
+    {
+        APEX_ooo_print_stats(cpu->ooo, cpu->out);
+    }
+}
+
+/* Reports the access outside data memory that stopped the program */
+void
+APEX_cpu_report_fault(const APEX_CPU *cpu)
+{
+    fprintf(cpu->err, "APEX_Error: Data memory access out of range, "
+            "address = %d (data memory has %u words)\n",
+            cpu->data_memory.fault_address, cpu->data_memory.size);
 }
 
 /*
@@ -1021,6 +2040,21 @@ APEX_cpu_run(APEX_CPU *cpu,const int cycles_expected)
 void
 APEX_cpu_stop(APEX_CPU *cpu)
 {    
-    free(cpu->code_memory);
+    if (cpu->trace && APEX_trace_close(cpu->trace) != 0)
+    {
+        fprintf(cpu->err, "APEX_Error: Unable to write the pipeline trace\n");
+    }
+    if (cpu->owns_code)
+    {
+        free(cpu->code_memory);
+        free(cpu->decoded);
+    }
+    APEX_func_invalidate(cpu);
+    APEX_memory_free(&cpu->data_memory);
+    APEX_cache_free(&cpu->dcache);
+    APEX_cache_free(&cpu->icache);
+    APEX_bpred_free(&cpu->bpred);
+    APEX_ooo_free(cpu->ooo);
+    free(cpu->pc_cycles);
     free(cpu);
 }
\ No newline at end of file
@@ -9,7 +9,12 @@
 #ifndef _APEX_CPU_H_
 #define _APEX_CPU_H_
 
+#include <stdio.h>
+
+#include "apex_bpred.h"
+#include "apex_cache.h"
 #include "apex_macros.h"
+#include "apex_memory.h"
 
 /* Format of an APEX instruction  */
 typedef struct APEX_Instruction
@@ -23,59 +28,257 @@ typedef struct APEX_Instruction
     int imm;
 } APEX_Instruction;
 
-/* Model of CPU stage latch */
+struct APEX_CPU;
+struct CPU_Stage;
+struct APEX_TCache;
+struct APEX_Trace;
+struct APEX_OoO;
+
+/* Work done by one pipeline stage for one instruction */
+typedef void (*APEX_Stage_Handler)(struct APEX_CPU *cpu, struct CPU_Stage *stage);
+
+/* Stage handlers of one opcode */
+typedef struct APEX_Opcode_Handlers
+{
+    APEX_Stage_Handler execute;
+    APEX_Stage_Handler memory;
+    APEX_Stage_Handler writeback;
+} APEX_Opcode_Handlers;
+
+/* The zero flag is tracked like one more register by the scoreboard */
+#define SCOREBOARD_FLAG REG_FILE_SIZE
+#define SCOREBOARD_REGS (REG_FILE_SIZE + 1)
+
+/* Pre-decoded form of an APEX instruction, built once in create_code_memory */
+typedef struct APEX_Decoded
+{
+    APEX_Opcode_Handlers handler;
+    int imm;
+    unsigned int src_mask;   /* Bit per register read, SCOREBOARD_FLAG for BZ/BNZ */
+    unsigned char opcode;
+    signed char rd;
+    signed char rs1;
+    signed char rs2;
+    signed char rs3;
+} APEX_Decoded;
+
+/* Stage handlers indexed by the numeric OPCODE_* identifiers */
+extern const APEX_Opcode_Handlers APEX_opcode_handlers[NUM_OPCODES];
+
+/* Functional units of the execute stage */
+#define FU_NONE -1 /* Branches, HALT and NOP take one cycle and no unit */
+#define FU_ALU 0
+#define FU_MUL 1
+#define FU_DIV 2
+#define FU_AGU 3   /* Address generation of loads and stores */
+#define NUM_FUNCTIONAL_UNITS 4
+
+/* Operations that can still be in their unit after leaving execute */
+#define EXECUTE_MAX_INFLIGHT 8
+
+/*
+ * Model of CPU stage latch. Latches only refer to code memory (insn) and are
+ * kept at 32 bytes, so the five stages of a cpu take 160 bytes. A BZ/BNZ
+ * has no result or address of its own; its latch carries the next PC fetch
+ * predicted in result and the predictor history in memory_address.
+ */
 typedef struct CPU_Stage
 {
     int pc;
-    char opcode_str[128];
-    int opcode;
-    int rs1;
-    int rs2;
-    int rs3; //third source for STR instructions
-    int rd;
-    int imm;
+    int insn; /* Index into code memory / pre-decoded table */
     int rs1_value;
     int rs2_value;
     int rs3_value; //third source value for STR instructions
-    //int result_buffer;
-
-    struct result_bus //structure initialized to maintain the result and its corresponding tag
-    {
-        int buffer; //buffer to hold the results
-        int tag;    //tag to hold the destination address required to compare in D/RF stage
-    }result_bus;
-
+    int result;         /* Result forwarded to the D/RF stage */
     int memory_address;
-    int has_insn;
-    int checker; // Stall checker :- 1 = stall and 0 = no stall
+    signed char result_tag;     /* Destination register of result, -1 = none */
+    unsigned char has_insn;
+    unsigned short cycles_left; /* Cycles still to spend in this stage, 0 = not started */
 } CPU_Stage;
 
+/*
+ * What the stages of one cycle need to know about each other, worked out
+ * from the current latches before any stage is evaluated
+ */
+typedef struct APEX_Cycle_Control
+{
+    int memory_cycles;  /* Cycles memory still needs, this one included */
+    int execute_cycles; /* Cycles execute still needs, this one included */
+    int memory_stall;   /* Memory keeps its instruction */
+    int execute_wait;   /* Execute waits for a load in memory */
+    int execute_stall;  /* Execute keeps its instruction */
+    int decode_stall;   /* Decode keeps its instruction */
+    int resolve;        /* A branch in execute is resolved this cycle */
+    int taken;          /* That branch is taken */
+    int flush;          /* It was mispredicted, decode and fetch are flushed */
+    int unit_stall;     /* Execute waits only because its unit is busy */
+    int execute_to_unit; /* Execute hands a multi-cycle operation to its unit */
+    int unit_done;      /* Operation leaving its unit for memory, -1 = none */
+    int fetch;          /* Fetch brings in a new instruction */
+    int fetch_miss;     /* Fetch waits for its line from the instruction cache */
+} APEX_Cycle_Control;
+
+/* Stage holding the youngest writer of a register */
+#define PRODUCER_NONE 0
+#define PRODUCER_UNIT 1      /* Still in a multi-cycle functional unit */
+#define PRODUCER_MEMORY 2
+#define PRODUCER_WRITEBACK 3
+
+/*
+ * Writers of every register beyond execute, built once per cycle from the
+ * latches (see control_cycle) so that every hazard and forwarding decision
+ * is a lookup. The instruction in execute is not in it, it is the reader.
+ */
+typedef struct APEX_Scoreboard
+{
+    unsigned int pending;  /* Registers a unit or memory still has to write */
+    unsigned char producer[SCOREBOARD_REGS]; /* PRODUCER_* of the youngest writer */
+    int ready[SCOREBOARD_REGS]; /* Clock from which execute can have its value */
+    const CPU_Stage *latch[SCOREBOARD_REGS]; /* Latch of the youngest writer */
+} APEX_Scoreboard;
+
+/* Paths a source value can take besides the register file */
+#define BYPASS_MEMORY 0      /* Memory to execute */
+#define BYPASS_WRITEBACK 1   /* Writeback to execute */
+#define BYPASS_DECODE 2      /* Writeback to decode, in the cycle it writes */
+#define NUM_BYPASS_PATHS 3
+
+/* Causes a cycle of the 5 stage pipeline is charged to in the CPI stack */
+#define CYCLE_RETIRING 0     /* An instruction issues in execute */
+#define CYCLE_RAW 1          /* The next one waits for a source */
+#define CYCLE_FLUSH 2        /* Bubble behind a mispredicted branch */
+#define CYCLE_STRUCTURAL 3   /* Its unit or the memory stage is busy */
+#define CYCLE_FRONTEND 4     /* Fetch has not delivered the next one */
+#define CYCLE_DRAIN 5        /* HALT has issued, or the pipeline is drained */
+#define NUM_CYCLE_CAUSES 6
+
+/* Structural stall cycles are kept per unit and for the memory stage */
+#define STRUCTURAL_MEMORY NUM_FUNCTIONAL_UNITS
+
+/* Timing parameters of the pipeline, see APEX_cpu_default_config */
+typedef struct APEX_Pipeline_Config
+{
+    int forwarding;     /* Forward results to decode, else interlock on RAW */
+    int branch_penalty; /* Extra fetch bubbles after a taken branch */
+    int alu_latency;    /* Execute cycles of all other instructions */
+    int alu_interval;   /* Cycles between two ALU operations, 0 = latency */
+    int mul_latency;    /* Execute cycles of MUL */
+    int mul_interval;   /* Cycles between two MULs, 0 = latency */
+    int div_latency;    /* Execute cycles of DIV */
+    int div_interval;   /* Cycles between two DIVs, 0 = latency */
+    int agu_latency;    /* Execute cycles of loads and stores */
+    int agu_interval;   /* Cycles between two loads or stores, 0 = latency */
+    int mem_latency;    /* Memory stage cycles of loads and stores, no dcache */
+    APEX_Cache_Config dcache; /* L1 data cache, size 0 = none */
+    APEX_Cache_Config icache; /* L1 instruction cache, size 0 = none */
+    APEX_Bpred_Config bpred;  /* Branch predictor of fetch */
+    int ooo;            /* Out-of-order core instead of the 5 stage pipeline */
+    int rob_size;       /* Reorder buffer entries of the out-of-order core */
+    int iq_size;        /* Issue queue entries */
+    int phys_regs;      /* Physical registers, zero flag included */
+    int width;          /* Instructions per cycle, above 1 uses the backend
+                           of the out-of-order core with in-order issue */
+    int mem_ports;      /* Loads and stores issued per cycle */
+    int branch_ports;   /* Branches issued per cycle */
+    int lsq_size;       /* Load/store queue entries */
+    int lsq_policy;     /* LSQ_*, when a load may pass older stores */
+} APEX_Pipeline_Config;
+
 /* Model of APEX CPU */
 typedef struct APEX_CPU
 {
     int pc;                        /* Current program counter */
     int clock;                     /* Clock cycles elapsed */
     int insn_completed;            /* Instructions retired */
+    long insn_fast_forwarded;      /* Instructions executed by the functional engine */
     int regs[REG_FILE_SIZE];       /* Integer register file */
-    int regs_status[REG_FILE_SIZE]; /* maintaining the status for stalling */
     int code_memory_size;          /* Number of instruction in the input file */
     APEX_Instruction *code_memory; /* Code Memory */
-    int data_memory[DATA_MEMORY_SIZE]; /* Data Memory */
+    APEX_Decoded *decoded;         /* Pre-decoded code memory */
+    const void **func_thread;      /* Threaded code built by the functional interpreter */
+    struct APEX_TCache *tcache;    /* Basic block translations of the functional engine */
+    APEX_Memory data_memory;       /* Data Memory, paged */
     int single_step;               /* Wait for user input after every cycle */
     int zero_flag;                 /* {TRUE, FALSE} Used by BZ and BNZ to branch */
-    int fetch_from_next_cycle;
-
-    /* Pipeline stages */
-    CPU_Stage fetch;
-    CPU_Stage decode;
-    CPU_Stage execute;
-    CPU_Stage memory;
-    CPU_Stage writeback;
+    int fetch_enabled;             /* Cleared when HALT is fetched, set by a mispredicted branch */
+    int stop_fetch;                /* Set to drain the pipeline without fetching */
+    int fetch_bubbles;             /* Fetch cycles left to skip after a branch */
+    int owns_code;                 /* Code memory is freed by APEX_cpu_stop */
+    APEX_Pipeline_Config config;
+    APEX_Cache dcache;             /* L1 data cache, see config.dcache */
+    APEX_Cache icache;             /* L1 instruction cache, see config.icache */
+    int fetch_wait;                /* Cycles fetch still waits for a missed line */
+    int fetch_missed;              /* Line of the PC was looked up and missed */
+    long fetch_stalls;             /* Cycles fetch waited on the instruction cache */
+    long decode_stalls;            /* Cycles decode (rename) held an instruction back */
+    APEX_Bpred bpred;              /* Branch predictor, see config.bpred */
+    int unit_busy[NUM_FUNCTIONAL_UNITS];   /* Cycles until a unit takes its next operation */
+    long unit_ops[NUM_FUNCTIONAL_UNITS];   /* Operations issued to each unit */
+    long unit_stalls[NUM_FUNCTIONAL_UNITS]; /* Cycles an operation waited for its unit */
+    long bypass_uses[NUM_BYPASS_PATHS];    /* Source values taken from each path */
+    long counter_base[NUM_COUNTERS];       /* Counter values at the last CLRCNT */
+    long cycle_causes[NUM_CYCLE_CAUSES];   /* CPI stack, cycles by CYCLE_* */
+    long raw_cycles[SCOREBOARD_REGS];      /* RAW stall cycles by source */
+    long structural_cycles[NUM_FUNCTIONAL_UNITS + 1]; /* By unit, STRUCTURAL_MEMORY */
+    long *pc_cycles;               /* CPI stack per code memory index, NUM_CYCLE_CAUSES each */
+    int flush_pc;                  /* Mispredicted branch whose bubbles are counted, -1 = none */
+    int drain_pc;                  /* HALT that has issued, -1 = none */
+    int interlock_source;          /* Source decode was interlocked on last cycle, -1 = none */
+    struct APEX_OoO *ooo;          /* Superscalar core, NULL for the 5 stage pipeline */
+    FILE *out;                     /* Stage trace and results (stdout by default) */
+    FILE *err;                     /* Diagnostics (stderr by default) */
+    int log_level;                 /* APEX_LOG_*, text printed by the cpu */
+    struct APEX_Trace *trace;      /* Binary pipeline trace instead of stage text */
+
+    /*
+     * Pipeline stages. The stage pointers rotate over latches[]: at the
+     * end of a cycle an instruction advancing from one stage to the next
+     * takes its latch along, see APEX_cpu_cycle.
+     */
+    CPU_Stage *fetch;
+    CPU_Stage *decode;
+    CPU_Stage *execute;
+    CPU_Stage *memory;
+    CPU_Stage *writeback;
+
+    /*
+     * Multi-cycle operations that left execute and are still in their
+     * unit, oldest first. The entries past num_inflight are spare latches.
+     */
+    int num_inflight;
+    CPU_Stage *inflight[EXECUTE_MAX_INFLIGHT];
+    APEX_Cycle_Control control;    /* Stalls and flush of this cycle */
+    APEX_Scoreboard scoreboard;    /* Register writers of this cycle */
+    CPU_Stage latches[5 + EXECUTE_MAX_INFLIGHT];
 } APEX_CPU;
 
-APEX_Instruction *create_code_memory(const char *filename, int *size);
+APEX_Instruction *create_code_memory(const char *filename, int *size,
+                                     APEX_Decoded **decoded);
+int get_code_memory_index_from_pc(const int pc);
+int APEX_cpu_pc_in_code(const APEX_CPU *cpu);
+int APEX_functional_unit(const APEX_Decoded *ins);
+int APEX_unit_latency(const APEX_Pipeline_Config *config, const int unit);
+int APEX_unit_interval(const APEX_Pipeline_Config *config, const int unit);
+int APEX_cpu_fetch_waits(APEX_CPU *cpu);
+int APEX_cpu_read_counter(const APEX_CPU *cpu, const int id, const long pending);
+void APEX_cpu_clear_counters(APEX_CPU *cpu, const long pending);
 APEX_CPU *APEX_cpu_init(const char *filename,const char *disp_sim);
-void APEX_cpu_run(APEX_CPU *cpu,const int cycles_expected);
+APEX_CPU *APEX_cpu_init_with_output(const char *filename, const char *disp_sim,
+                                    FILE *out, FILE *err, const int log_level);
+APEX_CPU *APEX_cpu_init_shared(APEX_Instruction *code_memory,
+                               APEX_Decoded *decoded, const int size,
+                               const char *disp_sim, FILE *out, FILE *err,
+                               const int log_level);
+void APEX_cpu_default_config(APEX_Pipeline_Config *config);
+int APEX_cpu_configure(APEX_CPU *cpu, const APEX_Pipeline_Config *config);
+void APEX_cpu_reset_pipeline(APEX_CPU *cpu);
+int APEX_cpu_set_data_memory(APEX_CPU *cpu, const unsigned int words,
+                             const char *filename);
+int APEX_cpu_cycle(APEX_CPU *cpu);
+int APEX_cpu_pipeline_empty(const APEX_CPU *cpu);
+int APEX_cpu_run(APEX_CPU *cpu,const int cycles_expected);
+void APEX_cpu_print_arch_state(const APEX_CPU *cpu);
+void APEX_cpu_report_fault(const APEX_CPU *cpu);
 int check_source_valid_fetch(APEX_CPU *cpu);
 int check_source_valid_decode(APEX_CPU *cpu);
 void APEX_cpu_stop(APEX_CPU *cpu);
@@ -0,0 +1,480 @@
+/*
+ * apex_func.c
+ * Contains the functional (ISA level) APEX execution engine. It works on the
+ * same APEX_CPU state as the pipeline (regs, data_memory, zero_flag, pc) but
+ * executes one whole instruction per step without modelling any latches, so
+ * it can be used to fast-forward to the region of interest of a program.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_cpu.h"
+#include "apex_func.h"
+#include "apex_macros.h"
+#include "apex_tcache.h"
+
+/*
+ * APEX_func_run dispatches through labels-as-values (direct threaded code)
+ * when the compiler supports it, build with -DAPEX_NO_COMPUTED_GOTO to use
+ * the portable switch based loop instead
+ */
+#if defined(__GNUC__) && !defined(APEX_NO_COMPUTED_GOTO)
+#define APEX_THREADED_DISPATCH 1
+#else
+#define APEX_THREADED_DISPATCH 0
+#endif
+
+/*
+ * Executes the instruction at cpu->pc and updates the architectural state.
+ *
+ * Returns TRUE if the executed instruction was HALT (or the PC ran off the end
+ * of code memory). The PC is left pointing at the HALT in that case. An
+ * access outside data memory also stops the program; the PC stays at that
+ * instruction, which does not count as executed, and cpu->data_memory.fault
+ * is set.
+ */
+int
+APEX_func_step(APEX_CPU *cpu)
+{
+    const APEX_Decoded *ins;
+    int index = get_code_memory_index_from_pc(cpu->pc);
+    int next_pc = cpu->pc + 4;
+    int value;
+
+    if (index < 0 || index >= cpu->code_memory_size)
+    {
+        return TRUE;
+    }
+
+    ins = &cpu->decoded[index];
+
+    switch (ins->opcode)
+    {
+        case OPCODE_ADD:
+        {
+            cpu->regs[ins->rd] = cpu->regs[ins->rs1] + cpu->regs[ins->rs2];
+            break;
+        }
+
+        case OPCODE_SUB:
+        {
+            cpu->regs[ins->rd] = cpu->regs[ins->rs1] - cpu->regs[ins->rs2];
+            break;
+        }
+
+        case OPCODE_MUL:
+        {
+            cpu->regs[ins->rd] = cpu->regs[ins->rs1] * cpu->regs[ins->rs2];
+            break;
+        }
+
+        case OPCODE_DIV:
+        {
+            if (cpu->regs[ins->rs2] == 0)
+            {
+                cpu->regs[ins->rd] = 0;
+            }
+            else
+            {
+                cpu->regs[ins->rd] = cpu->regs[ins->rs1] / cpu->regs[ins->rs2];
+            }
+            break;
+        }
+
+        case OPCODE_AND:
+        {
+            cpu->regs[ins->rd] = cpu->regs[ins->rs1] & cpu->regs[ins->rs2];
+            break;
+        }
+
+        case OPCODE_OR:
+        {
+            cpu->regs[ins->rd] = cpu->regs[ins->rs1] | cpu->regs[ins->rs2];
+            break;
+        }
+
+        case OPCODE_XOR:
+        {
+            cpu->regs[ins->rd] = cpu->regs[ins->rs1] ^ cpu->regs[ins->rs2];
+            break;
+        }
+
+        case OPCODE_ADDL:
+        {
+            cpu->regs[ins->rd] = cpu->regs[ins->rs1] + ins->imm;
+            break;
+        }
+
+        case OPCODE_SUBL:
+        {
+            cpu->regs[ins->rd] = cpu->regs[ins->rs1] - ins->imm;
+            break;
+        }
+
+        case OPCODE_MOVC:
+        {
+            cpu->regs[ins->rd] = ins->imm;
+
+            /* Same as the pipeline, MOVC updates the zero flag */
+            cpu->zero_flag = (ins->imm == 0) ? TRUE : FALSE;
+            break;
+        }
+
+        case OPCODE_LOAD:
+        {
+            /* A trapping load leaves Rd alone, like the pipeline */
+            value = APEX_memory_read(&cpu->data_memory,
+                                     cpu->regs[ins->rs1] + ins->imm);
+            if (!cpu->data_memory.fault)
+            {
+                cpu->regs[ins->rd] = value;
+            }
+            break;
+        }
+
+        case OPCODE_LDR:
+        {
+            value = APEX_memory_read(&cpu->data_memory,
+                                     cpu->regs[ins->rs1] + cpu->regs[ins->rs2]);
+            if (!cpu->data_memory.fault)
+            {
+                cpu->regs[ins->rd] = value;
+            }
+            break;
+        }
+
+        case OPCODE_STORE:
+        {
+            APEX_memory_write(&cpu->data_memory, cpu->regs[ins->rs2] + ins->imm,
+                              cpu->regs[ins->rs1]);
+            break;
+        }
+
+        case OPCODE_STR:
+        {
+            APEX_memory_write(&cpu->data_memory,
+                              cpu->regs[ins->rs2] + cpu->regs[ins->rs3],
+                              cpu->regs[ins->rs1]);
+            break;
+        }
+
+        case OPCODE_CMP:
+        {
+            cpu->zero_flag
+                = (cpu->regs[ins->rs1] == cpu->regs[ins->rs2]) ? TRUE : FALSE;
+            break;
+        }
+
+        case OPCODE_BZ:
+        {
+            if (cpu->zero_flag == TRUE)
+            {
+                next_pc = cpu->pc + ins->imm;
+            }
+            break;
+        }
+
+        case OPCODE_BNZ:
+        {
+            if (cpu->zero_flag == FALSE)
+            {
+                next_pc = cpu->pc + ins->imm;
+            }
+            break;
+        }
+
+        case OPCODE_HALT:
+        {
+            cpu->insn_fast_forwarded++;
+            return TRUE;
+        }
+
+        case OPCODE_NOP:
+        {
+            break;
+        }
+
+        case OPCODE_RDCNT:
+        {
+            cpu->regs[ins->rd] = APEX_cpu_read_counter(cpu, ins->imm, 0);
+            break;
+        }
+
+        case OPCODE_CLRCNT:
+        {
+            APEX_cpu_clear_counters(cpu, 0);
+            break;
+        }
+    }
+
+    if (cpu->data_memory.fault)
+    {
+        return TRUE;
+    }
+
+    cpu->pc = next_pc;
+    cpu->insn_fast_forwarded++;
+    return FALSE;
+}
+
+/*
+ * Executes up to insn_count instructions functionally. This is the fast path
+ * of the engine: it has the same semantics as APEX_func_step but keeps the PC
+ * as a code memory index and dispatches straight from one instruction to the
+ * next without returning to a central loop.
+ *
+ * Returns the number of instructions executed, *halted is set to TRUE if the
+ * program reached HALT (or faulted on data memory) before the budget was
+ * exhausted.
+ */
+long
+APEX_func_run(APEX_CPU *cpu, const long insn_count, int *halted)
+{
+    const APEX_Decoded *code = cpu->decoded;
+    const APEX_Decoded *ins;
+    const int size = cpu->code_memory_size;
+    int *regs = cpu->regs;
+    APEX_Memory *mem = &cpu->data_memory;
+    int zero_flag = cpu->zero_flag;
+    int index = get_code_memory_index_from_pc(cpu->pc);
+    long executed = 0;
+    int value;
+
+    *halted = FALSE;
+
+#if APEX_THREADED_DISPATCH
+    static const void *labels[NUM_OPCODES] = {
+        [OPCODE_ADD] = &&op_ADD,     [OPCODE_SUB] = &&op_SUB,
+        [OPCODE_MUL] = &&op_MUL,     [OPCODE_DIV] = &&op_DIV,
+        [OPCODE_AND] = &&op_AND,     [OPCODE_OR] = &&op_OR,
+        [OPCODE_XOR] = &&op_XOR,     [OPCODE_MOVC] = &&op_MOVC,
+        [OPCODE_LOAD] = &&op_LOAD,   [OPCODE_STORE] = &&op_STORE,
+        [OPCODE_BZ] = &&op_BZ,       [OPCODE_BNZ] = &&op_BNZ,
+        [OPCODE_HALT] = &&op_HALT,   [OPCODE_ADDL] = &&op_ADDL,
+        [OPCODE_SUBL] = &&op_SUBL,   [OPCODE_LDR] = &&op_LDR,
+        [OPCODE_STR] = &&op_STR,     [OPCODE_CMP] = &&op_CMP,
+        [OPCODE_NOP] = &&op_NOP,     [OPCODE_RDCNT] = &&op_RDCNT,
+        [OPCODE_CLRCNT] = &&op_CLRCNT,
+    };
+    const void **thread = cpu->func_thread;
+    int i;
+
+    /* Translate code memory into threaded code once per CPU */
+    if (!thread)
+    {
+        thread = malloc(sizeof(void *) * size);
+        if (!thread)
+        {
+            return 0;
+        }
+        for (i = 0; i < size; ++i)
+        {
+            thread[i] = labels[code[i].opcode];
+        }
+        cpu->func_thread = thread;
+    }
+
+#define OP(name) op_##name
+#define DISPATCH()                                                            \
+    do                                                                        \
+    {                                                                         \
+        if (executed == insn_count || (unsigned)index >= (unsigned)size)      \
+        {                                                                     \
+            goto done;                                                        \
+        }                                                                     \
+        ins = &code[index];                                                   \
+        executed++;                                                           \
+        goto *thread[index];                                                  \
+    } while (0)
+
+    DISPATCH();
+#else
+#define OP(name) case OPCODE_##name
+#define DISPATCH() goto dispatch
+
+dispatch:
+    if (executed == insn_count || (unsigned)index >= (unsigned)size)
+    {
+        goto done;
+    }
+    ins = &code[index];
+    executed++;
+
+    switch (ins->opcode)
+    {
+#endif
+
+    OP(ADD):
+        regs[ins->rd] = regs[ins->rs1] + regs[ins->rs2];
+        index++;
+        DISPATCH();
+
+    OP(SUB):
+        regs[ins->rd] = regs[ins->rs1] - regs[ins->rs2];
+        index++;
+        DISPATCH();
+
+    OP(MUL):
+        regs[ins->rd] = regs[ins->rs1] * regs[ins->rs2];
+        index++;
+        DISPATCH();
+
+    OP(DIV):
+        regs[ins->rd] = regs[ins->rs2] ? regs[ins->rs1] / regs[ins->rs2] : 0;
+        index++;
+        DISPATCH();
+
+    OP(AND):
+        regs[ins->rd] = regs[ins->rs1] & regs[ins->rs2];
+        index++;
+        DISPATCH();
+
+    OP(OR):
+        regs[ins->rd] = regs[ins->rs1] | regs[ins->rs2];
+        index++;
+        DISPATCH();
+
+    OP(XOR):
+        regs[ins->rd] = regs[ins->rs1] ^ regs[ins->rs2];
+        index++;
+        DISPATCH();
+
+    OP(ADDL):
+        regs[ins->rd] = regs[ins->rs1] + ins->imm;
+        index++;
+        DISPATCH();
+
+    OP(SUBL):
+        regs[ins->rd] = regs[ins->rs1] - ins->imm;
+        index++;
+        DISPATCH();
+
+    OP(MOVC):
+        regs[ins->rd] = ins->imm;
+        zero_flag = (ins->imm == 0) ? TRUE : FALSE;
+        index++;
+        DISPATCH();
+
+    OP(LOAD):
+        value = APEX_memory_read(mem, regs[ins->rs1] + ins->imm);
+        if (mem->fault)
+        {
+            goto fault;
+        }
+        regs[ins->rd] = value;
+        index++;
+        DISPATCH();
+
+    OP(LDR):
+        value = APEX_memory_read(mem, regs[ins->rs1] + regs[ins->rs2]);
+        if (mem->fault)
+        {
+            goto fault;
+        }
+        regs[ins->rd] = value;
+        index++;
+        DISPATCH();
+
+    OP(STORE):
+        APEX_memory_write(mem, regs[ins->rs2] + ins->imm, regs[ins->rs1]);
+        if (mem->fault)
+        {
+            goto fault;
+        }
+        index++;
+        DISPATCH();
+
+    OP(STR):
+        APEX_memory_write(mem, regs[ins->rs2] + regs[ins->rs3], regs[ins->rs1]);
+        if (mem->fault)
+        {
+            goto fault;
+        }
+        index++;
+        DISPATCH();
+
+    OP(CMP):
+        zero_flag = (regs[ins->rs1] == regs[ins->rs2]) ? TRUE : FALSE;
+        index++;
+        DISPATCH();
+
+    OP(BZ):
+        index = (zero_flag == TRUE)
+            ? get_code_memory_index_from_pc(4000 + index * 4 + ins->imm)
+            : index + 1;
+        DISPATCH();
+
+    OP(BNZ):
+        index = (zero_flag == FALSE)
+            ? get_code_memory_index_from_pc(4000 + index * 4 + ins->imm)
+            : index + 1;
+        DISPATCH();
+
+    OP(NOP):
+        index++;
+        DISPATCH();
+
+    /* Instructions of this run are added to the counts at the end */
+    OP(RDCNT):
+        regs[ins->rd] = APEX_cpu_read_counter(cpu, ins->imm, executed - 1);
+        index++;
+        DISPATCH();
+
+    OP(CLRCNT):
+        APEX_cpu_clear_counters(cpu, executed - 1);
+        index++;
+        DISPATCH();
+
+    OP(HALT):
+        *halted = TRUE;
+        goto done;
+
+#if !APEX_THREADED_DISPATCH
+    }
+#endif
+
+#undef OP
+#undef DISPATCH
+
+done:
+    /* Running off the end of code memory stops the program like HALT */
+    if ((unsigned)index >= (unsigned)size)
+    {
+        *halted = TRUE;
+    }
+
+    cpu->pc = 4000 + index * 4;
+    cpu->zero_flag = zero_flag;
+    cpu->insn_fast_forwarded += executed;
+    return executed;
+
+fault:
+    /* Like APEX_func_step, the faulting instruction is not executed */
+    executed--;
+    *halted = TRUE;
+    goto done;
+}
+
+/*
+ * Hands the CPU over from the functional engine to the detailed pipeline.
+ * Architectural state is already up to date, so all that is left is to drain
+ * the latches and restart fetch at the current PC.
+ */
+void
+APEX_func_handoff(APEX_CPU *cpu)
+{
+    APEX_cpu_reset_pipeline(cpu);
+}
+
+/*
+ * Drops the threaded code and the translation cache built from code memory,
+ * must be called whenever code memory is (re)loaded
+ */
+void
+APEX_func_invalidate(APEX_CPU *cpu)
+{
+    free(cpu->func_thread);
+    cpu->func_thread = NULL;
+    APEX_tcache_invalidate(cpu);
+}
@@ -0,0 +1,14 @@
+/*
+ * apex_func.h
+ * Contains declarations of the functional (ISA level) APEX execution engine
+ */
+#ifndef _APEX_FUNC_H_
+#define _APEX_FUNC_H_
+
+#include "apex_cpu.h"
+
+int APEX_func_step(APEX_CPU *cpu);
+long APEX_func_run(APEX_CPU *cpu, const long insn_count, int *halted);
+void APEX_func_handoff(APEX_CPU *cpu);
+void APEX_func_invalidate(APEX_CPU *cpu);
+#endif
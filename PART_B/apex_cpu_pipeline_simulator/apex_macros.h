@@ -12,7 +12,7 @@
 #define FALSE 0x0
 #define TRUE 0x1
 
-/* Integers */
+/* Integers, default size of data memory */
 #define DATA_MEMORY_SIZE 4096
 
 /* Size of integer register file */
@@ -38,10 +38,30 @@
 #define OPCODE_STR 0x10
 #define OPCODE_CMP 0x11
 #define OPCODE_NOP 0x12
+#define OPCODE_RDCNT 0x13
+#define OPCODE_CLRCNT 0x14
+
+/* Number of numeric OPCODE identifiers */
+#define NUM_OPCODES 0x15
+
+/* Performance counters, RDCNT Rd,#id reads one and CLRCNT resets them all */
+#define COUNTER_CYCLES 0        /* Clock cycles */
+#define COUNTER_INSTRUCTIONS 1  /* Instructions retired */
+#define COUNTER_STALLS 2        /* Cycles decode/rename held an instruction */
+#define COUNTER_FLUSHES 3       /* Mispredicted branches and replayed loads */
+#define COUNTER_DCACHE_MISSES 4 /* Data cache read and write misses */
+#define COUNTER_ICACHE_MISSES 5 /* Instruction cache misses */
+#define NUM_COUNTERS 6
 
 /* Set this flag to 1 to enable debug messages */
 #define ENABLE_DEBUG_MESSAGES 1
 
+/* Runtime log levels, each one prints everything the previous one does */
+#define APEX_LOG_QUIET 0   /* Completion line only, no per-cycle output */
+#define APEX_LOG_SUMMARY 1 /* + final registers and data memory */
+#define APEX_LOG_STAGE 2   /* + every stage of every cycle */
+#define APEX_LOG_FULL 3    /* + register file every cycle, code memory at init */
+
 /* Set this flag to 1 to enable cycle single-step mode */
 #define ENABLE_SINGLE_STEP 1
 #define DISABLE_SINGLE_STEP 0
@@ -0,0 +1,189 @@
+/*
+ * apex_memory.c
+ * Contains the paged data memory of the APEX cpu. A page table covers the
+ * whole memory, a page is allocated (zeroed) the first time it is written
+ * and pages never written read as zero. Memory can be preloaded from a file
+ * of raw words, which is mapped copy-on-write so that only the parts of it
+ * a program touches are ever read from disk.
+ */
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "apex_macros.h"
+#include "apex_memory.h"
+
+/* TRUE if page points into the file mapping rather than to the heap */
+static int
+page_is_mapped(const APEX_Memory *mem, const int *page)
+{
+    return mem->map && page >= mem->map
+           && page < mem->map + mem->map_len / sizeof(int);
+}
+
+/*
+ * Maps filename as the initial content of the first words of memory. Whole
+ * pages of the file are used in place, a partial last page is copied.
+ */
+static int
+map_file(APEX_Memory *mem, const char *filename)
+{
+    struct stat st;
+    size_t words, full_pages, tail;
+    int *page;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size % sizeof(int) != 0
+        || (size_t)st.st_size / sizeof(int) > mem->size)
+    {
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    mem->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    fd, 0);
+    close(fd);
+    if (mem->map == MAP_FAILED)
+    {
+        mem->map = NULL;
+        return -1;
+    }
+    mem->map_len = st.st_size;
+
+    words = mem->map_len / sizeof(int);
+    full_pages = words >> MEMORY_PAGE_SHIFT;
+    for (size_t i = 0; i < full_pages; ++i)
+    {
+        mem->pages[i] = mem->map + (i << MEMORY_PAGE_SHIFT);
+    }
+
+    tail = words & (MEMORY_PAGE_WORDS - 1);
+    if (tail)
+    {
+        page = APEX_memory_page(mem, full_pages);
+        if (!page)
+        {
+            return -1;
+        }
+        memcpy(page, mem->map + (full_pages << MEMORY_PAGE_SHIFT),
+               tail * sizeof(int));
+    }
+    return 0;
+}
+
+/*
+ * Sets up a zeroed memory of words words, optionally preloaded from filename
+ * (raw host order words, at most words of them)
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int
+APEX_memory_init(APEX_Memory *mem, const unsigned int words,
+                 const char *filename)
+{
+    memset(mem, 0, sizeof(APEX_Memory));
+
+    if (words == 0 || words > MEMORY_MAX_WORDS)
+    {
+        return -1;
+    }
+
+    mem->size = words;
+    mem->num_pages = (words + MEMORY_PAGE_WORDS - 1) >> MEMORY_PAGE_SHIFT;
+    mem->pages = calloc(mem->num_pages, sizeof(int *));
+    if (!mem->pages)
+    {
+        return -1;
+    }
+
+    if (filename && map_file(mem, filename) != 0)
+    {
+        APEX_memory_free(mem);
+        return -1;
+    }
+    return 0;
+}
+
+/* Makes every word zero again (also drops the file content) */
+void
+APEX_memory_clear(APEX_Memory *mem)
+{
+    int i;
+
+    for (i = 0; i < mem->num_pages; ++i)
+    {
+        if (mem->pages[i] && !page_is_mapped(mem, mem->pages[i]))
+        {
+            free(mem->pages[i]);
+        }
+        mem->pages[i] = NULL;
+    }
+
+    if (mem->map)
+    {
+        munmap(mem->map, mem->map_len);
+        mem->map = NULL;
+        mem->map_len = 0;
+    }
+    mem->fault = FALSE;
+    mem->fault_address = 0;
+}
+
+void
+APEX_memory_free(APEX_Memory *mem)
+{
+    if (mem->pages)
+    {
+        APEX_memory_clear(mem);
+        free(mem->pages);
+    }
+    memset(mem, 0, sizeof(APEX_Memory));
+}
+
+/*
+ * Page number page, allocated zeroed if it was never written. Running out of
+ * host memory is reported like an access outside data memory.
+ */
+int *
+APEX_memory_page(APEX_Memory *mem, const int page)
+{
+    if (!mem->pages[page])
+    {
+        mem->pages[page] = calloc(MEMORY_PAGE_WORDS, sizeof(int));
+        if (!mem->pages[page])
+        {
+            APEX_memory_trap(mem, page << MEMORY_PAGE_SHIFT);
+        }
+    }
+    return mem->pages[page];
+}
+
+/*
+ * Records an access outside data memory, only the first one is kept.
+ * Returns the value such a read yields (0).
+ */
+int
+APEX_memory_trap(APEX_Memory *mem, const int address)
+{
+    if (!mem->fault)
+    {
+        mem->fault = TRUE;
+        mem->fault_address = address;
+    }
+    return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * apex_memory.h
+ * Contains declarations of the paged APEX data memory. Its size is set at
+ * run time; pages are only allocated when they are first written, so a cpu
+ * costs nothing for memory it never touches.
+ */
+#ifndef _APEX_MEMORY_H_
+#define _APEX_MEMORY_H_
+
+#include <stddef.h>
+
+/* Words per page of data memory (4 KB pages) */
+#define MEMORY_PAGE_SHIFT 10
+#define MEMORY_PAGE_WORDS (1 << MEMORY_PAGE_SHIFT)
+
+/* Largest data memory, in words (2 GB) */
+#define MEMORY_MAX_WORDS (1u << 29)
+
+typedef struct APEX_Memory
+{
+    int **pages;          /* Page table, NULL pages have never been written */
+    unsigned int size;    /* Words */
+    int num_pages;
+    int fault;            /* Set by an access outside the memory */
+    int fault_address;    /* Word address of the first such access */
+    int *map;             /* Backing file mapped copy-on-write, NULL if none */
+    size_t map_len;       /* Bytes of the mapping */
+} APEX_Memory;
+
+int APEX_memory_init(APEX_Memory *mem, const unsigned int words,
+                     const char *filename);
+void APEX_memory_clear(APEX_Memory *mem);
+void APEX_memory_free(APEX_Memory *mem);
+int *APEX_memory_page(APEX_Memory *mem, const int page);
+int APEX_memory_trap(APEX_Memory *mem, const int address);
+
+/*
+ * Word at address. Out-of-range addresses read as 0 and set mem->fault, the
+ * caller checks the flag once the instruction is done.
+ */
+static inline int
+APEX_memory_read(APEX_Memory *mem, const int address)
+{
+    const int *page;
+
+    if ((unsigned int)address >= mem->size)
+    {
+        return APEX_memory_trap(mem, address);
+    }
+
+    page = mem->pages[address >> MEMORY_PAGE_SHIFT];
+    return page ? page[address & (MEMORY_PAGE_WORDS - 1)] : 0;
+}
+
+/* Word at address for inspection, 0 outside memory and never a fault */
+static inline int
+APEX_memory_peek(const APEX_Memory *mem, const int address)
+{
+    const int *page;
+
+    if ((unsigned int)address >= mem->size)
+    {
+        return 0;
+    }
+
+    page = mem->pages[address >> MEMORY_PAGE_SHIFT];
+    return page ? page[address & (MEMORY_PAGE_WORDS - 1)] : 0;
+}
+
+/* Writes the word at address, allocating its page on first touch */
+static inline void
+APEX_memory_write(APEX_Memory *mem, const int address, const int value)
+{
+    int *page;
+
+    if ((unsigned int)address >= mem->size)
+    {
+        APEX_memory_trap(mem, address);
+        return;
+    }
+
+    page = mem->pages[address >> MEMORY_PAGE_SHIFT];
+    if (!page)
+    {
+        page = APEX_memory_page(mem, address >> MEMORY_PAGE_SHIFT);
+        if (!page)
+        {
+            return;
+        }
+    }
+    page[address & (MEMORY_PAGE_WORDS - 1)] = value;
+}
+#endif
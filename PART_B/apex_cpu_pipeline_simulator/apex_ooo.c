@@ -0,0 +1,1237 @@
+/*
+ * apex_ooo.c
+ * Contains the superscalar backend of the APEX cpu. Every cycle it commits
+ * up to width finished instructions, oldest first, completes the ones whose
+ * unit is done (resolving branches), issues up to width ready instructions
+ * of the issue queue, renames the fetch group into the ROB and fetches the
+ * next group. The stages are evaluated from commit back to fetch, so a stage sees
+ * what the later stages freed up in the same cycle. The architectural state
+ * (cpu->regs, zero_flag, data memory) is only written at commit, stores
+ * included, so it is always precise. Until then the load/store queue holds
+ * the stores, and loads take their value from it when they can.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_cache.h"
+#include "apex_cpu.h"
+#include "apex_macros.h"
+#include "apex_memory.h"
+#include "apex_ooo.h"
+#include "apex_trace.h"
+
+/*
+ * Creates the backend for config, rename state is built from the
+ * architectural registers in the first cycle
+ *
+ * Returns NULL if the sizes are not valid
+ */
+APEX_OoO *
+APEX_ooo_create(const APEX_Pipeline_Config *config)
+{
+    APEX_OoO *ooo;
+
+    /* Every architectural register needs a physical one, plus the two a
+     * MOVC renames (its register and the zero flag) */
+    if (config->rob_size < 1 || config->iq_size < 1
+        || config->phys_regs < OOO_MIN_PHYS_REGS
+        || config->width < 1 || config->width > OOO_MAX_WIDTH
+        || config->mem_ports < 1 || config->mem_ports > OOO_MAX_WIDTH
+        || config->branch_ports < 1 || config->branch_ports > OOO_MAX_WIDTH
+        || config->lsq_size < 1 || config->lsq_policy < LSQ_COMMIT
+        || config->lsq_policy > LSQ_SPECULATE)
+    {
+        return NULL;
+    }
+
+    ooo = calloc(1, sizeof(APEX_OoO));
+    if (!ooo)
+    {
+        return NULL;
+    }
+
+    ooo->rob_size = config->rob_size;
+    ooo->iq_size = config->iq_size;
+    ooo->phys_regs = config->phys_regs;
+    ooo->width = config->width;
+    ooo->in_order = !config->ooo;
+    ooo->mem_ports = config->mem_ports;
+    ooo->branch_ports = config->branch_ports;
+    ooo->lsq_size = config->lsq_size;
+    ooo->lsq_policy = config->lsq_policy;
+
+    /* Simple integer operations and address generation are replicated, one
+     * multiplier and one divider are shared */
+    ooo->unit_copies[FU_ALU] = ooo->width;
+    ooo->unit_copies[FU_MUL] = 1;
+    ooo->unit_copies[FU_DIV] = 1;
+    ooo->unit_copies[FU_AGU] = ooo->mem_ports;
+    ooo->phys_value = calloc(ooo->phys_regs, sizeof(int));
+    ooo->phys_ready = calloc(ooo->phys_regs, sizeof(unsigned char));
+    ooo->free_list = calloc(ooo->phys_regs, sizeof(int));
+    ooo->rob = calloc(ooo->rob_size, sizeof(APEX_Rob_Entry));
+    ooo->iq = calloc(ooo->iq_size, sizeof(APEX_Iq_Entry));
+    ooo->exec = calloc(ooo->rob_size, sizeof(APEX_Exec_Entry));
+    ooo->lsq = calloc(ooo->lsq_size, sizeof(int));
+    if (!ooo->phys_value || !ooo->phys_ready || !ooo->free_list || !ooo->rob
+        || !ooo->iq || !ooo->exec || !ooo->lsq)
+    {
+        APEX_ooo_free(ooo);
+        return NULL;
+    }
+    return ooo;
+}
+
+void
+APEX_ooo_free(APEX_OoO *ooo)
+{
+    if (!ooo)
+    {
+        return;
+    }
+    free(ooo->phys_value);
+    free(ooo->phys_ready);
+    free(ooo->free_list);
+    free(ooo->rob);
+    free(ooo->iq);
+    free(ooo->exec);
+    free(ooo->lsq);
+    free(ooo);
+}
+
+/*
+ * Empties the backend, the next cycle renames from cpu->regs again. Called
+ * whenever the architectural state changed behind its back (fast-forward,
+ * checkpoint restore).
+ */
+void
+APEX_ooo_reset(APEX_OoO *ooo)
+{
+    ooo->started = FALSE;
+    ooo->rob_count = 0;
+    ooo->iq_count = 0;
+    ooo->exec_count = 0;
+    ooo->lsq_count = 0;
+    ooo->fetch_count = 0;
+    memset(ooo->unit_busy, 0, sizeof(ooo->unit_busy));
+}
+
+/* TRUE when no instruction is fetched, queued or waiting to commit */
+int
+APEX_ooo_empty(const APEX_OoO *ooo)
+{
+    return ooo->fetch_count == 0 && ooo->rob_count == 0;
+}
+
+/* Identity map onto the first physical registers, all others free */
+static void
+start(APEX_CPU *cpu, APEX_OoO *ooo)
+{
+    int i;
+
+    for (i = 0; i < OOO_ARCH_REGS; ++i)
+    {
+        ooo->rat[i] = i;
+        ooo->phys_value[i] = i == OOO_FLAG_REG ? cpu->zero_flag : cpu->regs[i];
+        ooo->phys_ready[i] = TRUE;
+    }
+    ooo->free_head = 0;
+    ooo->free_count = 0;
+    for (i = OOO_ARCH_REGS; i < ooo->phys_regs; ++i)
+    {
+        ooo->free_list[ooo->free_count++] = i;
+    }
+    ooo->rob_head = 0;
+    ooo->lsq_head = 0;
+    ooo->stores_dispatched = 0;
+    ooo->stores_committed = 0;
+    ooo->started = TRUE;
+}
+
+static void
+free_reg(APEX_OoO *ooo, const int phys)
+{
+    ooo->free_list[(ooo->free_head + ooo->free_count) % ooo->phys_regs] = phys;
+    ooo->free_count++;
+}
+
+static int
+alloc_reg(APEX_OoO *ooo)
+{
+    const int phys = ooo->free_list[ooo->free_head];
+
+    ooo->free_head = (ooo->free_head + 1) % ooo->phys_regs;
+    ooo->free_count--;
+    ooo->phys_ready[phys] = FALSE;
+    return phys;
+}
+
+/* Position of ROB slot rob counted from the oldest entry */
+static int
+age(const APEX_OoO *ooo, const int rob)
+{
+    return (rob - ooo->rob_head + ooo->rob_size) % ooo->rob_size;
+}
+
+static const APEX_Decoded *
+decoded(const APEX_CPU *cpu, const APEX_OoO *ooo, const int rob)
+{
+    return &cpu->decoded[ooo->rob[rob].insn];
+}
+
+/* ROB slot of entry i of the load/store queue, counted from the oldest */
+static int
+lsq_rob(const APEX_OoO *ooo, const int i)
+{
+    return ooo->lsq[(ooo->lsq_head + i) % ooo->lsq_size];
+}
+
+/* Stage text in the same format as the in-order pipeline */
+static void
+trace(APEX_CPU *cpu, const int stage_id, const int state, const int pc,
+      const int insn)
+{
+    if (cpu->trace)
+    {
+        APEX_trace_stage(cpu->trace, stage_id, state, pc);
+    }
+    else if (ENABLE_DEBUG_MESSAGES && cpu->log_level >= APEX_LOG_STAGE)
+    {
+        APEX_trace_print_stage(cpu->out, stage_id, state, pc,
+                               state == TRACE_STATE_EMPTY
+                               ? NULL : &cpu->code_memory[insn]);
+    }
+}
+
+static int
+is_branch(const APEX_Decoded *ins)
+{
+    return ins->opcode == OPCODE_BZ || ins->opcode == OPCODE_BNZ;
+}
+
+static int
+is_store(const APEX_Decoded *ins)
+{
+    return ins->opcode == OPCODE_STORE || ins->opcode == OPCODE_STR;
+}
+
+static int
+is_load(const APEX_Decoded *ins)
+{
+    return ins->opcode == OPCODE_LOAD || ins->opcode == OPCODE_LDR;
+}
+
+/* RDCNT and CLRCNT, they issue only once they are the oldest instruction */
+static int
+is_counter(const APEX_Decoded *ins)
+{
+    return ins->opcode == OPCODE_RDCNT || ins->opcode == OPCODE_CLRCNT;
+}
+
+/* TRUE if the instruction writes rd */
+static int
+writes_register(const APEX_Decoded *ins)
+{
+    switch (ins->opcode)
+    {
+        case OPCODE_STORE:
+        case OPCODE_STR:
+        case OPCODE_CMP:
+        case OPCODE_BZ:
+        case OPCODE_BNZ:
+        case OPCODE_HALT:
+        case OPCODE_NOP:
+        case OPCODE_CLRCNT:
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static int
+writes_flag(const APEX_Decoded *ins)
+{
+    return ins->opcode == OPCODE_CMP || ins->opcode == OPCODE_MOVC;
+}
+
+/* Architectural sources in operand order, the zero flag for BZ/BNZ */
+static int
+source_registers(const APEX_Decoded *ins, int src[OOO_MAX_SOURCES])
+{
+    switch (ins->opcode)
+    {
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_AND:
+        case OPCODE_OR:
+        case OPCODE_XOR:
+        case OPCODE_LDR:
+        case OPCODE_STORE:
+        case OPCODE_CMP:
+            src[0] = ins->rs1;
+            src[1] = ins->rs2;
+            return 2;
+
+        case OPCODE_ADDL:
+        case OPCODE_SUBL:
+        case OPCODE_LOAD:
+            src[0] = ins->rs1;
+            return 1;
+
+        case OPCODE_STR:
+            src[0] = ins->rs1;
+            src[1] = ins->rs2;
+            src[2] = ins->rs3;
+            return 3;
+
+        case OPCODE_BZ:
+        case OPCODE_BNZ:
+            src[0] = OOO_FLAG_REG;
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Operation of the instruction on its source values, same semantics as the
+ * in-order pipeline. Memory is not touched here.
+ */
+static void
+compute(const APEX_Decoded *ins, const int v[OOO_MAX_SOURCES],
+        APEX_Rob_Entry *entry)
+{
+    switch (ins->opcode)
+    {
+        case OPCODE_ADD:
+            entry->result = v[0] + v[1];
+            break;
+        case OPCODE_SUB:
+            entry->result = v[0] - v[1];
+            break;
+        case OPCODE_MUL:
+            entry->result = v[0] * v[1];
+            break;
+        case OPCODE_DIV:
+            /* Division by zero yields 0 instead of trapping the host */
+            entry->result = v[1] == 0 ? 0 : v[0] / v[1];
+            break;
+        case OPCODE_AND:
+            entry->result = v[0] & v[1];
+            break;
+        case OPCODE_OR:
+            entry->result = v[0] | v[1];
+            break;
+        case OPCODE_XOR:
+            entry->result = v[0] ^ v[1];
+            break;
+        case OPCODE_ADDL:
+            entry->result = v[0] + ins->imm;
+            break;
+        case OPCODE_SUBL:
+            entry->result = v[0] - ins->imm;
+            break;
+        case OPCODE_MOVC:
+            entry->result = ins->imm;
+            entry->flag = ins->imm == 0;
+            break;
+        case OPCODE_CMP:
+            entry->flag = v[0] == v[1];
+            break;
+        case OPCODE_LOAD:
+            entry->memory_address = v[0] + ins->imm;
+            break;
+        case OPCODE_LDR:
+            entry->memory_address = v[0] + v[1];
+            break;
+        case OPCODE_STORE:
+            entry->memory_address = v[1] + ins->imm;
+            entry->store_value = v[0];
+            break;
+        case OPCODE_STR:
+            entry->memory_address = v[1] + v[2];
+            entry->store_value = v[0];
+            break;
+        case OPCODE_BZ:
+            entry->flag = v[0] == TRUE;
+            break;
+        case OPCODE_BNZ:
+            entry->flag = v[0] == FALSE;
+            break;
+    }
+}
+
+/*
+ * Retires the oldest instruction. Its results become architectural, the
+ * physical registers it replaced are freed and a store writes data memory.
+ * Returns TRUE when it was HALT or accessed a word outside data memory.
+ */
+static int
+retire(APEX_CPU *cpu, APEX_OoO *ooo)
+{
+    const APEX_Rob_Entry *entry = &ooo->rob[ooo->rob_head];
+    const APEX_Decoded *ins = &cpu->decoded[entry->insn];
+
+    if (entry->fault)
+    {
+        APEX_memory_trap(&cpu->data_memory, entry->memory_address);
+        return TRUE;
+    }
+
+    if (is_store(ins))
+    {
+        if (cpu->dcache.num_sets)
+        {
+            /* Written from the store buffer, commit does not wait */
+            APEX_cache_access(&cpu->dcache,
+                              (unsigned int)entry->memory_address * 4, TRUE,
+                              entry->pc, cpu->clock);
+        }
+        APEX_memory_write(&cpu->data_memory, entry->memory_address,
+                          entry->store_value);
+        ooo->stores_committed++;
+    }
+    if (is_load(ins) || is_store(ins))
+    {
+        ooo->lsq_head = (ooo->lsq_head + 1) % ooo->lsq_size;
+        ooo->lsq_count--;
+    }
+    if (entry->phys >= 0)
+    {
+        cpu->regs[ins->rd] = ooo->phys_value[entry->phys];
+        free_reg(ooo, entry->old_phys);
+    }
+    if (entry->flag_phys >= 0)
+    {
+        cpu->zero_flag = ooo->phys_value[entry->flag_phys];
+        free_reg(ooo, entry->old_flag_phys);
+    }
+
+    cpu->insn_completed++;
+    trace(cpu, TRACE_STAGE_WRITEBACK, TRACE_STATE_ACTIVE, entry->pc,
+          entry->insn);
+
+    ooo->rob_head = (ooo->rob_head + 1) % ooo->rob_size;
+    ooo->rob_count--;
+    return ins->opcode == OPCODE_HALT;
+}
+
+/*
+ * Commit: retires up to width instructions in program order, stopping at
+ * the first one that is not done. Returns TRUE when the simulation stops.
+ */
+static int
+commit(APEX_CPU *cpu, APEX_OoO *ooo)
+{
+    int retired;
+
+    for (retired = 0; retired < ooo->width && ooo->rob_count > 0
+                      && ooo->rob[ooo->rob_head].done; ++retired)
+    {
+        if (retire(cpu, ooo))
+        {
+            return TRUE;
+        }
+    }
+
+    if (retired == 0)
+    {
+        trace(cpu, TRACE_STAGE_WRITEBACK, TRACE_STATE_EMPTY, 0, 0);
+    }
+    return FALSE;
+}
+
+/* Removes entry i of the issue queue, the younger ones close up */
+static void
+leave_queue(APEX_OoO *ooo, const int i)
+{
+    memmove(&ooo->iq[i], &ooo->iq[i + 1],
+            (ooo->iq_count - i - 1) * sizeof(APEX_Iq_Entry));
+    ooo->iq_count--;
+}
+
+/*
+ * Throws away every instruction from position keep of the ROB on (counted
+ * from the oldest), youngest first, so that each rename is undone in the
+ * reverse order it was made
+ */
+static void
+squash(APEX_CPU *cpu, APEX_OoO *ooo, const int keep)
+{
+    const APEX_Rob_Entry *entry;
+    int i;
+
+    while (ooo->rob_count > keep)
+    {
+        entry = &ooo->rob[(ooo->rob_head + ooo->rob_count - 1)
+                          % ooo->rob_size];
+        if (entry->flag_phys >= 0)
+        {
+            ooo->rat[OOO_FLAG_REG] = entry->old_flag_phys;
+            free_reg(ooo, entry->flag_phys);
+        }
+        if (entry->phys >= 0)
+        {
+            ooo->rat[cpu->decoded[entry->insn].rd] = entry->old_phys;
+            free_reg(ooo, entry->phys);
+        }
+        if (is_store(&cpu->decoded[entry->insn]))
+        {
+            ooo->stores_dispatched--;
+        }
+        ooo->rob_count--;
+        ooo->squashed++;
+    }
+
+    /* The queues are in program order, the squashed ones are last */
+    while (ooo->iq_count > 0
+           && age(ooo, ooo->iq[ooo->iq_count - 1].rob) >= keep)
+    {
+        ooo->iq_count--;
+    }
+    while (ooo->lsq_count > 0
+           && age(ooo, lsq_rob(ooo, ooo->lsq_count - 1)) >= keep)
+    {
+        ooo->lsq_count--;
+    }
+    for (i = 0; i < ooo->exec_count; ++i)
+    {
+        if (age(ooo, ooo->exec[i].rob) >= keep)
+        {
+            ooo->exec[i--] = ooo->exec[--ooo->exec_count];
+        }
+    }
+    ooo->fetch_count = 0;
+}
+
+/* Fetch goes on at pc after the branch penalty, dropping the current line */
+static void
+refetch(APEX_CPU *cpu, const int pc)
+{
+    cpu->pc = pc;
+    cpu->fetch_enabled = TRUE;
+    cpu->fetch_bubbles = cpu->config.branch_penalty;
+
+    /* A line still coming in for the wrong path is not waited for */
+    cpu->fetch_wait = 0;
+    cpu->fetch_missed = FALSE;
+}
+
+/*
+ * A BZ/BNZ finished: the predictor learns it, and if fetch went on at the
+ * wrong PC everything behind the branch is squashed and fetch restarts at
+ * the right one after the branch penalty
+ */
+static void
+resolve_branch(APEX_CPU *cpu, APEX_OoO *ooo, const int rob)
+{
+    const APEX_Rob_Entry *entry = &ooo->rob[rob];
+    const int target = entry->pc + decoded(cpu, ooo, rob)->imm;
+    const int next_pc = entry->flag ? target : entry->pc + 4;
+    const int mispredicted = next_pc != entry->predicted_pc;
+
+    APEX_bpred_update(&cpu->bpred, entry->pc, entry->history, entry->flag,
+                      target, mispredicted);
+    if (!mispredicted)
+    {
+        return;
+    }
+
+    squash(cpu, ooo, age(ooo, rob) + 1);
+    refetch(cpu, next_pc);
+}
+
+/*
+ * A load issued before an older store to the same word and read a stale
+ * value: it and everything younger are squashed and fetched again. The
+ * global history goes back to what the oldest squashed branch saw.
+ */
+static void
+replay_load(APEX_CPU *cpu, APEX_OoO *ooo, const int rob)
+{
+    const int pc = ooo->rob[rob].pc;
+    int i, slot;
+
+    for (i = age(ooo, rob); i < ooo->rob_count; ++i)
+    {
+        slot = (ooo->rob_head + i) % ooo->rob_size;
+        if (is_branch(decoded(cpu, ooo, slot)))
+        {
+            break;
+        }
+    }
+    if (i < ooo->rob_count)
+    {
+        cpu->bpred.history = ooo->rob[slot].history;
+    }
+    else
+    {
+        for (i = 0; i < ooo->fetch_count; ++i)
+        {
+            if (is_branch(&cpu->decoded[ooo->fetched[i].insn]))
+            {
+                cpu->bpred.history = ooo->fetched[i].history;
+                break;
+            }
+        }
+    }
+
+    squash(cpu, ooo, age(ooo, rob));
+    refetch(cpu, pc);
+    ooo->replays++;
+}
+
+/*
+ * Complete: operations whose unit is done write their physical registers,
+ * which wakes up their consumers for this cycle's issue. They are handled
+ * oldest first, so a mispredicted branch squashes younger ones before they
+ * complete.
+ */
+static void
+complete(APEX_CPU *cpu, APEX_OoO *ooo)
+{
+    APEX_Rob_Entry *entry;
+    int i, oldest, rob, completed = 0;
+
+    for (i = 0; i < ooo->exec_count; ++i)
+    {
+        ooo->exec[i].cycles_left--;
+    }
+
+    while (TRUE)
+    {
+        oldest = -1;
+        for (i = 0; i < ooo->exec_count; ++i)
+        {
+            if (ooo->exec[i].cycles_left <= 0
+                && (oldest < 0 || age(ooo, ooo->exec[i].rob)
+                                  < age(ooo, ooo->exec[oldest].rob)))
+            {
+                oldest = i;
+            }
+        }
+        if (oldest < 0)
+        {
+            break;
+        }
+
+        rob = ooo->exec[oldest].rob;
+        ooo->exec[oldest] = ooo->exec[--ooo->exec_count];
+        entry = &ooo->rob[rob];
+        if (entry->phys >= 0)
+        {
+            ooo->phys_value[entry->phys] = entry->result;
+            ooo->phys_ready[entry->phys] = TRUE;
+        }
+        if (entry->flag_phys >= 0)
+        {
+            ooo->phys_value[entry->flag_phys] = entry->flag;
+            ooo->phys_ready[entry->flag_phys] = TRUE;
+        }
+        entry->done = TRUE;
+        completed++;
+        trace(cpu, TRACE_STAGE_MEMORY, TRACE_STATE_ACTIVE, entry->pc,
+              entry->insn);
+
+        if (is_branch(decoded(cpu, ooo, rob)))
+        {
+            resolve_branch(cpu, ooo, rob);
+        }
+    }
+
+    if (completed == 0)
+    {
+        trace(cpu, TRACE_STAGE_MEMORY, TRACE_STATE_EMPTY, 0, 0);
+    }
+}
+
+/* TRUE once every source of the queued instruction has its value */
+static int
+operands_ready(const APEX_OoO *ooo, const APEX_Iq_Entry *iq)
+{
+    int i;
+
+    for (i = 0; i < OOO_MAX_SOURCES; ++i)
+    {
+        if (iq->src[i] >= 0 && !ooo->phys_ready[iq->src[i]])
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Cycles from issue to complete. A load also reads data memory (through the
+ * data cache) before it completes, or takes one more cycle when a store
+ * forwards its value; a store only computes its address here and writes
+ * memory at commit.
+ */
+static int
+issue_latency(APEX_CPU *cpu, const APEX_Rob_Entry *entry, const int unit)
+{
+    const APEX_Decoded *ins = &cpu->decoded[entry->insn];
+    int cycles;
+
+    if (unit == FU_NONE)
+    {
+        return 1;
+    }
+    cycles = APEX_unit_latency(&cpu->config, unit);
+    if (is_load(ins) && entry->forwarded_seq >= 0)
+    {
+        cycles += 1;
+    }
+    else if (is_load(ins) && !entry->fault)
+    {
+        cycles += cpu->dcache.num_sets
+                  ? APEX_cache_access(&cpu->dcache,
+                                      (unsigned int)entry->memory_address * 4,
+                                      FALSE, entry->pc, cpu->clock)
+                  : cpu->config.mem_latency;
+    }
+    return cycles;
+}
+
+/*
+ * TRUE if the policy lets the load in ROB slot rob issue: LSQ_COMMIT waits
+ * until every older store has committed, LSQ_RESOLVED until every older
+ * store has its address, LSQ_SPECULATE does not wait
+ */
+static int
+load_may_issue(const APEX_CPU *cpu, const APEX_OoO *ooo, const int rob)
+{
+    int i, slot;
+
+    switch (ooo->lsq_policy)
+    {
+        case LSQ_COMMIT:
+            return ooo->stores_committed >= ooo->rob[rob].store_seq;
+
+        case LSQ_RESOLVED:
+            for (i = 0; (slot = lsq_rob(ooo, i)) != rob; ++i)
+            {
+                if (is_store(decoded(cpu, ooo, slot))
+                    && !ooo->rob[slot].resolved)
+                {
+                    return FALSE;
+                }
+            }
+            return TRUE;
+    }
+    return TRUE;
+}
+
+/*
+ * Value of the load in ROB slot rob: the data of the youngest older store
+ * to the same word whose address is known, else the word in data memory
+ */
+static int
+load_value(APEX_CPU *cpu, APEX_OoO *ooo, const int rob)
+{
+    APEX_Rob_Entry *load = &ooo->rob[rob];
+    const APEX_Rob_Entry *store;
+    int i, slot, value = 0;
+
+    load->forwarded_seq = -1;
+    for (i = 0; (slot = lsq_rob(ooo, i)) != rob; ++i)
+    {
+        store = &ooo->rob[slot];
+        if (is_store(decoded(cpu, ooo, slot)) && store->resolved
+            && store->memory_address == load->memory_address)
+        {
+            load->forwarded_seq = store->store_seq;
+            value = store->store_value;
+        }
+    }
+    if (load->forwarded_seq >= 0)
+    {
+        ooo->forwarded_loads++;
+        return value;
+    }
+    return APEX_memory_peek(&cpu->data_memory, load->memory_address);
+}
+
+/*
+ * The store in ROB slot rob got its address: a younger load to the same
+ * word that already issued without seeing it (from memory or an older
+ * store) has to be replayed, the oldest one is noted for the end of issue
+ */
+static void
+check_store(const APEX_CPU *cpu, APEX_OoO *ooo, const int rob)
+{
+    const APEX_Rob_Entry *store = &ooo->rob[rob];
+    const APEX_Rob_Entry *load;
+    int i, slot;
+
+    for (i = ooo->lsq_count - 1; (slot = lsq_rob(ooo, i)) != rob; --i)
+    {
+        load = &ooo->rob[slot];
+        if (is_load(decoded(cpu, ooo, slot)) && load->resolved
+            && load->memory_address == store->memory_address
+            && load->forwarded_seq < store->store_seq
+            && (ooo->replay < 0 || age(ooo, slot) < age(ooo, ooo->replay)))
+        {
+            ooo->replay = slot;
+        }
+    }
+}
+
+/*
+ * Copy of unit that was free at the start of the cycle and is not taken
+ * yet, -1 if none
+ */
+static int
+free_copy(const APEX_OoO *ooo, int was_free[][OOO_MAX_WIDTH], const int unit)
+{
+    int copy;
+
+    for (copy = 0; copy < ooo->unit_copies[unit]; ++copy)
+    {
+        if (was_free[unit][copy])
+        {
+            return copy;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Starts queued instruction i in copy copy of its unit: it reads the
+ * physical register file and leaves the issue queue
+ */
+static void
+start_execution(APEX_CPU *cpu, APEX_OoO *ooo, const int i, const int unit,
+                const int copy)
+{
+    const APEX_Iq_Entry *iq = &ooo->iq[i];
+    APEX_Rob_Entry *entry = &ooo->rob[iq->rob];
+    const APEX_Decoded *ins = &cpu->decoded[entry->insn];
+    APEX_Exec_Entry *exec;
+    int v[OOO_MAX_SOURCES];
+    int k;
+
+    for (k = 0; k < OOO_MAX_SOURCES; ++k)
+    {
+        v[k] = iq->src[k] >= 0 ? ooo->phys_value[iq->src[k]] : 0;
+    }
+    compute(ins, v, entry);
+
+    /* Nothing older is in flight, the counters are exact */
+    if (ins->opcode == OPCODE_RDCNT)
+    {
+        entry->result = APEX_cpu_read_counter(cpu, ins->imm, 0);
+    }
+    else if (ins->opcode == OPCODE_CLRCNT)
+    {
+        APEX_cpu_clear_counters(cpu, 0);
+    }
+
+    /* An access outside data memory traps when it commits, not when a
+     * wrong path issues it */
+    if (is_load(ins) || is_store(ins))
+    {
+        entry->fault = (unsigned int)entry->memory_address
+                       >= cpu->data_memory.size;
+        entry->resolved = TRUE;
+        if (is_load(ins))
+        {
+            entry->result = load_value(cpu, ooo, iq->rob);
+        }
+        else
+        {
+            check_store(cpu, ooo, iq->rob);
+        }
+    }
+
+    exec = &ooo->exec[ooo->exec_count++];
+    exec->rob = iq->rob;
+    exec->cycles_left = issue_latency(cpu, entry, unit);
+    if (unit != FU_NONE)
+    {
+        cpu->unit_ops[unit]++;
+        ooo->unit_busy[unit][copy]
+            = APEX_unit_interval(&cpu->config, unit) - 1;
+    }
+
+    trace(cpu, TRACE_STAGE_EXECUTE, TRACE_STATE_ACTIVE, entry->pc,
+          entry->insn);
+    leave_queue(ooo, i);
+}
+
+/*
+ * Issue: up to width queued instructions with all operands ready start
+ * executing, oldest first. Each needs a free copy of its unit, and at most
+ * mem_ports loads/stores and branch_ports branches issue per cycle, a load
+ * as the LSQ policy allows and RDCNT/CLRCNT only at the head of the ROB.
+ * Operands only become ready when their producer completes, so two
+ * dependent instructions never issue in the same cycle. With in-order issue
+ * the first instruction that cannot issue holds back all younger ones. A
+ * load found to have passed a conflicting store is replayed once the
+ * cycle's issue is over.
+ */
+static void
+issue(APEX_CPU *cpu, APEX_OoO *ooo)
+{
+    int was_free[NUM_FUNCTIONAL_UNITS][OOO_MAX_WIDTH];
+    int waiting[NUM_FUNCTIONAL_UNITS] = { 0 };
+    int mem_left = ooo->mem_ports;
+    int branch_left = ooo->branch_ports;
+    const APEX_Decoded *ins;
+    int i = 0, unit, copy, issued = 0;
+
+    ooo->replay = -1;
+
+    /* A unit copy is free if it was free at the start of the cycle */
+    for (unit = 0; unit < NUM_FUNCTIONAL_UNITS; ++unit)
+    {
+        for (copy = 0; copy < ooo->unit_copies[unit]; ++copy)
+        {
+            was_free[unit][copy] = ooo->unit_busy[unit][copy] == 0;
+            if (ooo->unit_busy[unit][copy] > 0)
+            {
+                ooo->unit_busy[unit][copy]--;
+            }
+        }
+    }
+
+    while (i < ooo->iq_count && issued < ooo->width)
+    {
+        ins = decoded(cpu, ooo, ooo->iq[i].rob);
+        unit = APEX_functional_unit(ins);
+        copy = -1;
+        if (operands_ready(ooo, &ooo->iq[i])
+            && (!is_load(ins) || load_may_issue(cpu, ooo, ooo->iq[i].rob))
+            && (!is_counter(ins) || ooo->iq[i].rob == ooo->rob_head)
+            && (!is_branch(ins) || branch_left > 0)
+            && ((!is_load(ins) && !is_store(ins)) || mem_left > 0))
+        {
+            if (unit == FU_NONE)
+            {
+                copy = 0;
+            }
+            else
+            {
+                copy = free_copy(ooo, was_free, unit);
+                waiting[unit] = waiting[unit] || copy < 0;
+            }
+        }
+
+        if (copy < 0)
+        {
+            if (ooo->in_order)
+            {
+                break;
+            }
+            ++i;
+            continue;
+        }
+
+        if (unit != FU_NONE)
+        {
+            was_free[unit][copy] = FALSE;
+        }
+        mem_left -= is_load(ins) || is_store(ins);
+        branch_left -= is_branch(ins);
+        start_execution(cpu, ooo, i, unit, copy);
+        issued++;
+    }
+
+    for (unit = 0; unit < NUM_FUNCTIONAL_UNITS; ++unit)
+    {
+        cpu->unit_stalls[unit] += waiting[unit];
+    }
+    ooo->issued[issued]++;
+
+    if (issued == 0)
+    {
+        trace(cpu, TRACE_STAGE_EXECUTE, TRACE_STATE_EMPTY, 0, 0);
+    }
+    if (ooo->replay >= 0)
+    {
+        replay_load(cpu, ooo, ooo->replay);
+    }
+}
+
+/*
+ * Renames one fetched instruction and enters it into the ROB and the issue
+ * queue, and a load or store into the load/store queue. Returns FALSE,
+ * counting the reason, if one of the queues is full or no physical register
+ * is free for its destination.
+ */
+static int
+rename_one(APEX_CPU *cpu, APEX_OoO *ooo, const APEX_Fetch_Entry *fetched)
+{
+    const APEX_Decoded *ins = &cpu->decoded[fetched->insn];
+    const int needs_queue = ins->opcode != OPCODE_HALT
+                            && ins->opcode != OPCODE_NOP;
+    APEX_Rob_Entry *entry;
+    APEX_Iq_Entry *iq;
+    int src[OOO_MAX_SOURCES];
+    int i, num_sources, rob;
+
+    if (ooo->rob_count == ooo->rob_size)
+    {
+        ooo->rob_full++;
+        return FALSE;
+    }
+    if (needs_queue && ooo->iq_count == ooo->iq_size)
+    {
+        ooo->iq_full++;
+        return FALSE;
+    }
+    if ((is_load(ins) || is_store(ins)) && ooo->lsq_count == ooo->lsq_size)
+    {
+        ooo->lsq_full++;
+        return FALSE;
+    }
+    if (ooo->free_count < writes_register(ins) + writes_flag(ins))
+    {
+        ooo->regs_full++;
+        return FALSE;
+    }
+
+    rob = (ooo->rob_head + ooo->rob_count++) % ooo->rob_size;
+    entry = &ooo->rob[rob];
+    memset(entry, 0, sizeof(APEX_Rob_Entry));
+    entry->pc = fetched->pc;
+    entry->insn = fetched->insn;
+    entry->predicted_pc = fetched->predicted_pc;
+    entry->history = fetched->history;
+    entry->store_seq = ooo->stores_dispatched;
+    entry->forwarded_seq = -1;
+    if (is_store(ins))
+    {
+        ooo->stores_dispatched++;
+    }
+    if (is_load(ins) || is_store(ins))
+    {
+        ooo->lsq[(ooo->lsq_head + ooo->lsq_count++) % ooo->lsq_size] = rob;
+    }
+
+    /* Sources are looked up before the destination is renamed, an
+     * instruction may read the register it writes. An older instruction of
+     * the same group has already renamed its destination, so a dependency
+     * inside the group reads the new mapping. */
+    num_sources = source_registers(ins, src);
+    if (needs_queue)
+    {
+        iq = &ooo->iq[ooo->iq_count++];
+        iq->rob = rob;
+        for (i = 0; i < OOO_MAX_SOURCES; ++i)
+        {
+            iq->src[i] = i < num_sources ? ooo->rat[src[i]] : -1;
+        }
+    }
+    else
+    {
+        entry->done = TRUE;
+    }
+
+    entry->phys = -1;
+    entry->flag_phys = -1;
+    if (writes_register(ins))
+    {
+        entry->old_phys = ooo->rat[ins->rd];
+        entry->phys = alloc_reg(ooo);
+        ooo->rat[ins->rd] = entry->phys;
+    }
+    if (writes_flag(ins))
+    {
+        entry->old_flag_phys = ooo->rat[OOO_FLAG_REG];
+        entry->flag_phys = alloc_reg(ooo);
+        ooo->rat[OOO_FLAG_REG] = entry->flag_phys;
+    }
+
+    trace(cpu, TRACE_STAGE_DECODE, TRACE_STATE_ACTIVE, entry->pc,
+          entry->insn);
+    return TRUE;
+}
+
+/*
+ * Dispatch: renames the fetch group in program order, up to width
+ * instructions. What could not be renamed stays at the front of the group
+ * for the next cycle.
+ */
+static void
+dispatch(APEX_CPU *cpu, APEX_OoO *ooo)
+{
+    int renamed = 0;
+
+    if (ooo->fetch_count == 0)
+    {
+        trace(cpu, TRACE_STAGE_DECODE, TRACE_STATE_EMPTY, 0, 0);
+        return;
+    }
+
+    while (renamed < ooo->fetch_count
+           && rename_one(cpu, ooo, &ooo->fetched[renamed]))
+    {
+        renamed++;
+    }
+
+    if (renamed < ooo->fetch_count)
+    {
+        cpu->decode_stalls++;
+        trace(cpu, TRACE_STAGE_DECODE, TRACE_STATE_STALL,
+              ooo->fetched[renamed].pc, ooo->fetched[renamed].insn);
+    }
+    ooo->fetch_count -= renamed;
+    memmove(&ooo->fetched[0], &ooo->fetched[renamed],
+            ooo->fetch_count * sizeof(APEX_Fetch_Entry));
+}
+
+/*
+ * Fetch: same as the in-order fetch (branch prediction, instruction cache,
+ * bubbles after a mispredicted branch), but brings in a group of up to
+ * width instructions once the previous group is renamed. A group ends
+ * after a branch predicted taken and after HALT, and with an instruction
+ * cache at the end of the line. A wrong path running past the end of code
+ * memory waits for the branch to resolve.
+ */
+static void
+fetch(APEX_CPU *cpu, APEX_OoO *ooo)
+{
+    const int line_size = cpu->config.icache.line_size;
+    APEX_Fetch_Entry *fetched;
+    const APEX_Decoded *ins;
+    int index;
+
+    if (!cpu->fetch_enabled || cpu->stop_fetch)
+    {
+        trace(cpu, TRACE_STAGE_FETCH, TRACE_STATE_EMPTY, 0, 0);
+        return;
+    }
+    if (cpu->fetch_bubbles > 0)
+    {
+        cpu->fetch_bubbles--;
+        trace(cpu, TRACE_STAGE_FETCH, TRACE_STATE_EMPTY, 0, 0);
+        return;
+    }
+    index = get_code_memory_index_from_pc(cpu->pc);
+    if (index < 0 || index >= cpu->code_memory_size)
+    {
+        trace(cpu, TRACE_STAGE_FETCH, TRACE_STATE_EMPTY, 0, 0);
+        return;
+    }
+
+    /* A missed line keeps coming in while dispatch is stalled */
+    if (cpu->icache.num_sets && (ooo->fetch_count == 0 || cpu->fetch_wait > 0)
+        && APEX_cpu_fetch_waits(cpu))
+    {
+        cpu->fetch_wait--;
+        cpu->fetch_stalls++;
+        trace(cpu, TRACE_STAGE_FETCH, TRACE_STATE_EMPTY, 0, 0);
+        return;
+    }
+
+    if (ooo->fetch_count > 0)
+    {
+        trace(cpu, TRACE_STAGE_FETCH, TRACE_STATE_STALL, ooo->fetched[0].pc,
+              ooo->fetched[0].insn);
+        return;
+    }
+    cpu->fetch_missed = FALSE;
+
+    while (TRUE)
+    {
+        fetched = &ooo->fetched[ooo->fetch_count++];
+        fetched->pc = cpu->pc;
+        fetched->insn = index;
+        fetched->history = 0;
+        ins = &cpu->decoded[index];
+        if (is_branch(ins))
+        {
+            cpu->pc = APEX_bpred_predict(&cpu->bpred, cpu->pc,
+                                         &fetched->history);
+        }
+        else
+        {
+            cpu->pc += 4;
+        }
+        fetched->predicted_pc = cpu->pc;
+
+        trace(cpu, TRACE_STAGE_FETCH, TRACE_STATE_ACTIVE, fetched->pc, index);
+
+        /* Stop fetching new instructions if HALT is fetched */
+        if (ins->opcode == OPCODE_HALT)
+        {
+            cpu->fetch_enabled = FALSE;
+            return;
+        }
+
+        index = get_code_memory_index_from_pc(cpu->pc);
+        if (ooo->fetch_count == ooo->width || cpu->pc != fetched->pc + 4
+            || index < 0 || index >= cpu->code_memory_size
+            || (cpu->icache.num_sets && cpu->pc % line_size == 0))
+        {
+            return;
+        }
+    }
+}
+
+/*
+ * Simulates one clock cycle of the out-of-order core. Returns TRUE when HALT
+ * committed or the committing instruction accessed a word outside data
+ * memory (cpu->data_memory.fault is set then).
+ */
+int
+APEX_ooo_cycle(APEX_CPU *cpu)
+{
+    APEX_OoO *ooo = cpu->ooo;
+
+    if (!ooo->started)
+    {
+        start(cpu, ooo);
+    }
+    ooo->rob_occupancy += ooo->rob_count;
+    ooo->cycles++;
+
+    if (commit(cpu, ooo))
+    {
+        return TRUE;
+    }
+    complete(cpu, ooo);
+    issue(cpu, ooo);
+    dispatch(cpu, ooo);
+    fetch(cpu, ooo);
+    return FALSE;
+}
+
+static const char *const lsq_policy_names[] = {
+    [LSQ_COMMIT] = "commit", [LSQ_RESOLVED] = "resolved",
+    [LSQ_SPECULATE] = "speculate",
+};
+
+/*
+ * Prints the shape of the core, why rename stalled, the load/store queue
+ * counters and how many instructions issued per cycle
+ */
+void
+APEX_ooo_print_stats(const APEX_OoO *ooo, FILE *fp)
+{
+    int n;
+
+    fprintf(fp, "\n ============== %s CORE ============= \n",
+            ooo->in_order ? "IN-ORDER SUPERSCALAR" : "OUT-OF-ORDER");
+    fprintf(fp, "Width = %d | Memory ports = %d | Branch ports = %d\n",
+            ooo->width, ooo->mem_ports, ooo->branch_ports);
+    fprintf(fp, "ROB = %d | Issue queue = %d | Physical registers = %d\n",
+            ooo->rob_size, ooo->iq_size, ooo->phys_regs);
+    fprintf(fp, "Dispatch stalls: ROB full = %ld | Issue queue full = %ld | "
+            "LSQ full = %ld | No free register = %ld\n",
+            ooo->rob_full, ooo->iq_full, ooo->lsq_full, ooo->regs_full);
+    fprintf(fp, "LSQ = %d (%s) | Forwarded loads = %ld | Replays = %ld\n",
+            ooo->lsq_size, lsq_policy_names[ooo->lsq_policy],
+            ooo->forwarded_loads, ooo->replays);
+    fprintf(fp, "Squashed = %ld | Average ROB occupancy = %.2f\n",
+            ooo->squashed,
+            ooo->cycles ? (double)ooo->rob_occupancy / ooo->cycles : 0.0);
+    fprintf(fp, "Issued per cycle:");
+    for (n = 0; n <= ooo->width; ++n)
+    {
+        fprintf(fp, "%s %d = %ld", n ? " |" : "", n, ooo->issued[n]);
+    }
+    fprintf(fp, "\n");
+}
@@ -0,0 +1,140 @@
+/*
+ * apex_ooo.h
+ * Contains declarations of the superscalar backend: registers are renamed
+ * onto a physical register file, instructions wait in an issue queue until
+ * their operands are ready and issue to the functional units (oldest first,
+ * or strictly in program order), loads and stores also enter a load/store
+ * queue, and a reorder buffer commits them in program order. Every stage
+ * handles up to width instructions per cycle.
+ */
+#ifndef _APEX_OOO_H_
+#define _APEX_OOO_H_
+
+#include <stdio.h>
+
+#include "apex_cpu.h"
+
+/* The zero flag is renamed like one more architectural register */
+#define OOO_FLAG_REG REG_FILE_SIZE
+#define OOO_ARCH_REGS (REG_FILE_SIZE + 1)
+
+/* Fewest physical registers that can rename every instruction */
+#define OOO_MIN_PHYS_REGS (OOO_ARCH_REGS + 2)
+
+/* Widest fetch, rename, issue and commit */
+#define OOO_MAX_WIDTH 8
+
+/* Most sources of an instruction (STR reads three registers) */
+#define OOO_MAX_SOURCES 3
+
+/* When a load may issue relative to the older stores, see --lsq-policy */
+#define LSQ_COMMIT 0     /* Once every older store has committed */
+#define LSQ_RESOLVED 1   /* Once every older store has its address */
+#define LSQ_SPECULATE 2  /* Right away, replayed if an older store conflicts */
+
+typedef struct APEX_Rob_Entry
+{
+    int pc;
+    int insn;              /* Index into code memory / pre-decoded table */
+    int predicted_pc;      /* PC fetch went on to after a branch */
+    unsigned int history;  /* Predictor history of a branch */
+    int phys;              /* Physical destination register, -1 = none */
+    int old_phys;          /* Previous mapping of the destination */
+    int flag_phys;         /* Same for the zero flag (CMP, MOVC) */
+    int old_flag_phys;
+    int result;
+    int flag;              /* New zero flag, or whether a branch is taken */
+    int memory_address;
+    int store_value;
+    long store_seq;        /* Stores dispatched before this instruction */
+    long forwarded_seq;    /* Store a load took its value from, -1 = memory */
+    unsigned char resolved; /* Load or store issued, its address is known */
+    unsigned char done;    /* Executed, can commit */
+    unsigned char fault;   /* Load or store outside data memory */
+} APEX_Rob_Entry;
+
+/* Instruction waiting in the issue queue */
+typedef struct APEX_Iq_Entry
+{
+    int rob;
+    int src[OOO_MAX_SOURCES]; /* Physical sources, -1 = none */
+} APEX_Iq_Entry;
+
+/* Instruction executing in its functional unit */
+typedef struct APEX_Exec_Entry
+{
+    int rob;
+    int cycles_left;
+} APEX_Exec_Entry;
+
+/* Instruction fetched and waiting to be renamed */
+typedef struct APEX_Fetch_Entry
+{
+    int pc;
+    int insn;
+    int predicted_pc;
+    unsigned int history;
+} APEX_Fetch_Entry;
+
+typedef struct APEX_OoO
+{
+    int rob_size;
+    int iq_size;
+    int phys_regs;
+    int width;                /* Instructions per cycle of every stage */
+    int in_order;             /* Issue stops at the oldest waiting instruction */
+    int mem_ports;            /* Loads and stores issued per cycle */
+    int branch_ports;         /* Branches issued per cycle */
+    int lsq_size;
+    int lsq_policy;           /* LSQ_* */
+    int started;              /* Rename state was built from cpu->regs */
+
+    int rat[OOO_ARCH_REGS];   /* Speculative architectural to physical map */
+    int *phys_value;
+    unsigned char *phys_ready;
+    int *free_list;           /* Free physical registers, a ring */
+    int free_head;
+    int free_count;
+
+    APEX_Rob_Entry *rob;      /* A ring, oldest at rob_head */
+    int rob_head;
+    int rob_count;
+    APEX_Iq_Entry *iq;        /* Program order, oldest first */
+    int iq_count;
+    APEX_Exec_Entry *exec;
+    int exec_count;
+    int *lsq;                 /* ROB slots of loads and stores, a ring */
+    int lsq_head;
+    int lsq_count;
+    int replay;               /* Load issued too early this cycle, -1 = none */
+    APEX_Fetch_Entry fetched[OOO_MAX_WIDTH]; /* Fetch group, oldest first */
+    int fetch_count;
+
+    /* Copies of each functional unit and the cycles until each copy takes
+     * its next operation */
+    int unit_copies[NUM_FUNCTIONAL_UNITS];
+    int unit_busy[NUM_FUNCTIONAL_UNITS][OOO_MAX_WIDTH];
+
+    long stores_dispatched;   /* Numbers the stores in program order */
+    long stores_committed;
+
+    long forwarded_loads;     /* Loads that took their value from a store */
+    long replays;             /* Loads squashed for passing a conflicting store */
+
+    long rob_full;            /* Cycles rename stalled for each reason */
+    long iq_full;
+    long regs_full;
+    long lsq_full;
+    long squashed;            /* Wrong path instructions thrown away */
+    long rob_occupancy;       /* Summed every cycle */
+    long cycles;
+    long issued[OOO_MAX_WIDTH + 1]; /* Cycles that issued 0..width instructions */
+} APEX_OoO;
+
+APEX_OoO *APEX_ooo_create(const APEX_Pipeline_Config *config);
+void APEX_ooo_free(APEX_OoO *ooo);
+void APEX_ooo_reset(APEX_OoO *ooo);
+int APEX_ooo_empty(const APEX_OoO *ooo);
+int APEX_ooo_cycle(APEX_CPU *cpu);
+void APEX_ooo_print_stats(const APEX_OoO *ooo, FILE *fp);
+#endif
@@ -0,0 +1,183 @@
+/*
+ * apex_sample.c
+ * Contains the SMARTS style statistical sampling driver. Every period the
+ * program is fast-forwarded in the functional engine, then handed to the
+ * pipeline which is warmed up for a few instructions before the CPI of a
+ * short window is measured. The pipeline is drained afterwards so the
+ * functional engine can take over again at a precise PC.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_cpu.h"
+#include "apex_func.h"
+#include "apex_macros.h"
+#include "apex_sample.h"
+#include "apex_tcache.h"
+
+/* Advances the pipeline by one cycle, returns TRUE when HALT retired */
+static int
+detailed_cycle(APEX_CPU *cpu, APEX_Sample_Result *result)
+{
+    int halted = APEX_cpu_cycle(cpu);
+
+    cpu->clock++;
+    result->detailed_cycles++;
+    return halted;
+}
+
+/*
+ * Runs the pipeline from empty latches until target more instructions have
+ * retired. Returns TRUE when the program halted first; running off the end
+ * of code memory halts it, as in the functional engine.
+ */
+static int
+detailed_run(APEX_CPU *cpu, const long target, APEX_Sample_Result *result)
+{
+    const long start = cpu->insn_completed;
+
+    while (cpu->insn_completed - start < target)
+    {
+        /* Fetch has stopped at the end of code memory and all retired */
+        if (!APEX_cpu_pc_in_code(cpu) && APEX_cpu_pipeline_empty(cpu))
+        {
+            return TRUE;
+        }
+        if (detailed_cycle(cpu, result))
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Stops fetch and lets every in-flight instruction retire, so cpu->pc is the
+ * next instruction to execute. Returns TRUE when HALT retired while draining.
+ */
+static int
+drain_pipeline(APEX_CPU *cpu, APEX_Sample_Result *result)
+{
+    int halted = FALSE;
+
+    cpu->stop_fetch = TRUE;
+    while (!APEX_cpu_pipeline_empty(cpu))
+    {
+        if (detailed_cycle(cpu, result))
+        {
+            halted = TRUE;
+            break;
+        }
+    }
+    cpu->stop_fetch = FALSE;
+    return halted;
+}
+
+/*
+ * Samples the whole program. The CPI of each window is measured from the
+ * retirement of the last warm-up instruction to the retirement of the last
+ * window instruction, so pipeline fill and drain are not part of it.
+ */
+void
+APEX_sample_run(APEX_CPU *cpu, const APEX_Sample_Config *cfg,
+                APEX_Sample_Result *result)
+{
+    long skip = cfg->period - cfg->warmup - cfg->window;
+    long cycle_start;
+    double cpi, variance, sum = 0.0, sum_sq = 0.0;
+    int halted = FALSE;
+
+    memset(result, 0, sizeof(APEX_Sample_Result));
+    if (skip < 0)
+    {
+        skip = 0;
+    }
+
+    while (!halted)
+    {
+        /* Functional warming up to the next sample */
+        if (cfg->use_tcache)
+        {
+            APEX_tcache_run(cpu, skip, &halted);
+        }
+        else
+        {
+            APEX_func_run(cpu, skip, &halted);
+        }
+        if (halted)
+        {
+            break;
+        }
+
+        /* Detailed warming, then the measured window */
+        APEX_func_handoff(cpu);
+        if (detailed_run(cpu, cfg->warmup, result))
+        {
+            halted = TRUE;
+            break;
+        }
+
+        cycle_start = result->detailed_cycles;
+        if (detailed_run(cpu, cfg->window, result))
+        {
+            halted = TRUE;
+            break;
+        }
+
+        cpi = (double)(result->detailed_cycles - cycle_start) / cfg->window;
+        sum += cpi;
+        sum_sq += cpi * cpi;
+        result->samples++;
+
+        halted = drain_pipeline(cpu, result);
+    }
+
+    result->halted = halted;
+    result->insn_total = cpu->insn_fast_forwarded + cpu->insn_completed;
+
+    if (result->samples > 0)
+    {
+        result->cpi_mean = sum / result->samples;
+    }
+    if (result->samples > 1)
+    {
+        variance = (sum_sq - sum * result->cpi_mean) / (result->samples - 1);
+        result->cpi_stddev = variance > 0.0 ? sqrt(variance) : 0.0;
+        result->cpi_ci = SAMPLE_CONFIDENCE_Z * result->cpi_stddev
+                         / sqrt((double)result->samples);
+    }
+}
+
+/*
+ * Prints the CPI estimate of a sampled run
+ */
+void
+APEX_sample_print(const APEX_Sample_Result *result, FILE *fp)
+{
+    fprintf(fp, "\n ============== SAMPLED CPI ESTIMATE ============= \n");
+    fprintf(fp, "Samples = %ld | Instructions = %ld | Detailed cycles = %ld\n",
+            result->samples, result->insn_total, result->detailed_cycles);
+
+    if (result->samples == 0)
+    {
+        fprintf(fp, "CPI = n/a (program ended before the first window)\n");
+        return;
+    }
+
+    if (result->samples == 1)
+    {
+        fprintf(fp, "CPI = %.4f (single sample, no confidence interval)\n",
+                result->cpi_mean);
+        return;
+    }
+
+    fprintf(fp, "CPI = %.4f +/- %.4f (95%% confidence, stddev = %.4f, "
+            "+/- %.2f%%)\n", result->cpi_mean, result->cpi_ci,
+            result->cpi_stddev,
+            result->cpi_mean > 0 ? 100.0 * result->cpi_ci / result->cpi_mean
+                                 : 0.0);
+    fprintf(fp, "Estimated cycles = %.0f\n",
+            result->cpi_mean * result->insn_total);
+}
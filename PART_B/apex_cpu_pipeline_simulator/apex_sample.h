@@ -0,0 +1,39 @@
+/*
+ * apex_sample.h
+ * Contains declarations of the SMARTS style sampling driver, which estimates
+ * the CPI of a program from short detailed windows in the pipeline separated
+ * by functional warming
+ */
+#ifndef _APEX_SAMPLE_H_
+#define _APEX_SAMPLE_H_
+
+#include <stdio.h>
+
+#include "apex_cpu.h"
+
+/* z value of the reported confidence interval (95%) */
+#define SAMPLE_CONFIDENCE_Z 1.96
+
+typedef struct APEX_Sample_Config
+{
+    long period;    /* Instructions from the start of one sample to the next */
+    long window;    /* Measured instructions per sample */
+    long warmup;    /* Detailed warming instructions before each window */
+    int use_tcache; /* Functional warming through the translation cache */
+} APEX_Sample_Config;
+
+typedef struct APEX_Sample_Result
+{
+    long samples;          /* Completed measurement windows */
+    double cpi_mean;
+    double cpi_stddev;
+    double cpi_ci;         /* Half width of the confidence interval */
+    long insn_total;       /* Instructions executed by both engines */
+    long detailed_cycles;  /* Cycles simulated in the pipeline */
+    int halted;
+} APEX_Sample_Result;
+
+void APEX_sample_run(APEX_CPU *cpu, const APEX_Sample_Config *cfg,
+                     APEX_Sample_Result *result);
+void APEX_sample_print(const APEX_Sample_Result *result, FILE *fp);
+#endif
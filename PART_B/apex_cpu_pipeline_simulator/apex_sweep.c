@@ -0,0 +1,341 @@
+/*
+ * apex_sweep.c
+ * Contains the configuration sweep. The program is parsed once, every point
+ * of the parameter grid becomes one job of the batch runner, and all jobs
+ * share the read-only code image. The same option parser also sets the
+ * timing of a single run.
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_batch.h"
+#include "apex_cpu.h"
+#include "apex_macros.h"
+#include "apex_ooo.h"
+#include "apex_sweep.h"
+
+/* Names parameters can be given by instead of their value, NULL ended */
+static const char *const policy_names[] = { "lru", "plru", "random", NULL };
+static const char *const write_names[] = { "through", "back", NULL };
+static const char *const prefetch_names[] = { "none", "next-line", "stride",
+                                             "stream", NULL };
+static const char *const bpred_names[] = { "none", "bimodal", "gshare", "tage",
+                                          NULL };
+static const char *const lsq_names[] = { "commit", "resolved", "speculate",
+                                        NULL };
+
+#define FIELD(name) offsetof(APEX_Pipeline_Config, name)
+
+/*
+ * Command line option, report column, field and range of every sweepable
+ * parameter, and the names of its values if it has any
+ */
+static const struct
+{
+    const char *option;
+    const char *column;
+    size_t offset;
+    int min;
+    int max;
+    const char *const *names;
+} sweep_params[SWEEP_NUM_AXES] = {
+    { "--forwarding",     "fwd",  FIELD(forwarding),     0, SWEEP_MAX_VALUE, NULL },
+    { "--branch-penalty", "bp",   FIELD(branch_penalty), 0, SWEEP_MAX_VALUE, NULL },
+    { "--alu-latency",    "alu",  FIELD(alu_latency),    1, SWEEP_MAX_VALUE, NULL },
+    { "--alu-interval",   "alui", FIELD(alu_interval),   0, SWEEP_MAX_VALUE, NULL },
+    { "--mul-latency",    "mul",  FIELD(mul_latency),    1, SWEEP_MAX_VALUE, NULL },
+    { "--mul-interval",   "muli", FIELD(mul_interval),   0, SWEEP_MAX_VALUE, NULL },
+    { "--div-latency",    "div",  FIELD(div_latency),    1, SWEEP_MAX_VALUE, NULL },
+    { "--div-interval",   "divi", FIELD(div_interval),   0, SWEEP_MAX_VALUE, NULL },
+    { "--agu-latency",    "agu",  FIELD(agu_latency),    1, SWEEP_MAX_VALUE, NULL },
+    { "--agu-interval",   "agui", FIELD(agu_interval),   0, SWEEP_MAX_VALUE, NULL },
+    { "--mem-latency",    "mem",  FIELD(mem_latency),    1, SWEEP_MAX_VALUE, NULL },
+    { "--dcache-size",         "dsize", FIELD(dcache.size),         0, 1 << 30, NULL },
+    { "--dcache-ways",         "dway",  FIELD(dcache.ways),         1, 32, NULL },
+    { "--dcache-line",         "dline", FIELD(dcache.line_size),    4, 1 << 16, NULL },
+    { "--dcache-policy",       "dpol",  FIELD(dcache.policy),       0, 2, policy_names },
+    { "--dcache-write",        "dwr",   FIELD(dcache.write_back),   0, 1, write_names },
+    { "--dcache-hit-latency",  "dhit",  FIELD(dcache.hit_latency),  1, SWEEP_MAX_VALUE, NULL },
+    { "--dcache-miss-latency", "dmiss", FIELD(dcache.miss_latency), 0, SWEEP_MAX_VALUE, NULL },
+    { "--dcache-prefetch",     "dpf",   FIELD(dcache.prefetch),     0, 3, prefetch_names },
+    { "--dcache-prefetch-degree",   "dpdeg",  FIELD(dcache.prefetch_degree),   1, CACHE_MAX_PREFETCH_DEGREE, NULL },
+    { "--dcache-prefetch-distance", "dpdist", FIELD(dcache.prefetch_distance), 1, 1 << 16, NULL },
+    { "--icache-size",         "isize", FIELD(icache.size),         0, 1 << 30, NULL },
+    { "--icache-ways",         "iway",  FIELD(icache.ways),         1, 32, NULL },
+    { "--icache-line",         "iline", FIELD(icache.line_size),    4, 1 << 16, NULL },
+    { "--icache-policy",       "ipol",  FIELD(icache.policy),       0, 2, policy_names },
+    { "--icache-hit-latency",  "ihit",  FIELD(icache.hit_latency),  1, SWEEP_MAX_VALUE, NULL },
+    { "--icache-miss-latency", "imiss", FIELD(icache.miss_latency), 0, SWEEP_MAX_VALUE, NULL },
+    { "--icache-prefetch",     "ipf",   FIELD(icache.prefetch),     0, 3, prefetch_names },
+    { "--icache-prefetch-degree",   "ipdeg",  FIELD(icache.prefetch_degree),   1, CACHE_MAX_PREFETCH_DEGREE, NULL },
+    { "--icache-prefetch-distance", "ipdist", FIELD(icache.prefetch_distance), 1, 1 << 16, NULL },
+    { "--bpred",         "pred",  FIELD(bpred.kind),     0, 3, bpred_names },
+    { "--bpred-size",    "psize", FIELD(bpred.size),     16, 1 << 24, NULL },
+    { "--bpred-history", "phist", FIELD(bpred.history),  0, BPRED_MAX_HISTORY, NULL },
+    { "--btb-size",      "btb",   FIELD(bpred.btb_size), 1, 1 << 24, NULL },
+    { "--ooo",       "ooo",  FIELD(ooo),       0, 1, NULL },
+    { "--rob-size",  "rob",  FIELD(rob_size),  1, 1 << 16, NULL },
+    { "--iq-size",   "iq",   FIELD(iq_size),   1, 1 << 16, NULL },
+    { "--phys-regs", "preg", FIELD(phys_regs), OOO_MIN_PHYS_REGS, 1 << 16, NULL },
+    { "--width",        "w",     FIELD(width),        1, OOO_MAX_WIDTH, NULL },
+    { "--mem-ports",    "mport", FIELD(mem_ports),    1, OOO_MAX_WIDTH, NULL },
+    { "--branch-ports", "bport", FIELD(branch_ports), 1, OOO_MAX_WIDTH, NULL },
+    { "--lsq-size",   "lsq",  FIELD(lsq_size),   1, 1 << 16, NULL },
+    { "--lsq-policy", "lsqp", FIELD(lsq_policy), 0, 2, lsq_names },
+};
+
+static int *
+config_field(APEX_Pipeline_Config *config, const int axis)
+{
+    return (int *)((char *)config + sweep_params[axis].offset);
+}
+
+static int
+config_value(const APEX_Pipeline_Config *config, const int axis)
+{
+    return *(const int *)((const char *)config + sweep_params[axis].offset);
+}
+
+/* Every axis holds just the default value */
+void
+APEX_sweep_grid_init(APEX_Sweep_Grid *grid)
+{
+    APEX_Pipeline_Config config;
+    int axis;
+
+    APEX_cpu_default_config(&config);
+    memset(grid, 0, sizeof(APEX_Sweep_Grid));
+
+    for (axis = 0; axis < SWEEP_NUM_AXES; ++axis)
+    {
+        grid->axes[axis].values[0] = config_value(&config, axis);
+        grid->axes[axis].count = 1;
+    }
+}
+
+/* Index of the name at p in names (NULL ended), end is set past it */
+static int
+parse_name(const char *const *names, const char *p, char **end)
+{
+    size_t len = strcspn(p, ",");
+    int i;
+
+    for (i = 0; names && names[i]; ++i)
+    {
+        if (strlen(names[i]) == len && strncmp(names[i], p, len) == 0)
+        {
+            *end = (char *)p + len;
+            return i;
+        }
+    }
+    *end = (char *)p;
+    return -1;
+}
+
+/* Parses a comma separated list such as "1,2,4" into the axis of param */
+static int
+parse_values(APEX_Sweep_Axis *axis, const char *list, const int param)
+{
+    const char *p = list;
+    char *end;
+    long value;
+
+    axis->count = 0;
+    while (*p)
+    {
+        value = parse_name(sweep_params[param].names, p, &end);
+        if (end == p)
+        {
+            value = strtol(p, &end, 10);
+        }
+        if (end == p || value < sweep_params[param].min
+            || value > sweep_params[param].max
+            || axis->count == SWEEP_MAX_VALUES)
+        {
+            return FALSE;
+        }
+        axis->values[axis->count++] = value;
+
+        if (*end == ',')
+        {
+            end++;
+        }
+        else if (*end != '\0')
+        {
+            return FALSE;
+        }
+        p = end;
+    }
+    return axis->count > 0;
+}
+
+/*
+ * Consumes argv[*i] (and its value) if it is one of the timing options
+ *
+ * Returns TRUE if consumed, FALSE if it is some other option and -1 if the
+ * value list is malformed
+ */
+int
+APEX_sweep_parse_option(APEX_Sweep_Grid *grid, const int argc,
+                        char const *argv[], int *i)
+{
+    int axis;
+
+    for (axis = 0; axis < SWEEP_NUM_AXES; ++axis)
+    {
+        if (strcmp(argv[*i], sweep_params[axis].option) == 0)
+        {
+            if (*i + 1 >= argc
+                || !parse_values(&grid->axes[axis], argv[*i + 1], axis))
+            {
+                return -1;
+            }
+            *i += 1;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Number of configurations in the grid, -1 if it is more than
+ * SWEEP_MAX_CONFIGS. The product is checked after every axis, so it never
+ * grows past SWEEP_MAX_CONFIGS * SWEEP_MAX_VALUES.
+ */
+long
+APEX_sweep_grid_size(const APEX_Sweep_Grid *grid)
+{
+    long size = 1;
+    int axis;
+
+    for (axis = 0; axis < SWEEP_NUM_AXES; ++axis)
+    {
+        size *= grid->axes[axis].count;
+        if (size > SWEEP_MAX_CONFIGS)
+        {
+            return -1;
+        }
+    }
+    return size;
+}
+
+/*
+ * Configuration number index of the grid, the last parameter varies fastest
+ */
+void
+APEX_sweep_config_at(const APEX_Sweep_Grid *grid, long index,
+                     APEX_Pipeline_Config *config)
+{
+    const APEX_Sweep_Axis *a;
+    int axis;
+
+    APEX_cpu_default_config(config);
+    for (axis = SWEEP_NUM_AXES - 1; axis >= 0; --axis)
+    {
+        a = &grid->axes[axis];
+        *config_field(config, axis) = a->values[index % a->count];
+        index /= a->count;
+    }
+}
+
+/* Table width of the column of axis, wide enough for its name and names */
+static int
+column_width(const int axis)
+{
+    const char *const *names = sweep_params[axis].names;
+    int width = 4;
+    int i;
+
+    if ((int)strlen(sweep_params[axis].column) > width)
+    {
+        width = strlen(sweep_params[axis].column);
+    }
+    for (i = 0; names && names[i]; ++i)
+    {
+        if ((int)strlen(names[i]) > width)
+        {
+            width = strlen(names[i]);
+        }
+    }
+    return width;
+}
+
+/* Prints one cell of the column of axis, csv or padded to the table */
+static void
+print_cell(FILE *fp, const int csv, const int axis, const char *text)
+{
+    if (csv)
+    {
+        fprintf(fp, "%s,", text);
+    }
+    else
+    {
+        fprintf(fp, "%*s ", column_width(axis), text);
+    }
+}
+
+/* Prints one value of axis, by name if the parameter has names */
+static void
+print_value(FILE *fp, const int csv, const int axis, const int value)
+{
+    const char *const *names = sweep_params[axis].names;
+    char text[16];
+
+    if (names)
+    {
+        print_cell(fp, csv, axis, names[value]);
+    }
+    else
+    {
+        snprintf(text, sizeof(text), "%d", value);
+        print_cell(fp, csv, axis, text);
+    }
+}
+
+/*
+ * Prints the CPI of every configuration, as a table or (csv set) as CSV.
+ * Only the parameters that take more than one value in grid get a column.
+ */
+void
+APEX_sweep_report(const APEX_Sweep_Grid *grid, const APEX_Batch_Job *jobs,
+                  const int num_jobs, FILE *fp, const int csv)
+{
+    const APEX_Batch_Job *job;
+    int i, axis;
+
+    for (axis = 0; axis < SWEEP_NUM_AXES; ++axis)
+    {
+        if (grid->axes[axis].count > 1)
+        {
+            print_cell(fp, csv, axis, sweep_params[axis].column);
+        }
+    }
+    if (csv)
+    {
+        fprintf(fp, "cycles,instructions,cpi,status\n");
+    }
+    else
+    {
+        fprintf(fp, "| %10s %12s %8s  %s\n", "cycles", "instructions", "CPI",
+                "status");
+    }
+
+    for (i = 0; i < num_jobs; ++i)
+    {
+        job = &jobs[i];
+        for (axis = 0; axis < SWEEP_NUM_AXES; ++axis)
+        {
+            if (grid->axes[axis].count > 1)
+            {
+                print_value(fp, csv, axis, config_value(&job->config, axis));
+            }
+        }
+        fprintf(fp, csv ? "%d,%d,%.4f,%s\n" : "| %10d %12d %8.4f  %s\n",
+                job->cycles, job->instructions,
+                job->instructions ? (double)job->cycles / job->instructions
+                                  : 0.0,
+                APEX_batch_status_name(job->status));
+    }
+}
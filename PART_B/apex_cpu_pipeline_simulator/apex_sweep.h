@@ -0,0 +1,47 @@
+/*
+ * apex_sweep.h
+ * Contains declarations of the configuration sweep, which runs one program
+ * under every combination of a grid of pipeline timing parameters
+ */
+#ifndef _APEX_SWEEP_H_
+#define _APEX_SWEEP_H_
+
+#include <stdio.h>
+
+#include "apex_batch.h"
+#include "apex_cpu.h"
+
+/* Number of APEX_Pipeline_Config fields that can be swept */
+#define SWEEP_NUM_AXES 43
+
+/* Most values one parameter can take in a sweep */
+#define SWEEP_MAX_VALUES 16
+
+/* Largest value of a latency, latencies are counted down in 16 bits */
+#define SWEEP_MAX_VALUE 65535
+
+/* Most configurations one sweep runs, each of them is a batch job */
+#define SWEEP_MAX_CONFIGS 65536
+
+/* Values of one APEX_Pipeline_Config field */
+typedef struct APEX_Sweep_Axis
+{
+    int values[SWEEP_MAX_VALUES];
+    int count;
+} APEX_Sweep_Axis;
+
+typedef struct APEX_Sweep_Grid
+{
+    APEX_Sweep_Axis axes[SWEEP_NUM_AXES];
+} APEX_Sweep_Grid;
+
+void APEX_sweep_grid_init(APEX_Sweep_Grid *grid);
+int APEX_sweep_parse_option(APEX_Sweep_Grid *grid, const int argc,
+                            char const *argv[], int *i);
+long APEX_sweep_grid_size(const APEX_Sweep_Grid *grid);
+void APEX_sweep_config_at(const APEX_Sweep_Grid *grid, long index,
+                          APEX_Pipeline_Config *config);
+void APEX_sweep_report(const APEX_Sweep_Grid *grid,
+                       const APEX_Batch_Job *jobs, const int num_jobs,
+                       FILE *fp, const int csv);
+#endif
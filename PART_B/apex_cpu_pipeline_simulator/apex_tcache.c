@@ -0,0 +1,462 @@
+/*
+ * apex_tcache.c
+ * Contains the basic block translation cache of the functional APEX engine.
+ * Each basic block (straight line code up to a BZ, BNZ or HALT) is turned
+ * once into a chain of specialized closures with register pointers and
+ * immediates folded in. Blocks are looked up by PC and chained directly to
+ * their successors, so hot loops run without any decoding or dispatch on the
+ * opcode.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_cpu.h"
+#include "apex_func.h"
+#include "apex_macros.h"
+#include "apex_tcache.h"
+
+/*
+ * Specialized closures, one per operation
+ */
+static int
+op_add(const APEX_Op *op)
+{
+    *op->dst = *op->src1 + *op->src2;
+    return FALSE;
+}
+
+static int
+op_sub(const APEX_Op *op)
+{
+    *op->dst = *op->src1 - *op->src2;
+    return FALSE;
+}
+
+static int
+op_mul(const APEX_Op *op)
+{
+    *op->dst = *op->src1 * *op->src2;
+    return FALSE;
+}
+
+static int
+op_div(const APEX_Op *op)
+{
+    *op->dst = *op->src2 ? *op->src1 / *op->src2 : 0;
+    return FALSE;
+}
+
+static int
+op_and(const APEX_Op *op)
+{
+    *op->dst = *op->src1 & *op->src2;
+    return FALSE;
+}
+
+static int
+op_or(const APEX_Op *op)
+{
+    *op->dst = *op->src1 | *op->src2;
+    return FALSE;
+}
+
+static int
+op_xor(const APEX_Op *op)
+{
+    *op->dst = *op->src1 ^ *op->src2;
+    return FALSE;
+}
+
+static int
+op_addl(const APEX_Op *op)
+{
+    *op->dst = *op->src1 + op->imm;
+    return FALSE;
+}
+
+static int
+op_subl(const APEX_Op *op)
+{
+    *op->dst = *op->src1 - op->imm;
+    return FALSE;
+}
+
+static int
+op_movc(const APEX_Op *op)
+{
+    *op->dst = op->imm;
+    *op->zero_flag = (op->imm == 0) ? TRUE : FALSE;
+    return FALSE;
+}
+
+/* A trapping load leaves its destination alone */
+static int
+op_load(const APEX_Op *op)
+{
+    const int value = APEX_memory_read(op->mem, *op->src1 + op->imm);
+
+    if (op->mem->fault)
+    {
+        return TRUE;
+    }
+    *op->dst = value;
+    return FALSE;
+}
+
+static int
+op_ldr(const APEX_Op *op)
+{
+    const int value = APEX_memory_read(op->mem, *op->src1 + *op->src2);
+
+    if (op->mem->fault)
+    {
+        return TRUE;
+    }
+    *op->dst = value;
+    return FALSE;
+}
+
+static int
+op_store(const APEX_Op *op)
+{
+    APEX_memory_write(op->mem, *op->src2 + op->imm, *op->src1);
+    return op->mem->fault;
+}
+
+static int
+op_str(const APEX_Op *op)
+{
+    APEX_memory_write(op->mem, *op->src2 + *op->src3, *op->src1);
+    return op->mem->fault;
+}
+
+static int
+op_cmp(const APEX_Op *op)
+{
+    *op->zero_flag = (*op->src1 == *op->src2) ? TRUE : FALSE;
+    return FALSE;
+}
+
+/* The run adds its instructions to the counts at the end, not per block */
+static int
+op_rdcnt(const APEX_Op *op)
+{
+    *op->dst = APEX_cpu_read_counter(op->cpu, op->imm,
+                                     op->cpu->tcache->executed + op->offset);
+    return FALSE;
+}
+
+static int
+op_clrcnt(const APEX_Op *op)
+{
+    APEX_cpu_clear_counters(op->cpu, op->cpu->tcache->executed + op->offset);
+    return FALSE;
+}
+
+/* Closure of each opcode, NULL for block exits and NOP which emit no op */
+static const APEX_Op_Fn op_fns[NUM_OPCODES] = {
+    [OPCODE_ADD] = op_add,     [OPCODE_SUB] = op_sub,
+    [OPCODE_MUL] = op_mul,     [OPCODE_DIV] = op_div,
+    [OPCODE_AND] = op_and,     [OPCODE_OR] = op_or,
+    [OPCODE_XOR] = op_xor,     [OPCODE_MOVC] = op_movc,
+    [OPCODE_LOAD] = op_load,   [OPCODE_STORE] = op_store,
+    [OPCODE_ADDL] = op_addl,   [OPCODE_SUBL] = op_subl,
+    [OPCODE_LDR] = op_ldr,     [OPCODE_STR] = op_str,
+    [OPCODE_CMP] = op_cmp,     [OPCODE_RDCNT] = op_rdcnt,
+    [OPCODE_CLRCNT] = op_clrcnt,
+};
+
+/*
+ * Translates the basic block starting at code memory index start
+ */
+static APEX_Block *
+translate_block(APEX_CPU *cpu, const int start)
+{
+    APEX_Block *block, *shrunk;
+    const APEX_Decoded *ins;
+    APEX_Op *op;
+    int i;
+
+    block = calloc(1, sizeof(APEX_Block)
+                          + sizeof(APEX_Op) * TCACHE_MAX_BLOCK_LEN);
+    if (!block)
+    {
+        return NULL;
+    }
+
+    block->start = start;
+    block->exit_kind = BLOCK_EXIT_FALLTHROUGH;
+
+    for (i = start; i < cpu->code_memory_size; ++i)
+    {
+        ins = &cpu->decoded[i];
+        block->len++;
+
+        if (ins->opcode == OPCODE_BZ || ins->opcode == OPCODE_BNZ)
+        {
+            block->exit_kind = (ins->opcode == OPCODE_BZ) ? BLOCK_EXIT_BZ
+                                                          : BLOCK_EXIT_BNZ;
+            block->taken_index
+                = get_code_memory_index_from_pc(4000 + i * 4 + ins->imm);
+            break;
+        }
+
+        if (ins->opcode == OPCODE_HALT)
+        {
+            block->exit_kind = BLOCK_EXIT_HALT;
+            break;
+        }
+
+        if (op_fns[ins->opcode])
+        {
+            op = &block->ops[block->num_ops++];
+            op->fn = op_fns[ins->opcode];
+            op->dst = &cpu->regs[ins->rd];
+            op->src1 = &cpu->regs[ins->rs1];
+            op->src2 = &cpu->regs[ins->rs2];
+            op->src3 = &cpu->regs[ins->rs3];
+            op->zero_flag = &cpu->zero_flag;
+            op->mem = &cpu->data_memory;
+            op->cpu = cpu;
+            op->imm = ins->imm;
+            op->offset = i - start;
+        }
+
+        if (block->len == TCACHE_MAX_BLOCK_LEN)
+        {
+            break;
+        }
+    }
+
+    block->fall_index = start + block->len;
+
+    /* Give back the unused tail of the op array */
+    shrunk = realloc(block, sizeof(APEX_Block) + sizeof(APEX_Op) * block->num_ops);
+    return shrunk ? shrunk : block;
+}
+
+/*
+ * Finds the block starting at index, translating it on a miss
+ */
+static APEX_Block *
+lookup_block(APEX_CPU *cpu, APEX_TCache *tc, const int index)
+{
+    tc->lookups++;
+
+    if (tc->blocks[index])
+    {
+        tc->hits++;
+        return tc->blocks[index];
+    }
+
+    tc->blocks[index] = translate_block(cpu, index);
+    if (tc->blocks[index])
+    {
+        tc->translated++;
+    }
+    return tc->blocks[index];
+}
+
+/*
+ * Executes up to insn_count instructions through the translation cache. Has
+ * the same contract as APEX_func_run; when fewer instructions are left in
+ * the budget than in the next block the remainder is single stepped.
+ */
+long
+APEX_tcache_run(APEX_CPU *cpu, const long insn_count, int *halted)
+{
+    APEX_TCache *tc = cpu->tcache;
+    APEX_Block *block = NULL;
+    APEX_Block **link = NULL;
+    long executed = 0;
+    long stepped;
+    int index = get_code_memory_index_from_pc(cpu->pc);
+    int taken, stop;
+    int i;
+
+    *halted = FALSE;
+
+    if (!tc)
+    {
+        tc = calloc(1, sizeof(APEX_TCache));
+        if (!tc)
+        {
+            return 0;
+        }
+        tc->size = cpu->code_memory_size;
+        tc->blocks = calloc(tc->size, sizeof(APEX_Block *));
+        if (!tc->blocks)
+        {
+            free(tc);
+            return 0;
+        }
+        cpu->tcache = tc;
+    }
+
+    while (executed < insn_count)
+    {
+        if (!block)
+        {
+            if ((unsigned)index >= (unsigned)tc->size)
+            {
+                *halted = TRUE;
+                break;
+            }
+
+            block = lookup_block(cpu, tc, index);
+            if (!block)
+            {
+                break;
+            }
+
+            /* Chain the previous block's exit straight to this one */
+            if (link)
+            {
+                *link = block;
+            }
+        }
+
+        if (block->len > insn_count - executed)
+        {
+            /* Not enough budget left for the whole block */
+            cpu->pc = 4000 + index * 4;
+            cpu->insn_fast_forwarded += executed;
+            while (executed < insn_count)
+            {
+                /*
+                 * A step counts once it is done, and only if APEX_func_step
+                 * counted it: a faulting access or running off the end of
+                 * code memory executes nothing
+                 */
+                stepped = cpu->insn_fast_forwarded;
+                stop = APEX_func_step(cpu);
+                executed += cpu->insn_fast_forwarded - stepped;
+                if (stop)
+                {
+                    *halted = TRUE;
+                    break;
+                }
+            }
+            return executed;
+        }
+
+        tc->executed = executed;
+        for (i = 0; i < block->num_ops; ++i)
+        {
+            if (block->ops[i].fn(&block->ops[i]))
+            {
+                /* Stop at the faulting instruction, like APEX_func_step */
+                index = block->start + block->ops[i].offset;
+                executed += block->ops[i].offset;
+                *halted = TRUE;
+                goto done;
+            }
+        }
+        block->exec_count++;
+        executed += block->len;
+
+        switch (block->exit_kind)
+        {
+            case BLOCK_EXIT_HALT:
+            {
+                /* Leave the PC at the HALT, like APEX_func_step */
+                index = block->start + block->len - 1;
+                *halted = TRUE;
+                goto done;
+            }
+
+            case BLOCK_EXIT_BZ:
+            case BLOCK_EXIT_BNZ:
+            {
+                taken = (cpu->zero_flag == TRUE)
+                        == (block->exit_kind == BLOCK_EXIT_BZ);
+                break;
+            }
+
+            default:
+            {
+                taken = FALSE;
+                break;
+            }
+        }
+
+        index = taken ? block->taken_index : block->fall_index;
+        link = taken ? &block->taken : &block->fall;
+
+        if (*link)
+        {
+            tc->chained++;
+            block = *link;
+            link = NULL;
+        }
+        else
+        {
+            block = NULL;
+        }
+    }
+
+done:
+    cpu->pc = 4000 + index * 4;
+    cpu->insn_fast_forwarded += executed;
+    return executed;
+}
+
+/*
+ * Drops every translated block and the statistics. Must be called whenever
+ * code memory is (re)loaded.
+ */
+void
+APEX_tcache_invalidate(APEX_CPU *cpu)
+{
+    APEX_TCache *tc = cpu->tcache;
+    int i;
+
+    if (!tc)
+    {
+        return;
+    }
+
+    for (i = 0; i < tc->size; ++i)
+    {
+        free(tc->blocks[i]);
+    }
+    free(tc->blocks);
+    free(tc);
+    cpu->tcache = NULL;
+}
+
+/*
+ * Prints the cache hit rate and the execution count of every block
+ */
+void
+APEX_tcache_print_stats(const APEX_CPU *cpu, FILE *fp)
+{
+    const APEX_TCache *tc = cpu->tcache;
+    const APEX_Block *block;
+    long entries;
+    int i;
+
+    if (!tc)
+    {
+        return;
+    }
+
+    fprintf(fp, "\n ============== TRANSLATION CACHE ============= \n");
+    /* A block entry hits unless it had to be translated first */
+    entries = tc->lookups + tc->chained;
+    fprintf(fp, "Blocks translated = %ld | Block entries = %ld | "
+            "Chained = %ld | Hit rate = %.2f%%\n",
+            tc->translated, entries, tc->chained,
+            entries ? 100.0 * (tc->hits + tc->chained) / entries : 0.0);
+
+    for (i = 0; i < tc->size; ++i)
+    {
+        block = tc->blocks[i];
+        if (block)
+        {
+            fprintf(fp, "Block pc(%d) | Instructions = %d | Executions = %ld\n",
+                    4000 + block->start * 4, block->len, block->exec_count);
+        }
+    }
+}
@@ -0,0 +1,79 @@
+/*
+ * apex_tcache.h
+ * Contains declarations of the basic block translation cache used by the
+ * functional APEX execution engine
+ */
+#ifndef _APEX_TCACHE_H_
+#define _APEX_TCACHE_H_
+
+#include <stdio.h>
+
+#include "apex_cpu.h"
+
+/* Longest basic block the translator builds before splitting it */
+#define TCACHE_MAX_BLOCK_LEN 64
+
+struct APEX_Op;
+
+/*
+ * Specialized closure for one instruction, operands are folded into it.
+ * Returns TRUE when the instruction accessed a word outside data memory.
+ */
+typedef int (*APEX_Op_Fn)(const struct APEX_Op *op);
+
+typedef struct APEX_Op
+{
+    APEX_Op_Fn fn;
+    /* Registers of the instruction; an operand it does not have points at
+     * R0 and is never read or written */
+    int *dst;
+    const int *src1;
+    const int *src2;
+    const int *src3;
+    int *zero_flag;
+    APEX_Memory *mem; /* Data memory */
+    APEX_CPU *cpu;   /* RDCNT and CLRCNT read the counters of the CPU */
+    int imm;
+    int offset;      /* Instruction of the op, counted from the block start */
+} APEX_Op;
+
+/* How control leaves a translated block */
+enum
+{
+    BLOCK_EXIT_FALLTHROUGH,
+    BLOCK_EXIT_BZ,
+    BLOCK_EXIT_BNZ,
+    BLOCK_EXIT_HALT
+};
+
+/* A translated basic block, its ops execute back to back */
+typedef struct APEX_Block
+{
+    int start;                 /* Code memory index of the first instruction */
+    int len;                   /* Instructions, including the exit instruction */
+    int exit_kind;             /* BLOCK_EXIT_* */
+    int fall_index;            /* Successor index when the branch is not taken */
+    int taken_index;           /* Successor index when the branch is taken */
+    struct APEX_Block *fall;   /* Chained successors, filled in on first use */
+    struct APEX_Block *taken;
+    long exec_count;           /* Times the whole block was executed */
+    int num_ops;
+    APEX_Op ops[];
+} APEX_Block;
+
+/* Translation cache of one CPU, indexed by code memory index */
+typedef struct APEX_TCache
+{
+    APEX_Block **blocks;
+    int size;
+    long lookups;              /* Block lookups by PC (chained exits excluded) */
+    long hits;                 /* Lookups that found a translated block */
+    long chained;              /* Block transitions that followed a chain link */
+    long translated;           /* Blocks built */
+    long executed;             /* Instructions of the run before the block */
+} APEX_TCache;
+
+long APEX_tcache_run(APEX_CPU *cpu, const long insn_count, int *halted);
+void APEX_tcache_invalidate(APEX_CPU *cpu);
+void APEX_tcache_print_stats(const APEX_CPU *cpu, FILE *fp);
+#endif
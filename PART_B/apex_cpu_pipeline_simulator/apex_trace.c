@@ -0,0 +1,593 @@
+/*
+ * apex_trace.c
+ * Contains the binary pipeline trace. The simulator appends one small record
+ * per stage per cycle to a large in-memory buffer instead of formatting text;
+ * the apex_trace tool reads the records back and prints them with the same
+ * functions the simulator uses for its text output.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_cpu.h"
+#include "apex_macros.h"
+#include "apex_trace.h"
+
+/* Longest encoding of one record (REGS, raw) */
+#define TRACE_MAX_RECORD (1 + 4 * REG_FILE_SIZE + 2)
+
+static const char *const stage_names[TRACE_NUM_STAGES] = {
+    "Writeback", "Memory", "Execute", "Decode/RF", "Fetch"
+};
+
+static const char *const stall_names[TRACE_NUM_STAGES] = {
+    "Writeback (stall)", "Memory (stall)", "Execute (stall)", "Decode (stall)",
+    "Fetch (stall)"
+};
+
+static const char *const empty_lines[TRACE_NUM_STAGES] = {
+    "Writeback : Empty\n", "Memory : Empty\n", "Execute : Empty\n",
+    "Decode :  Empty\n", "Fetch : Empty\n"
+};
+
+/*
+ * Writer
+ */
+static void
+trace_flush(APEX_Trace *trace)
+{
+    if (trace->len && fwrite(trace->buf, 1, trace->len, trace->fp) != trace->len)
+    {
+        trace->failed = TRUE;
+    }
+    trace->len = 0;
+}
+
+static void
+put_int32(APEX_Trace *trace, const int value)
+{
+    uint32_t v = value;
+
+    trace->buf[trace->len++] = v;
+    trace->buf[trace->len++] = v >> 8;
+    trace->buf[trace->len++] = v >> 16;
+    trace->buf[trace->len++] = v >> 24;
+}
+
+/* Zigzag varint: small magnitudes of either sign take one byte */
+static void
+put_varint(APEX_Trace *trace, const int value)
+{
+    uint32_t v = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+
+    while (v >= 0x80)
+    {
+        trace->buf[trace->len++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    trace->buf[trace->len++] = v;
+}
+
+/* Makes room for one more record */
+static void
+trace_reserve(APEX_Trace *trace)
+{
+    if (trace->len + TRACE_MAX_RECORD > TRACE_BUFFER_SIZE)
+    {
+        trace_flush(trace);
+    }
+}
+
+/*
+ * Creates filename and writes the header and the code image of cpu
+ *
+ * Returns NULL on failure
+ */
+APEX_Trace *
+APEX_trace_open(const char *filename, const APEX_CPU *cpu, const int delta)
+{
+    APEX_Trace_Header header;
+    APEX_Trace_Insn insn;
+    APEX_Trace *trace;
+    int i, ok = TRUE;
+
+    trace = calloc(1, sizeof(APEX_Trace));
+    if (!trace)
+    {
+        return NULL;
+    }
+
+    trace->buf = malloc(TRACE_BUFFER_SIZE);
+    trace->fp = fopen(filename, "wb");
+    if (!trace->buf || !trace->fp)
+    {
+        if (trace->fp)
+        {
+            fclose(trace->fp);
+        }
+        free(trace->buf);
+        free(trace);
+        return NULL;
+    }
+    trace->delta = delta;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.flags = delta ? TRACE_FLAG_DELTA : 0;
+    header.code_memory_size = cpu->code_memory_size;
+    ok &= fwrite(&header, sizeof(header), 1, trace->fp) == 1;
+
+    for (i = 0; i < cpu->code_memory_size; ++i)
+    {
+        memset(&insn, 0, sizeof(insn));
+        strncpy(insn.opcode_str, cpu->code_memory[i].opcode_str,
+                sizeof(insn.opcode_str) - 1);
+        insn.opcode = cpu->code_memory[i].opcode;
+        insn.rd = cpu->code_memory[i].rd;
+        insn.rs1 = cpu->code_memory[i].rs1;
+        insn.rs2 = cpu->code_memory[i].rs2;
+        insn.rs3 = cpu->code_memory[i].rs3;
+        insn.imm = cpu->code_memory[i].imm;
+        ok &= fwrite(&insn, sizeof(insn), 1, trace->fp) == 1;
+    }
+
+    trace->failed = !ok;
+    return trace;
+}
+
+/* Start of a clock cycle */
+void
+APEX_trace_cycle(APEX_Trace *trace, const int clock)
+{
+    trace_reserve(trace);
+    trace->buf[trace->len++] = TRACE_REC_CYCLE;
+    if (trace->delta)
+    {
+        put_varint(trace, clock - trace->last_clock);
+    }
+    else
+    {
+        put_int32(trace, clock);
+    }
+    trace->last_clock = clock;
+}
+
+/* What one stage did in the current cycle */
+void
+APEX_trace_stage(APEX_Trace *trace, const int stage, const int state,
+                 const int pc)
+{
+    trace_reserve(trace);
+    trace->buf[trace->len++] = TRACE_REC_STAGE | stage << 2 | state;
+    if (state == TRACE_STATE_EMPTY)
+    {
+        return;
+    }
+
+    if (trace->delta)
+    {
+        put_varint(trace, pc - trace->last_pc[stage]);
+    }
+    else
+    {
+        put_int32(trace, pc);
+    }
+    trace->last_pc[stage] = pc;
+}
+
+/* Register file at the end of the current cycle */
+void
+APEX_trace_regs(APEX_Trace *trace, const int *regs)
+{
+    unsigned int mask = 0;
+    int i;
+
+    trace_reserve(trace);
+    trace->buf[trace->len++] = TRACE_REC_REGS;
+
+    if (!trace->delta)
+    {
+        for (i = 0; i < REG_FILE_SIZE; ++i)
+        {
+            put_int32(trace, regs[i]);
+        }
+        return;
+    }
+
+    for (i = 0; i < REG_FILE_SIZE; ++i)
+    {
+        if (regs[i] != trace->last_regs[i])
+        {
+            mask |= 1u << i;
+        }
+    }
+    trace->buf[trace->len++] = mask;
+    trace->buf[trace->len++] = mask >> 8;
+
+    for (i = 0; i < REG_FILE_SIZE; ++i)
+    {
+        if (mask & (1u << i))
+        {
+            put_varint(trace, regs[i] - trace->last_regs[i]);
+            trace->last_regs[i] = regs[i];
+        }
+    }
+}
+
+/*
+ * Flushes and closes the trace
+ *
+ * Returns 0 on success, -1 if any write failed
+ */
+int
+APEX_trace_close(APEX_Trace *trace)
+{
+    int failed;
+
+    trace_flush(trace);
+    failed = trace->failed;
+    if (fclose(trace->fp) != 0)
+    {
+        failed = TRUE;
+    }
+    free(trace->buf);
+    free(trace);
+    return failed ? -1 : 0;
+}
+
+/*
+ * Reader
+ */
+static int
+get_int32(FILE *fp, int *value)
+{
+    unsigned char b[4];
+
+    if (fread(b, 1, 4, fp) != 4)
+    {
+        return FALSE;
+    }
+    *value = (int)((uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16
+                   | (uint32_t)b[3] << 24);
+    return TRUE;
+}
+
+static int
+get_varint(FILE *fp, int *value)
+{
+    uint32_t v = 0;
+    int shift, c;
+
+    for (shift = 0; shift < 35; shift += 7)
+    {
+        c = getc(fp);
+        if (c == EOF)
+        {
+            return FALSE;
+        }
+        v |= (uint32_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+        {
+            *value = (int)(v >> 1) ^ -(int)(v & 1);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Reads a field written by put_int32 or, for delta traces, put_varint */
+static int
+get_field(const APEX_Trace_Reader *reader, int *value, const int last)
+{
+    if (reader->delta)
+    {
+        if (!get_varint(reader->fp, value))
+        {
+            return FALSE;
+        }
+        *value += last;
+        return TRUE;
+    }
+    return get_int32(reader->fp, value);
+}
+
+/*
+ * Opens a trace and loads its code image
+ *
+ * Returns 0 on success, -1 if the file is missing or not a trace
+ */
+int
+APEX_trace_reader_open(APEX_Trace_Reader *reader, const char *filename)
+{
+    APEX_Trace_Header header;
+    APEX_Trace_Insn insn;
+    int i;
+
+    memset(reader, 0, sizeof(APEX_Trace_Reader));
+    reader->fp = fopen(filename, "rb");
+    if (!reader->fp)
+    {
+        return -1;
+    }
+
+    if (fread(&header, sizeof(header), 1, reader->fp) != 1
+        || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != TRACE_VERSION || header.code_memory_size < 0)
+    {
+        fclose(reader->fp);
+        return -1;
+    }
+
+    reader->delta = header.flags & TRACE_FLAG_DELTA;
+    reader->code_memory_size = header.code_memory_size;
+    reader->code_memory = calloc(header.code_memory_size + 1,
+                                 sizeof(APEX_Instruction));
+    if (!reader->code_memory)
+    {
+        fclose(reader->fp);
+        return -1;
+    }
+
+    for (i = 0; i < header.code_memory_size; ++i)
+    {
+        if (fread(&insn, sizeof(insn), 1, reader->fp) != 1)
+        {
+            APEX_trace_reader_close(reader);
+            return -1;
+        }
+        memcpy(reader->code_memory[i].opcode_str, insn.opcode_str,
+               sizeof(insn.opcode_str));
+        reader->code_memory[i].opcode_str[sizeof(insn.opcode_str) - 1] = '\0';
+        reader->code_memory[i].opcode = insn.opcode;
+        reader->code_memory[i].rd = insn.rd;
+        reader->code_memory[i].rs1 = insn.rs1;
+        reader->code_memory[i].rs2 = insn.rs2;
+        reader->code_memory[i].rs3 = insn.rs3;
+        reader->code_memory[i].imm = insn.imm;
+    }
+    return 0;
+}
+
+/*
+ * Decodes the next record
+ *
+ * Returns TRUE for a record, FALSE at the end of the trace (or a truncated
+ * last record)
+ */
+int
+APEX_trace_read(APEX_Trace_Reader *reader, APEX_Trace_Record *rec)
+{
+    unsigned char mask[2];
+    unsigned int bits;
+    int c, i;
+
+    c = getc(reader->fp);
+    if (c == EOF)
+    {
+        return FALSE;
+    }
+    rec->tag = c;
+
+    if (c & TRACE_REC_STAGE)
+    {
+        rec->stage = (c >> 2) & 0x7;
+        rec->state = c & 0x3;
+        if (rec->stage >= TRACE_NUM_STAGES)
+        {
+            return FALSE;
+        }
+        rec->tag = TRACE_REC_STAGE;
+        if (rec->state == TRACE_STATE_EMPTY)
+        {
+            return TRUE;
+        }
+        if (!get_field(reader, &rec->pc, reader->last_pc[rec->stage]))
+        {
+            return FALSE;
+        }
+        reader->last_pc[rec->stage] = rec->pc;
+        return TRUE;
+    }
+
+    if (c == TRACE_REC_CYCLE)
+    {
+        if (!get_field(reader, &rec->clock, reader->last_clock))
+        {
+            return FALSE;
+        }
+        reader->last_clock = rec->clock;
+        return TRUE;
+    }
+
+    if (c != TRACE_REC_REGS)
+    {
+        return FALSE;
+    }
+
+    if (!reader->delta)
+    {
+        for (i = 0; i < REG_FILE_SIZE; ++i)
+        {
+            if (!get_int32(reader->fp, &rec->regs[i]))
+            {
+                return FALSE;
+            }
+        }
+        return TRUE;
+    }
+
+    if (fread(mask, 1, 2, reader->fp) != 2)
+    {
+        return FALSE;
+    }
+    bits = mask[0] | mask[1] << 8;
+    for (i = 0; i < REG_FILE_SIZE; ++i)
+    {
+        if ((bits & (1u << i))
+            && !get_field(reader, &reader->last_regs[i], reader->last_regs[i]))
+        {
+            return FALSE;
+        }
+        rec->regs[i] = reader->last_regs[i];
+    }
+    return TRUE;
+}
+
+void
+APEX_trace_reader_close(APEX_Trace_Reader *reader)
+{
+    fclose(reader->fp);
+    free(reader->code_memory);
+}
+
+/*
+ * Text rendering, shared by the simulator and the apex_trace tool
+ */
+static void
+print_instruction(FILE *fp, const APEX_Instruction *ins)
+{
+    switch (ins->opcode)
+    {
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_AND:
+        case OPCODE_OR:
+        case OPCODE_XOR:
+        {
+            fprintf(fp, "%s,R%d,R%d,R%d ", ins->opcode_str, ins->rd, ins->rs1,
+                    ins->rs2);
+            break;
+        }
+
+        case OPCODE_MOVC:
+        case OPCODE_RDCNT:
+        {
+            fprintf(fp, "%s,R%d,#%d ", ins->opcode_str, ins->rd, ins->imm);
+            break;
+        }
+
+        case OPCODE_ADDL:
+        case OPCODE_SUBL:
+        {
+            fprintf(fp, "%s,R%d,R%d,#%d ", ins->opcode_str, ins->rd, ins->rs1,
+                    ins->imm);
+            break;
+        }
+
+        case OPCODE_LDR:
+        {
+            fprintf(fp, "%s,R%d,R%d,R%d ", ins->opcode_str, ins->rd, ins->rs1,
+                    ins->imm);
+            break;
+        }
+
+        case OPCODE_STR:
+        {
+            fprintf(fp, "%s,R%d,R%d,R%d ", ins->opcode_str, ins->rs1, ins->rs2,
+                    ins->rs3);
+            break;
+        }
+
+        case OPCODE_CMP:
+        {
+            fprintf(fp, "%s,R%d,R%d ", ins->opcode_str, ins->rs1, ins->rs2);
+            break;
+        }
+
+
+        case OPCODE_LOAD:
+        {
+            fprintf(fp, "%s,R%d,R%d,#%d ", ins->opcode_str, ins->rd, ins->rs1,
+                    ins->imm);
+            break;
+        }
+
+        case OPCODE_STORE:
+        {
+            fprintf(fp, "%s,R%d,R%d,#%d ", ins->opcode_str, ins->rs1, ins->rs2,
+                    ins->imm);
+            break;
+        }
+
+        case OPCODE_BZ:
+        case OPCODE_BNZ:
+        {
+            fprintf(fp, "%s,#%d ", ins->opcode_str, ins->imm);
+            break;
+        }
+
+        case OPCODE_HALT:
+        case OPCODE_CLRCNT:
+        {
+            fprintf(fp, "%s", ins->opcode_str);
+            break;
+        }
+    }
+}
+
+void
+APEX_trace_print_cycle(FILE *fp, const int clock)
+{
+    fprintf(fp, "--------------------------------------------\n");
+    fprintf(fp, "Clock Cycle #: %d\n", clock);
+    fprintf(fp, "--------------------------------------------\n");
+}
+
+/*
+ * Prints one stage of one cycle. ins is the instruction at pc (unused for
+ * TRACE_STATE_EMPTY). A NOP is announced before the line of the stage that
+ * works on it, except in fetch where it follows the line.
+ */
+void
+APEX_trace_print_stage(FILE *fp, const int stage, const int state,
+                       const int pc, const APEX_Instruction *ins)
+{
+    const int nop = state == TRACE_STATE_ACTIVE && ins->opcode == OPCODE_NOP;
+
+    if (state == TRACE_STATE_EMPTY)
+    {
+        fputs(empty_lines[stage], fp);
+        return;
+    }
+
+    if (nop && stage != TRACE_STAGE_FETCH)
+    {
+        fprintf(fp, "NOP");
+    }
+
+    fprintf(fp, "%-15s: pc(%d) ", state == TRACE_STATE_STALL
+                                      ? stall_names[stage] : stage_names[stage],
+            pc);
+    print_instruction(fp, ins);
+    fprintf(fp, "\n");
+
+    if (nop && stage == TRACE_STAGE_FETCH)
+    {
+        fprintf(fp, "NOP");
+    }
+}
+
+void
+APEX_trace_print_regs(FILE *fp, const int *regs)
+{
+    int i;
+
+    fprintf(fp, "----------\n%s\n----------\n", "Registers:");
+
+    for (i = 0; i < REG_FILE_SIZE / 2; ++i)
+    {
+        fprintf(fp, "R%-3d[%-3d] ", i, regs[i]);
+    }
+
+    fprintf(fp, "\n");
+
+    for (i = (REG_FILE_SIZE / 2); i < REG_FILE_SIZE; ++i)
+    {
+        fprintf(fp, "R%-3d[%-3d] ", i, regs[i]);
+    }
+
+    fprintf(fp, "\n");
+}
@@ -0,0 +1,131 @@
+/*
+ * apex_trace.h
+ * Contains the compact binary pipeline trace: record format, the buffered
+ * writer used by the simulator, the reader used by the apex_trace tool and
+ * the text rendering shared by both
+ */
+#ifndef _APEX_TRACE_H_
+#define _APEX_TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "apex_cpu.h"
+
+#define TRACE_MAGIC "APEXTRC"
+
+/* Bump whenever the layout of the file or of a record changes */
+#define TRACE_VERSION 1
+
+/* Header flags */
+#define TRACE_FLAG_DELTA 0x1 /* Records are delta/varint encoded */
+
+/* Bytes buffered by the writer before they go to the file */
+#define TRACE_BUFFER_SIZE (1 << 20)
+
+/* Pipeline stages, in the order they are evaluated (and printed) per cycle */
+#define TRACE_STAGE_WRITEBACK 0
+#define TRACE_STAGE_MEMORY 1
+#define TRACE_STAGE_EXECUTE 2
+#define TRACE_STAGE_DECODE 3
+#define TRACE_STAGE_FETCH 4
+#define TRACE_NUM_STAGES 5
+
+/* What a stage did in a cycle */
+#define TRACE_STATE_EMPTY 0
+#define TRACE_STATE_ACTIVE 1
+#define TRACE_STATE_STALL 2
+
+/*
+ * Record tags. A record is one tag byte followed by its fields, which are
+ * little endian int32 or, with TRACE_FLAG_DELTA, zigzag varints holding the
+ * difference to the previous value of the same field:
+ *   CYCLE  clock
+ *   STAGE  pc (not present for TRACE_STATE_EMPTY)
+ *   REGS   all registers, or with TRACE_FLAG_DELTA a uint16 mask of the
+ *          registers that changed followed by their deltas
+ * The stage and its state are packed into the STAGE tag.
+ */
+#define TRACE_REC_CYCLE 0x01
+#define TRACE_REC_REGS 0x02
+#define TRACE_REC_STAGE 0x80 /* | stage << 2 | state */
+
+/*
+ * File layout:
+ *   APEX_Trace_Header
+ *   code_memory_size x APEX_Trace_Insn
+ *   records
+ */
+typedef struct APEX_Trace_Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    int32_t code_memory_size;
+} APEX_Trace_Header;
+
+/* Instruction as needed to print it */
+typedef struct APEX_Trace_Insn
+{
+    char opcode_str[8];
+    int32_t opcode;
+    int32_t rd;
+    int32_t rs1;
+    int32_t rs2;
+    int32_t rs3;
+    int32_t imm;
+} APEX_Trace_Insn;
+
+/* Buffered trace writer of one cpu */
+typedef struct APEX_Trace
+{
+    FILE *fp;
+    unsigned char *buf;
+    size_t len;
+    int delta;
+    int failed;
+    int last_clock;
+    int last_pc[TRACE_NUM_STAGES];
+    int last_regs[REG_FILE_SIZE];
+} APEX_Trace;
+
+/* One decoded record */
+typedef struct APEX_Trace_Record
+{
+    int tag;
+    int clock;   /* CYCLE */
+    int stage;   /* STAGE */
+    int state;   /* STAGE */
+    int pc;      /* STAGE */
+    int regs[REG_FILE_SIZE]; /* REGS */
+} APEX_Trace_Record;
+
+/* Reader state of a whole trace file */
+typedef struct APEX_Trace_Reader
+{
+    FILE *fp;
+    int delta;
+    int code_memory_size;
+    APEX_Instruction *code_memory;
+    int last_clock;
+    int last_pc[TRACE_NUM_STAGES];
+    int last_regs[REG_FILE_SIZE];
+} APEX_Trace_Reader;
+
+APEX_Trace *APEX_trace_open(const char *filename, const APEX_CPU *cpu,
+                            const int delta);
+void APEX_trace_cycle(APEX_Trace *trace, const int clock);
+void APEX_trace_stage(APEX_Trace *trace, const int stage, const int state,
+                      const int pc);
+void APEX_trace_regs(APEX_Trace *trace, const int *regs);
+int APEX_trace_close(APEX_Trace *trace);
+
+int APEX_trace_reader_open(APEX_Trace_Reader *reader, const char *filename);
+int APEX_trace_read(APEX_Trace_Reader *reader, APEX_Trace_Record *rec);
+void APEX_trace_reader_close(APEX_Trace_Reader *reader);
+
+void APEX_trace_print_cycle(FILE *fp, const int clock);
+void APEX_trace_print_stage(FILE *fp, const int stage, const int state,
+                            const int pc, const APEX_Instruction *ins);
+void APEX_trace_print_regs(FILE *fp, const int *regs);
+#endif
@@ -0,0 +1,229 @@
+/*
+ * apex_trace_main.c
+ * Main function of the apex_trace tool, which prints a binary pipeline
+ * trace written by apex_sim --trace in the simulator's text format,
+ * optionally limited to a range of PCs and/or clock cycles
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_cpu.h"
+#include "apex_macros.h"
+#include "apex_trace.h"
+
+/*
+ * Stage records of one cycle, collected before it is printed. The
+ * superscalar core writes a record per instruction of a stage, so a cycle
+ * can have any number of them.
+ */
+typedef struct Trace_Cycle
+{
+    int clock;
+    int num_stages;
+    int max_stages;            /* Records stages has room for */
+    APEX_Trace_Record *stages;
+    int has_regs;
+    int regs[REG_FILE_SIZE];
+} Trace_Cycle;
+
+typedef struct Trace_Filter
+{
+    int pc_lo, pc_hi;
+    int clock_lo, clock_hi;
+    int by_pc;
+} Trace_Filter;
+
+static void
+print_usage(const char *prog)
+{
+    fprintf(stderr,
+            "APEX_Help: Usage %s <trace_file> [--pc <lo>[:<hi>]] "
+            "[--cycles <lo>[:<hi>]]\n", prog);
+}
+
+/* Parses "lo" or "lo:hi", hi defaults to lo */
+static int
+parse_range(const char *arg, int *lo, int *hi)
+{
+    char *end;
+
+    *lo = strtol(arg, &end, 10);
+    if (end == arg)
+    {
+        return FALSE;
+    }
+    *hi = *lo;
+    if (*end == ':')
+    {
+        arg = end + 1;
+        *hi = strtol(arg, &end, 10);
+        if (end == arg)
+        {
+            return FALSE;
+        }
+    }
+    return *end == '\0' && *lo <= *hi;
+}
+
+static const APEX_Instruction *
+instruction_at(const APEX_Trace_Reader *reader, const int pc)
+{
+    static const APEX_Instruction unknown = { "???", -1, 0, 0, 0, 0, 0 };
+    int index = (pc - 4000) / 4;
+
+    if (pc < 4000 || index >= reader->code_memory_size)
+    {
+        return &unknown;
+    }
+    return &reader->code_memory[index];
+}
+
+static void
+print_cycle(const APEX_Trace_Reader *reader, const Trace_Cycle *cycle,
+            const Trace_Filter *filter)
+{
+    const APEX_Trace_Record *rec;
+    int i, header = FALSE;
+
+    if (cycle->clock < filter->clock_lo || cycle->clock > filter->clock_hi)
+    {
+        return;
+    }
+
+    for (i = 0; i < cycle->num_stages; ++i)
+    {
+        rec = &cycle->stages[i];
+        if (filter->by_pc && (rec->state == TRACE_STATE_EMPTY
+                              || rec->pc < filter->pc_lo
+                              || rec->pc > filter->pc_hi))
+        {
+            continue;
+        }
+
+        if (!header)
+        {
+            APEX_trace_print_cycle(stdout, cycle->clock);
+            header = TRUE;
+        }
+        APEX_trace_print_stage(stdout, rec->stage, rec->state, rec->pc,
+                               instruction_at(reader, rec->pc));
+    }
+
+    /* The register file only goes with complete cycles */
+    if (!filter->by_pc && cycle->has_regs)
+    {
+        if (!header)
+        {
+            APEX_trace_print_cycle(stdout, cycle->clock);
+        }
+        APEX_trace_print_regs(stdout, cycle->regs);
+    }
+}
+
+/* Appends a stage record to the cycle, growing it as needed */
+static int
+add_stage(Trace_Cycle *cycle, const APEX_Trace_Record *rec)
+{
+    APEX_Trace_Record *stages;
+    int max;
+
+    if (cycle->num_stages == cycle->max_stages)
+    {
+        max = cycle->max_stages ? 2 * cycle->max_stages : 4 * TRACE_NUM_STAGES;
+        stages = realloc(cycle->stages, max * sizeof(APEX_Trace_Record));
+        if (!stages)
+        {
+            return FALSE;
+        }
+        cycle->stages = stages;
+        cycle->max_stages = max;
+    }
+    cycle->stages[cycle->num_stages++] = *rec;
+    return TRUE;
+}
+
+int
+main(int argc, char const *argv[])
+{
+    APEX_Trace_Reader reader;
+    APEX_Trace_Record rec;
+    Trace_Cycle cycle;
+    Trace_Filter filter = { INT_MIN, INT_MAX, INT_MIN, INT_MAX, FALSE };
+    int i, started = FALSE;
+
+    if (argc < 2)
+    {
+        print_usage(argv[0]);
+        exit(1);
+    }
+
+    for (i = 2; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--pc") == 0 && i + 1 < argc
+            && parse_range(argv[i + 1], &filter.pc_lo, &filter.pc_hi))
+        {
+            filter.by_pc = TRUE;
+            i++;
+        }
+        else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc
+                 && parse_range(argv[i + 1], &filter.clock_lo,
+                                &filter.clock_hi))
+        {
+            i++;
+        }
+        else
+        {
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (APEX_trace_reader_open(&reader, argv[1]) != 0)
+    {
+        fprintf(stderr, "APEX_Error: %s is not an APEX pipeline trace\n",
+                argv[1]);
+        exit(1);
+    }
+
+    memset(&cycle, 0, sizeof(cycle));
+    while (APEX_trace_read(&reader, &rec))
+    {
+        if (rec.tag == TRACE_REC_CYCLE)
+        {
+            if (started)
+            {
+                print_cycle(&reader, &cycle, &filter);
+            }
+            cycle.clock = rec.clock;
+            cycle.num_stages = 0;
+            cycle.has_regs = FALSE;
+            started = TRUE;
+        }
+        else if (rec.tag == TRACE_REC_STAGE)
+        {
+            if (!add_stage(&cycle, &rec))
+            {
+                fprintf(stderr, "APEX_Error: Out of memory\n");
+                free(cycle.stages);
+                APEX_trace_reader_close(&reader);
+                exit(1);
+            }
+        }
+        else if (rec.tag == TRACE_REC_REGS)
+        {
+            memcpy(cycle.regs, rec.regs, sizeof(cycle.regs));
+            cycle.has_regs = TRUE;
+        }
+    }
+
+    if (started)
+    {
+        print_cycle(&reader, &cycle, &filter);
+    }
+
+    free(cycle.stages);
+    APEX_trace_reader_close(&reader);
+    return 0;
+}
@@ -7,7 +7,6 @@
  * Copyright (c) 2020, Gaurav Kothari (gkothar1@binghamton.edu)
  * State University of New York at Binghamton
  */
-#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,7 +25,9 @@ get_num_from_string(const char *buffer)
     char str[16];
     int i, j = 0;
 
-    for (i = 1; buffer[i] != '\0'; ++i)
+    /* Skip the 'R' or '#' prefix, a bare number has none */
+    i = (buffer[0] == '-' || (buffer[0] >= '0' && buffer[0] <= '9')) ? 0 : 1;
+    for (; buffer[i] != '\0' && j < (int)sizeof(str) - 1; ++i)
     {
         str[j] = buffer[i];
         j++;
@@ -141,22 +142,46 @@ set_opcode_str(const char *opcode_str)
         return OPCODE_NOP;
     }
 
-    assert(0 && "Invalid opcode");
-    return 0;
+    if (strcmp(opcode_str,"RDCNT") == 0)
+    {
+        return OPCODE_RDCNT;
+    }
+
+    if (strcmp(opcode_str,"CLRCNT") == 0)
+    {
+        return OPCODE_CLRCNT;
+    }
+
+    /* Invalid opcode */
+    return -1;
 }
 
+/*
+ * Splits the line into the opcode and its operand list. Blanks inside the
+ * operand list ("MOVC R2, 4") are dropped. Uses strtok_r so that several
+ * threads can parse programs at the same time.
+ */
 static void
 split_opcode_from_insn_string(char *buffer, char tokens[2][128])
 {
     int token_num = 0;
+    char *saveptr;
 
-    char *token = strtok(buffer, " ");
+    char *token = strtok_r(buffer, " \t\r\n", &saveptr);
 
     while (token != NULL)
     {
-        strcpy(tokens[token_num], token);
-        token_num++;
-        token = strtok(NULL, " ");
+        if (token_num < 2)
+        {
+            strncpy(tokens[token_num], token, 127);
+            tokens[token_num][127] = '\0';
+            token_num++;
+        }
+        else
+        {
+            strncat(tokens[1], token, 127 - strlen(tokens[1]));
+        }
+        token = strtok_r(NULL, " \t\r\n", &saveptr);
     }
 }
 
@@ -164,32 +189,45 @@ split_opcode_from_insn_string(char *buffer, char tokens[2][128])
  * This function is related to parsing input file
  *
  * Note : you can edit this function to add new instructions
+ *
+ * Returns 0 on success, -1 for an unknown opcode, register or counter
  */
-static void
+static int
 create_APEX_instruction(APEX_Instruction *ins, char *buffer)
 {
     int i, token_num = 0;
     char tokens[6][128];
     char top_level_tokens[2][128];
+    char *saveptr;
 
     for (i = 0; i < 2; ++i)
     {
         strcpy(top_level_tokens[i], "");
     }
 
+    /* Missing operands parse as 0 */
+    for (i = 0; i < 6; ++i)
+    {
+        strcpy(tokens[i], "");
+    }
+
     split_opcode_from_insn_string(buffer, top_level_tokens);
 
-    char *token = strtok(top_level_tokens[1], ",");
+    char *token = strtok_r(top_level_tokens[1], ",", &saveptr);
 
-    while (token != NULL)
+    while (token != NULL && token_num < 6)
     {
         strcpy(tokens[token_num], token);
         token_num++;
-        token = strtok(NULL, ",");
+        token = strtok_r(NULL, ",", &saveptr);
     }
 
     strcpy(ins->opcode_str, top_level_tokens[0]);
     ins->opcode = set_opcode_str(ins->opcode_str);
+    if (ins->opcode < 0)
+    {
+        return -1;
+    }
 
     switch (ins->opcode)
     {
@@ -273,8 +311,20 @@ create_APEX_instruction(APEX_Instruction *ins, char *buffer)
             break;
         }
 
+        case OPCODE_RDCNT:
+        {
+            ins->rd = get_num_from_string(tokens[0]);
+            ins->imm = get_num_from_string(tokens[1]);
+            if (ins->imm < 0 || ins->imm >= NUM_COUNTERS)
+            {
+                return -1;
+            }
+            break;
+        }
+
         case OPCODE_HALT:
         case OPCODE_NOP:
+        case OPCODE_CLRCNT:
         {
             break;
         }
@@ -282,15 +332,75 @@ create_APEX_instruction(APEX_Instruction *ins, char *buffer)
 
     }
     /* Fill in rest of the instructions accordingly */
+
+    if (ins->rd < 0 || ins->rd >= REG_FILE_SIZE
+        || ins->rs1 < 0 || ins->rs1 >= REG_FILE_SIZE
+        || ins->rs2 < 0 || ins->rs2 >= REG_FILE_SIZE
+        || ins->rs3 < 0 || ins->rs3 >= REG_FILE_SIZE)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Registers the instruction reads, one bit each, for the scoreboard */
+static unsigned int
+source_mask(const APEX_Instruction *ins)
+{
+    switch (ins->opcode)
+    {
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_AND:
+        case OPCODE_OR:
+        case OPCODE_XOR:
+        case OPCODE_LDR:
+        case OPCODE_STORE:
+        case OPCODE_CMP:
+            return 1u << ins->rs1 | 1u << ins->rs2;
+
+        case OPCODE_ADDL:
+        case OPCODE_SUBL:
+        case OPCODE_LOAD:
+            return 1u << ins->rs1;
+
+        case OPCODE_STR:
+            return 1u << ins->rs1 | 1u << ins->rs2 | 1u << ins->rs3;
+
+        case OPCODE_BZ:
+        case OPCODE_BNZ:
+            return 1u << SCOREBOARD_FLAG;
+    }
+    return 0;
+}
+
+/*
+ * Builds the compact pre-decoded record of an instruction: operand indices,
+ * immediate, source registers and the stage handlers bound to its opcode
+ */
+static void
+predecode_APEX_instruction(APEX_Decoded *dec, const APEX_Instruction *ins)
+{
+    dec->handler = APEX_opcode_handlers[ins->opcode];
+    dec->imm = ins->imm;
+    dec->src_mask = source_mask(ins);
+    dec->opcode = ins->opcode;
+    dec->rd = ins->rd;
+    dec->rs1 = ins->rs1;
+    dec->rs2 = ins->rs2;
+    dec->rs3 = ins->rs3;
 }
 
 /*
  * This function is related to parsing input file
  *
- * Note : You are not supposed to edit this function
+ * Also builds the pre-decoded table (*decoded) used by the pipeline stages,
+ * one entry per instruction of code memory
  */
 APEX_Instruction *
-create_code_memory(const char *filename, int *size)
+create_code_memory(const char *filename, int *size, APEX_Decoded **decoded)
 {
     FILE *fp;
     ssize_t nread;
@@ -329,10 +439,30 @@ create_code_memory(const char *filename, int *size)
         return NULL;
     }
 
+    *decoded = calloc(code_memory_size, sizeof(APEX_Decoded));
+    if (!*decoded)
+    {
+        free(code_memory);
+        fclose(fp);
+        return NULL;
+    }
+
     rewind(fp);
     while ((nread = getline(&line, &len, fp)) != -1)
     {
-        create_APEX_instruction(&code_memory[current_instruction], line);
+        if (create_APEX_instruction(&code_memory[current_instruction], line) != 0)
+        {
+            fprintf(stderr, "APEX_Error: %s:%d: invalid instruction\n",
+                    filename, current_instruction + 1);
+            free(*decoded);
+            *decoded = NULL;
+            free(code_memory);
+            free(line);
+            fclose(fp);
+            return NULL;
+        }
+        predecode_APEX_instruction(&(*decoded)[current_instruction],
+                                   &code_memory[current_instruction]);
         current_instruction++;
     }
 
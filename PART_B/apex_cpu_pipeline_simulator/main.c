@@ -6,36 +6,594 @@
  * State University of New York at Binghamton
  */
 #include <stdio.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include "apex_batch.h"
+#include "apex_checkpoint.h"
 #include "apex_cpu.h"
+#include "apex_func.h"
+#include "apex_sample.h"
+#include "apex_sweep.h"
+#include "apex_tcache.h"
+#include "apex_trace.h"
+
+static void
+print_usage(const char *prog)
+{
+    fprintf(stderr,
+            "APEX_Help: Usage %s <input_file> <display|simulate> <cycles> "
+            "[--skip <instructions>] [--functional] [--tcache]\n"
+            "           [--sample-period <instructions> "
+            "[--sample-window <instructions>] [--sample-warmup <instructions>]]\n"
+            "           [--load-checkpoint <file>] [--save-checkpoint <file>]\n"
+            "           [--forwarding <0|1>] [--branch-penalty <n>] "
+            "[--mem-latency <n>]\n"
+            "           [--alu-latency <n>] [--mul-latency <n>] "
+            "[--div-latency <n>] [--agu-latency <n>]\n"
+            "           [--alu-interval <n>] [--mul-interval <n>] "
+            "[--div-interval <n>] [--agu-interval <n>]\n"
+            "           [--dcache-size <bytes> [--dcache-ways <n>] "
+            "[--dcache-line <bytes>]\n"
+            "            [--dcache-policy <lru|plru|random>] "
+            "[--dcache-write <back|through>]\n"
+            "            [--dcache-hit-latency <n>] "
+            "[--dcache-miss-latency <n>]\n"
+            "            [--dcache-prefetch <none|next-line|stride|stream>]\n"
+            "            [--dcache-prefetch-degree <n>] "
+            "[--dcache-prefetch-distance <n>]]\n"
+            "           [--icache-size <bytes> [--icache-ways <n>] "
+            "[--icache-line <bytes>]\n"
+            "            [--icache-policy <lru|plru|random>] "
+            "[--icache-hit-latency <n>] "
+            "[--icache-miss-latency <n>]\n"
+            "            [--icache-prefetch <none|next-line|stride|stream>]\n"
+            "            [--icache-prefetch-degree <n>] "
+            "[--icache-prefetch-distance <n>]]\n"
+            "           [--bpred <none|bimodal|gshare|tage> [--bpred-size <n>] "
+            "[--bpred-history <bits>]\n"
+            "            [--btb-size <n>]]\n"
+            "           [--ooo <0|1>] [--width <n>] [--mem-ports <n>] "
+            "[--branch-ports <n>]\n"
+            "            [--rob-size <n>] [--iq-size <n>] [--phys-regs <n>] "
+            "[--lsq-size <n>]\n"
+            "            [--lsq-policy <commit|resolved|speculate>]\n"
+            "           [--trace <file> [--trace-delta]] "
+            "[--log <quiet|summary|stage|full>]\n"
+            "           [--data-memory <words>] [--data-file <file>]\n"
+            "       %s --batch <list_file> <cycles> [--threads <N>] "
+            "[--report <file.json|file.csv>] [--batch-logs <dir>]\n"
+            "       %s --sweep <input_file> <cycles> [--threads <N>] "
+            "[--report <file.csv>]\n"
+            "           [timing options above, each taking a comma separated "
+            "list of values]\n",
+            prog, prog, prog);
+}
+
+/* Host wall clock time in seconds, used to report simulation speed */
+static double
+host_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Maps a --log argument to APEX_LOG_*, -1 if unknown */
+static int
+parse_log_level(const char *name)
+{
+    if (strcmp(name, "quiet") == 0)
+    {
+        return APEX_LOG_QUIET;
+    }
+    else if (strcmp(name, "summary") == 0)
+    {
+        return APEX_LOG_SUMMARY;
+    }
+    else if (strcmp(name, "stage") == 0)
+    {
+        return APEX_LOG_STAGE;
+    }
+    else if (strcmp(name, "full") == 0)
+    {
+        return APEX_LOG_FULL;
+    }
+    return -1;
+}
+
+/*
+ * Runs the functional engine (threaded interpreter, or the translation cache
+ * when use_tcache is set) and reports its speed in host MIPS
+ */
+static long
+run_functional(APEX_CPU *cpu, const long insn_count, int *halted,
+               const int use_tcache)
+{
+    double start, elapsed;
+    long executed;
+
+    start = host_seconds();
+    if (use_tcache)
+    {
+        executed = APEX_tcache_run(cpu, insn_count, halted);
+    }
+    else
+    {
+        executed = APEX_func_run(cpu, insn_count, halted);
+    }
+    elapsed = host_seconds() - start;
+
+    fprintf(stderr, "APEX_CPU: Functional engine executed %ld instructions "
+            "in %.6f s (%.2f MIPS)\n", executed, elapsed,
+            elapsed > 0 ? executed / elapsed / 1e6 : 0.0);
+    return executed;
+}
+
+/*
+ * Simulates every program of a list file in parallel and writes one report.
+ * argv[1] is "--batch".
+ */
+static int
+run_batch(int argc, char const *argv[])
+{
+    APEX_Batch_Config cfg = { 0, 0, NULL };
+    APEX_Batch_Job *jobs;
+    const char *report = NULL;
+    FILE *fp = stdout;
+    double start;
+    size_t len;
+    int num_jobs, threads, i;
+
+    if (argc < 4)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+    cfg.cycles = atoi(argv[3]);
+
+    for (i = 4; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            cfg.threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc)
+        {
+            report = argv[++i];
+        }
+        else if (strcmp(argv[i], "--batch-logs") == 0 && i + 1 < argc)
+        {
+            cfg.log_dir = argv[++i];
+        }
+        else
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    jobs = APEX_batch_read_list(argv[2], &num_jobs);
+    if (!jobs)
+    {
+        fprintf(stderr, "APEX_Error: Unable to read program list %s\n",
+                argv[2]);
+        return 1;
+    }
+
+    start = host_seconds();
+    threads = APEX_batch_run(jobs, num_jobs, &cfg);
+    if (threads < 0)
+    {
+        fprintf(stderr, "APEX_Error: Unable to start batch workers\n");
+        APEX_batch_free(jobs, num_jobs);
+        return 1;
+    }
+    fprintf(stderr, "APEX_CPU: Batch of %d programs finished on %d threads "
+            "in %.3f s\n", num_jobs, threads, host_seconds() - start);
+
+    if (report)
+    {
+        fp = fopen(report, "w");
+        if (!fp)
+        {
+            fprintf(stderr, "APEX_Error: Unable to write report %s\n", report);
+            APEX_batch_free(jobs, num_jobs);
+            return 1;
+        }
+    }
+
+    len = report ? strlen(report) : 0;
+    APEX_batch_report(jobs, num_jobs, fp,
+                      len > 4 && strcmp(report + len - 4, ".csv") == 0);
+    if (report)
+    {
+        fclose(fp);
+    }
+
+    APEX_batch_free(jobs, num_jobs);
+    return 0;
+}
+
+/*
+ * Simulates one program under every configuration of a grid of timing
+ * parameters and prints the CPI of each. argv[1] is "--sweep".
+ */
+static int
+run_sweep(int argc, char const *argv[])
+{
+    APEX_Batch_Config cfg = { 0, 0, NULL };
+    APEX_Batch_Job *jobs;
+    APEX_Sweep_Grid grid;
+    const char *report = NULL;
+    FILE *fp;
+    double start;
+    int num_jobs, threads, i, j, parsed;
+
+    if (argc < 4)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+    cfg.cycles = atoi(argv[3]);
+    APEX_sweep_grid_init(&grid);
+
+    for (i = 4; i < argc; ++i)
+    {
+        parsed = APEX_sweep_parse_option(&grid, argc, argv, &i);
+        if (parsed == TRUE)
+        {
+            continue;
+        }
+
+        if (parsed < 0)
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            cfg.threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc)
+        {
+            report = argv[++i];
+        }
+        else
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    num_jobs = APEX_sweep_grid_size(&grid);
+    if (num_jobs < 0)
+    {
+        fprintf(stderr, "APEX_Error: Sweep has more than %d configurations\n",
+                SWEEP_MAX_CONFIGS);
+        return 1;
+    }
+
+    /* The program is parsed once and shared by all runs */
+    cfg.code_memory = create_code_memory(argv[2], &cfg.code_memory_size,
+                                         &cfg.decoded);
+    if (!cfg.code_memory)
+    {
+        fprintf(stderr, "APEX_Error: Unable to load %s\n", argv[2]);
+        return 1;
+    }
+
+    jobs = calloc(num_jobs, sizeof(APEX_Batch_Job));
+    if (!jobs)
+    {
+        free(cfg.code_memory);
+        free(cfg.decoded);
+        return 1;
+    }
+
+    for (j = 0; j < num_jobs; ++j)
+    {
+        jobs[j].filename = strdup(argv[2]);
+        APEX_sweep_config_at(&grid, j, &jobs[j].config);
+    }
+
+    start = host_seconds();
+    threads = APEX_batch_run(jobs, num_jobs, &cfg);
+    if (threads < 0)
+    {
+        fprintf(stderr, "APEX_Error: Unable to start sweep workers\n");
+    }
+    else
+    {
+        fprintf(stderr, "APEX_CPU: Sweep of %d configurations finished on %d "
+                "threads in %.3f s\n", num_jobs, threads,
+                host_seconds() - start);
+
+        APEX_sweep_report(&grid, jobs, num_jobs, stdout, FALSE);
+        if (report)
+        {
+            fp = fopen(report, "w");
+            if (fp)
+            {
+                APEX_sweep_report(&grid, jobs, num_jobs, fp, TRUE);
+                fclose(fp);
+            }
+            else
+            {
+                fprintf(stderr, "APEX_Error: Unable to write report %s\n",
+                        report);
+            }
+        }
+    }
+
+    APEX_batch_free(jobs, num_jobs);
+    free(cfg.code_memory);
+    free(cfg.decoded);
+    return threads < 0;
+}
 
 int
 main(int argc, char const *argv[])
 {
     APEX_CPU *cpu;
+    long skip_insns = 0;
+    int functional_only = FALSE;
+    int use_tcache = FALSE;
+    const char *load_checkpoint = NULL;
+    const char *save_checkpoint = NULL;
+    const char *trace_file = NULL;
+    int trace_delta = FALSE;
+    int log_level = APEX_LOG_FULL;
+    long data_memory_words = DATA_MEMORY_SIZE;
+    const char *data_file = NULL;
+    double start;
+    APEX_Sample_Config sample_cfg = { 0, 1000, 100, FALSE };
+    APEX_Sample_Result sample_result;
+    APEX_Sweep_Grid timing;
+    APEX_Pipeline_Config config;
+    int halted = FALSE;
+    int i, parsed;
 
     fprintf(stderr, "APEX CPU Pipeline Simulator v%0.1lf\n", VERSION);
 
-    if (argc != 4)
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0)
+    {
+        return run_batch(argc, argv);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--sweep") == 0)
+    {
+        return run_sweep(argc, argv);
+    }
+
+    if (argc < 4)
+    {
+        print_usage(argv[0]);
+        exit(1);
+    }
+
+    APEX_sweep_grid_init(&timing);
+
+    for (i = 4; i < argc; ++i)
+    {
+        parsed = APEX_sweep_parse_option(&timing, argc, argv, &i);
+        if (parsed == TRUE)
+        {
+            continue;
+        }
+
+        if (parsed < 0)
+        {
+            print_usage(argv[0]);
+            exit(1);
+        }
+
+        if (strcmp(argv[i], "--skip") == 0 && i + 1 < argc)
+        {
+            skip_insns = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--functional") == 0)
+        {
+            functional_only = TRUE;
+        }
+        else if (strcmp(argv[i], "--tcache") == 0)
+        {
+            use_tcache = TRUE;
+        }
+        else if (strcmp(argv[i], "--sample-period") == 0 && i + 1 < argc)
+        {
+            sample_cfg.period = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--sample-window") == 0 && i + 1 < argc)
+        {
+            sample_cfg.window = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--sample-warmup") == 0 && i + 1 < argc)
+        {
+            sample_cfg.warmup = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--load-checkpoint") == 0 && i + 1 < argc)
+        {
+            load_checkpoint = argv[++i];
+        }
+        else if (strcmp(argv[i], "--save-checkpoint") == 0 && i + 1 < argc)
+        {
+            save_checkpoint = argv[++i];
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            trace_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--trace-delta") == 0)
+        {
+            trace_delta = TRUE;
+        }
+        else if (strcmp(argv[i], "--data-memory") == 0 && i + 1 < argc)
+        {
+            data_memory_words = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--data-file") == 0 && i + 1 < argc)
+        {
+            data_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc
+                 && (log_level = parse_log_level(argv[i + 1])) >= 0)
+        {
+            i++;
+        }
+        else
+        {
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    /* A single run takes one value per timing option, lists are for --sweep */
+    if (APEX_sweep_grid_size(&timing) != 1 || data_memory_words <= 0
+        || data_memory_words > MEMORY_MAX_WORDS)
     {
-        fprintf(stderr, "APEX_Help: Usage %s <input_file>\n", argv[0]);
+        print_usage(argv[0]);
         exit(1);
     }
 
-    //if(strcmp(argv[2],"display") == 0)
-    //{
-    //    printf("Display \n");
-    //}
-    
-    cpu = APEX_cpu_init(argv[1],argv[2]);
+    cpu = APEX_cpu_init_with_output(argv[1], argv[2], stdout, stderr,
+                                    log_level);
     if (!cpu)
     {
         fprintf(stderr, "APEX_Error: Unable to initialize CPU\n");
         exit(1);
     }
+    APEX_sweep_config_at(&timing, 0, &config);
+    if (APEX_cpu_configure(cpu, &config) != 0)
+    {
+        fprintf(stderr, "APEX_Error: Invalid cache geometry, branch "
+                "predictor or superscalar core\n");
+        exit(1);
+    }
+
+    if ((data_memory_words != DATA_MEMORY_SIZE || data_file)
+        && APEX_cpu_set_data_memory(cpu, data_memory_words, data_file) != 0)
+    {
+        fprintf(stderr, "APEX_Error: Unable to set up %ld words of data "
+                "memory%s%s\n", data_memory_words,
+                data_file ? " from " : "", data_file ? data_file : "");
+        exit(1);
+    }
+
+    if (trace_file)
+    {
+        /* Stage records go to the file instead of stdout */
+        cpu->trace = APEX_trace_open(trace_file, cpu, trace_delta);
+        if (!cpu->trace)
+        {
+            fprintf(stderr, "APEX_Error: Unable to create trace %s\n",
+                    trace_file);
+            exit(1);
+        }
+    }
+
+    if (load_checkpoint)
+    {
+        if (APEX_checkpoint_load(cpu, load_checkpoint) != 0)
+        {
+            fprintf(stderr, "APEX_Error: Unable to restore checkpoint %s "
+                    "(missing, corrupt, or taken with another program)\n",
+                    load_checkpoint);
+            exit(1);
+        }
+        fprintf(stderr, "APEX_CPU: Restored checkpoint %s, PC = %d\n",
+                load_checkpoint, cpu->pc);
+    }
+
+    if (sample_cfg.period > 0)
+    {
+        if (sample_cfg.window <= 0 || sample_cfg.warmup < 0)
+        {
+            print_usage(argv[0]);
+            exit(1);
+        }
 
+        /* Functional warming with short detailed windows */
+        sample_cfg.use_tcache = use_tcache;
+        APEX_sample_run(cpu, &sample_cfg, &sample_result);
+        APEX_sample_print(&sample_result, stdout);
+        APEX_cpu_print_arch_state(cpu);
+        APEX_cpu_stop(cpu);
+        return 0;
+    }
+
+    if (functional_only)
+    {
+        /* Whole program in the functional engine, no pipeline timing */
+        run_functional(cpu, LONG_MAX, &halted, use_tcache);
+        if (cpu->data_memory.fault)
+        {
+            APEX_cpu_report_fault(cpu);
+        }
+        printf("APEX_CPU: Functional Simulation %s, instructions = %ld\n",
+               cpu->data_memory.fault ? "Stopped" : "Complete",
+               cpu->insn_fast_forwarded);
+        APEX_cpu_print_arch_state(cpu);
+        APEX_tcache_print_stats(cpu, stdout);
+        APEX_cpu_stop(cpu);
+        return 0;
+    }
+
+    if (skip_insns > 0)
+    {
+        /* Fast-forward functionally, then continue in the detailed pipeline */
+        run_functional(cpu, skip_insns, &halted, use_tcache);
+        fprintf(stderr, "APEX_CPU: Fast-forwarded %ld instructions, PC = %d\n",
+                cpu->insn_fast_forwarded, cpu->pc);
+        APEX_tcache_print_stats(cpu, stderr);
+
+        if (cpu->data_memory.fault)
+        {
+            APEX_cpu_report_fault(cpu);
+            printf("APEX_CPU: Simulation Stopped during fast-forward, "
+                   "instructions = %ld\n", cpu->insn_fast_forwarded);
+            APEX_cpu_print_arch_state(cpu);
+            APEX_cpu_stop(cpu);
+            return 0;
+        }
+
+        if (halted)
+        {
+            printf("APEX_CPU: Simulation Complete during fast-forward, "
+                   "instructions = %ld\n", cpu->insn_fast_forwarded);
+            APEX_cpu_print_arch_state(cpu);
+            APEX_cpu_stop(cpu);
+            return 0;
+        }
+
+        APEX_func_handoff(cpu);
+    }
+
+    if (save_checkpoint)
+    {
+        /* Snapshot of the state the detailed run starts from */
+        if (APEX_checkpoint_save(cpu, save_checkpoint) != 0)
+        {
+            fprintf(stderr, "APEX_Error: Unable to write checkpoint %s\n",
+                    save_checkpoint);
+            exit(1);
+        }
+        fprintf(stderr, "APEX_CPU: Saved checkpoint %s, PC = %d\n",
+                save_checkpoint, cpu->pc);
+    }
+
+    start = host_seconds();
     APEX_cpu_run(cpu,atoi(argv[3]));
+    if (log_level < APEX_LOG_STAGE)
+    {
+        /* Without per-cycle output this is the raw speed of the pipeline */
+        fprintf(stderr, "APEX_CPU: Simulated %d cycles in %.6f s "
+                "(%.2f M cycles/s)\n", cpu->clock, host_seconds() - start,
+                cpu->clock / (host_seconds() - start) / 1e6);
+    }
     APEX_cpu_stop(cpu);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,4 @@
+MOVC R1,#5
+MOVC R2,#5000
+LOAD R1,R2,#0
+HALT
@@ -0,0 +1,3 @@
+MOVC R1,#1
+MOVC R2,#2
+ADD R3,R1,R2
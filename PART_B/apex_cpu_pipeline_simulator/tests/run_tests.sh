@@ -0,0 +1,113 @@
+#!/bin/sh
+#
+# run_tests.sh
+# Regression checks of apex_sim, run from the project directory by
+# "make check". Prints one line per check and exits non-zero if any failed.
+#
+
+SIM=./apex_sim
+DIR=tests
+TMP=${TMPDIR:-/tmp}/apex_tests.$$
+failed=0
+
+mkdir -p "$TMP"
+trap 'rm -rf "$TMP"' EXIT
+
+pass()
+{
+    echo "PASS: $1"
+}
+
+fail()
+{
+    echo "FAIL: $1"
+    failed=1
+}
+
+# Final registers and data memory of a run
+arch_state()
+{
+    "$SIM" "$@" --log summary 2>/dev/null | grep -E '^(Reg|MEM)\['
+}
+
+#
+# A load outside data memory traps without writing its destination, the
+# same in the pipeline, the out-of-order core and the functional engine
+#
+arch_state "$DIR/load_trap.asm" simulate 100 > "$TMP/pipeline"
+for opts in "--ooo 1" "--functional" "--functional --tcache" \
+            "--skip 3" "--skip 3 --tcache"
+do
+    arch_state "$DIR/load_trap.asm" simulate 100 $opts > "$TMP/state"
+    if grep -q 'Reg\[1\] | Value = 5 ' "$TMP/state" \
+       && cmp -s "$TMP/pipeline" "$TMP/state"
+    then
+        pass "load_trap $opts"
+    else
+        fail "load_trap $opts"
+    fi
+done
+
+#
+# Stopping at the trap inside a partly executed translated block, the engine
+# counts the same instructions it fast-forwarded
+#
+for opts in "--skip 3" "--skip 3 --tcache"
+do
+    "$SIM" "$DIR/load_trap.asm" simulate 100 --log summary $opts \
+        > "$TMP/out" 2>&1
+    executed=$(sed -n 's/.*engine executed \([0-9]*\) .*/\1/p' "$TMP/out")
+    forwarded=$(sed -n 's/.*Fast-forwarded \([0-9]*\) .*/\1/p' "$TMP/out")
+    if [ "$executed" = 2 ] && [ "$forwarded" = 2 ]
+    then
+        pass "load_trap count $opts"
+    else
+        fail "load_trap count $opts"
+    fi
+done
+
+#
+# A program without HALT runs off the end of code memory; fetch stops there
+# and the cycles left run with an empty pipeline
+#
+for opts in "" "--ooo 1" "--width 4" "--functional" \
+            "--sample-period 4 --sample-window 2 --sample-warmup 0" \
+            "--sample-period 4 --sample-window 2 --sample-warmup 0 --tcache"
+do
+    if arch_state "$DIR/no_halt.asm" simulate 50 $opts > "$TMP/state" \
+       && grep -q 'Reg\[3\] | Value = 3 ' "$TMP/state"
+    then
+        pass "no_halt $opts"
+    else
+        fail "no_halt $opts"
+    fi
+done
+
+#
+# apex_trace prints a binary trace exactly as the simulator prints the
+# stages and registers of every cycle, whatever number of records a cycle has
+#
+trace_matches()
+{
+    "$SIM" "$DIR/trace_loop.asm" simulate 2000 --log full "$@" 2>/dev/null \
+        | awk '/^Clock Cycle #: 0$/ { p = 1; print "--------------------------------------------" }
+               /^APEX_CPU: Simulation/ { p = 0 }
+               p' > "$TMP/text"
+    "$SIM" "$DIR/trace_loop.asm" simulate 2000 --log full \
+        --trace "$TMP/trace" "$@" > /dev/null 2>&1
+    ./apex_trace "$TMP/trace" > "$TMP/decoded"
+    test -s "$TMP/text" && cmp -s "$TMP/text" "$TMP/decoded"
+}
+
+for opts in "" "--ooo 1" "--ooo 1 --trace-delta" "--width 4" \
+    "--ooo 1 --width 4 --bpred gshare"
+do
+    if trace_matches $opts
+    then
+        pass "trace $opts"
+    else
+        fail "trace $opts"
+    fi
+done
+
+exit $failed
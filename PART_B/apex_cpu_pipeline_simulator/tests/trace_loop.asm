@@ -0,0 +1,20 @@
+MOVC R1,#7
+MOVC R2,#0
+MOVC R3,#40
+MOVC R4,#1
+MOVC R6,#0
+MUL R8,R4,R4
+MUL R8,R8,R4
+DIV R9,R8,R4
+ADD R10,R2,R9
+STORE R1,R10,#4
+LOAD R5,R2,#5
+ADD R6,R6,R5
+STORE R5,R2,#8
+LOAD R11,R2,#8
+ADD R6,R6,R11
+ADDL R1,R1,#3
+ADDL R2,R2,#1
+CMP R2,R3
+BNZ #-56
+HALT